@@ -0,0 +1,250 @@
+//
+//  BatchRenderer.cpp
+//  image-browser
+//
+
+#include "BatchRenderer.h"
+#include "Collage.h"
+#include "Log.h"
+#include "Trace.h"
+#include "WorkQueue.h"
+#include <fstream>
+#include <sstream>
+
+namespace {
+
+double ElapsedMs(int64 start) {
+  return (cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency();
+}
+
+bool EndsWith(const std::string& str, const std::string& suffix) {
+  return (str.size() >= suffix.size()) &&
+         (0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix));
+}
+
+class BatchItem : public WorkItem {
+public:
+  explicit BatchItem(BatchJob* job) : job_(job) {}
+  virtual void Run() {
+    RunBatchJob(job_);
+  }
+private:
+  BatchJob* job_;
+};
+
+}  // namespace
+
+bool IsCollageStyle(char style) {
+  return std::string("pmeoci").find(style) != std::string::npos;
+}
+
+bool IsCollageStyleList(const std::string& styles) {
+  if (styles.empty())
+    return false;
+  for (int i = 0; i < static_cast<int>(styles.size()); ++i) {
+    if (!IsCollageStyle(styles[i]) || (styles.find(styles[i]) != static_cast<size_t>(i)))
+      return false;
+  }
+  return true;
+}
+
+std::string StyleOutputPath(const std::string& output_path, char style) {
+  size_t dot = output_path.rfind('.');
+  size_t slash = output_path.rfind('/');
+  if ((std::string::npos == dot) ||
+      ((std::string::npos != slash) && (dot < slash)))
+    dot = output_path.size();
+  return output_path.substr(0, dot) + "_" + style + output_path.substr(dot);
+}
+
+bool ReadManifest(const std::string& manifest_path, std::vector<BatchJob>* jobs) {
+  std::ifstream manifest(manifest_path.c_str());
+  if (!manifest.is_open()) {
+    LOG(LOG_ERROR, "cannot open manifest " << manifest_path);
+    return false;
+  }
+  jobs->clear();
+  std::string line;
+  int line_num = 0;
+  while (std::getline(manifest, line)) {
+    ++line_num;
+    std::istringstream fields(line);
+    BatchJob job;
+    job.line_ = line_num;
+    if (!(fields >> job.list_path_) || ('#' == job.list_path_[0]))
+      continue;
+    if (!(fields >> job.canvas_size_.width >> job.canvas_size_.height >>
+          job.styles_ >> job.output_path_) ||
+        !IsCollageStyleList(job.styles_) ||
+        ((job.styles_.size() > 1) && (EndsWith(job.output_path_, ".html") ||
+                                      EndsWith(job.output_path_, ".dzi"))) ||
+        (job.canvas_size_.width <= 0) || (job.canvas_size_.height <= 0)) {
+      LOG(LOG_ERROR, "malformed manifest line " << line_num);
+      return false;
+    }
+    fields >> job.border_size_;
+    jobs->push_back(job);
+  }
+  return true;
+}
+
+bool ReadImageList(const std::string& list_path, std::vector<std::string>* image_list) {
+  std::ifstream list(list_path.c_str());
+  if (!list.is_open())
+    return false;
+  image_list->clear();
+  std::string line;
+  while (std::getline(list, line)) {
+    // Strip trailing '\r' of lists written on Windows.
+    if (!line.empty() && ('\r' == line[line.size() - 1]))
+      line.erase(line.size() - 1);
+    if (!line.empty() && ('#' != line[0]))
+      image_list->push_back(line);
+  }
+  return !image_list->empty();
+}
+
+// RunBatchJob() without tracing setup.
+static bool RenderJob(BatchJob* job) {
+  TRACE_SCOPE("job");
+  int64 job_start = cv::getTickCount();
+  job->success_ = false;
+  
+  int64 start = cv::getTickCount();
+  if (job->image_list_.empty() &&
+      !ReadImageList(job->list_path_, &job->image_list_)) {
+    job->error_ = "cannot read image list";
+    job->total_ms_ = ElapsedMs(job_start);
+    return false;
+  }
+  CollageAdvanced collage(job->image_list_);
+  collage.set_tonal_path(job->tonal_path_);
+  collage.set_crop_fit(job->crop_fit_);
+  job->load_ms_ = ElapsedMs(start);
+  
+  start = cv::getTickCount();
+  bool success = collage.CreateCollage(job->canvas_size_, job->border_size_);
+  job->layout_ms_ = ElapsedMs(start);
+  if (!success) {
+    job->error_ = "layout failed";
+    job->total_ms_ = ElapsedMs(job_start);
+    return false;
+  }
+  
+  if (EndsWith(job->output_path_, ".html")) {
+    start = cv::getTickCount();
+    success = (1 == job->styles_.size()) &&
+              collage.OutputHtml(job->styles_[0], job->output_path_,
+                                 job->html_options_);
+    job->render_ms_ = ElapsedMs(start);
+    if (!success)
+      job->error_ = "html output failed";
+  } else if (EndsWith(job->output_path_, ".dzi")) {
+    start = cv::getTickCount();
+    success = (1 == job->styles_.size()) &&
+              collage.OutputDeepZoom(job->styles_[0], job->output_path_,
+                                     job->zoom_options_);
+    job->render_ms_ = ElapsedMs(start);
+    if (!success)
+      job->error_ = "deep zoom output failed";
+  } else if (job->styles_.size() > 1) {
+    // Jobs already run in parallel; the styles of each leaf still fan out.
+    start = cv::getTickCount();
+    std::vector<cv::Mat> canvases;
+    success = collage.OutputCollages(job->styles_, 1, &canvases);
+    job->render_ms_ = ElapsedMs(start);
+    start = cv::getTickCount();
+    {
+      TRACE_SCOPE("encode");
+      for (int s = 0; success && (s < static_cast<int>(canvases.size())); ++s) {
+        success = cv::imwrite(StyleOutputPath(job->output_path_, job->styles_[s]),
+                              canvases[s]);
+      }
+    }
+    job->write_ms_ = ElapsedMs(start);
+    if (!success)
+      job->error_ = "cannot write output";
+  } else {
+    start = cv::getTickCount();
+    cv::Mat canvas = collage.OutputCollage(job->styles_[0]);
+    job->render_ms_ = ElapsedMs(start);
+    start = cv::getTickCount();
+    {
+      TRACE_SCOPE("encode");
+      success = !canvas.empty() && cv::imwrite(job->output_path_, canvas);
+    }
+    job->write_ms_ = ElapsedMs(start);
+    if (!success)
+      job->error_ = "cannot write output";
+  }
+  job->success_ = success;
+  job->total_ms_ = ElapsedMs(job_start);
+  return success;
+}
+
+bool RunBatchJob(BatchJob* job) {
+  if (!Trace::enabled())
+    return RenderJob(job);
+  TraceSession session;
+  bool success = false;
+  {
+    TraceSessionScope session_scope(&session);
+    success = RenderJob(job);
+  }
+  job->layout_attempts_ = static_cast<int>(session.counter("layout_attempts"));
+  if (!job->trace_path_.empty() && !session.WriteChromeTrace(job->trace_path_))
+    LOG(LOG_ERROR, "cannot write trace " << job->trace_path_);
+  return success;
+}
+
+int RunBatch(std::vector<BatchJob>* jobs, int thread_num) {
+  {
+    // Keep at most two jobs waiting per worker, so the queue never holds
+    // more than a few decoded collages at once.
+    WorkQueue queue(thread_num, 2 * thread_num);
+    for (int i = 0; i < static_cast<int>(jobs->size()); ++i) {
+      queue.Push(new BatchItem(&(*jobs)[i]));
+    }
+    queue.Wait();
+  }
+  int failed = 0;
+  for (int i = 0; i < static_cast<int>(jobs->size()); ++i) {
+    if (!(*jobs)[i].success_)
+      ++failed;
+  }
+  return failed;
+}
+
+void WriteBatchReport(const std::vector<BatchJob>& jobs,
+                      double wall_ms,
+                      std::ostream& out) {
+  out << "#line\tstatus\tstyle\twidth\theight\tload_ms\tlayout_ms\t"
+      << "render_ms\twrite_ms\ttotal_ms\tlayout_attempts\toutput" << std::endl;
+  double total_ms = 0;
+  int failed = 0;
+  for (int i = 0; i < static_cast<int>(jobs.size()); ++i) {
+    const BatchJob& job = jobs[i];
+    out << job.line_ << "\t"
+        << (job.success_ ? "ok" : job.error_) << "\t"
+        << job.styles_ << "\t"
+        << job.canvas_size_.width << "\t"
+        << job.canvas_size_.height << "\t"
+        << job.load_ms_ << "\t"
+        << job.layout_ms_ << "\t"
+        << job.render_ms_ << "\t"
+        << job.write_ms_ << "\t"
+        << job.total_ms_ << "\t"
+        << job.layout_attempts_ << "\t"
+        << job.output_path_ << std::endl;
+    total_ms += job.total_ms_;
+    if (!job.success_)
+      ++failed;
+  }
+  out << "#jobs " << jobs.size()
+      << "\tfailed " << failed
+      << "\tjob_ms " << total_ms
+      << "\twall_ms " << wall_ms;
+  if (wall_ms > 0)
+    out << "\tjobs_per_s " << jobs.size() * 1000.0 / wall_ms;
+  out << std::endl;
+}
@@ -0,0 +1,85 @@
+//
+//  BatchRenderer.h
+//  image-browser
+//
+//  Headless collage rendering of a job manifest on a bounded worker pool.
+//
+
+#ifndef __image_browser__BatchRenderer__
+#define __image_browser__BatchRenderer__
+
+#include "Collage.h"
+#include <iostream>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+// One line of a batch manifest:
+//   <image_list> <width> <height> <style> <output> [border]
+// image_list is a text file with one image path per line. style is one of
+// the OutputCollage() types ('p', 'm', 'e', 'o', 'c', 'i'). If output ends
+// with ".html" the collage is written by OutputHtml(), if it ends with
+// ".dzi" by OutputDeepZoom(), otherwise the canvas is saved by
+// cv::imwrite(). Image outputs may list several styles (e.g.
+// "pmc"); they are rendered together by OutputCollages() and saved as
+// StyleOutputPath(output, style). Empty lines and lines starting with '#'
+// are skipped.
+class BatchJob {
+public:
+  BatchJob() {
+    line_ = 0;
+    styles_ = "p";
+    border_size_ = 6;
+    success_ = false;
+    load_ms_ = 0;
+    layout_ms_ = 0;
+    render_ms_ = 0;
+    write_ms_ = 0;
+    total_ms_ = 0;
+    layout_attempts_ = 0;
+    crop_fit_ = false;
+  }
+  int line_;                  // Manifest line number, for the report.
+  std::string list_path_;     // Image list file.
+  std::vector<std::string> image_list_;  // If empty, read from list_path_.
+  cv::Size2i canvas_size_;
+  std::string styles_;        // One or more style codes.
+  std::string output_path_;
+  int border_size_;
+  std::string tonal_path_;    // Required by 'e' and 'o' styles.
+  HtmlOptions html_options_;  // Tile export settings of html jobs.
+  DeepZoomOptions zoom_options_;  // Pyramid settings of dzi jobs.
+  bool crop_fit_;             // CollageAdvanced::set_crop_fit().
+  std::string trace_path_;    // Chrome trace of the job, if Trace::enabled().
+  // Results, filled by RunBatchJob():
+  bool success_;
+  std::string error_;
+  double load_ms_;            // Reading the list and probing aspect ratios.
+  double layout_ms_;          // CreateCollage().
+  double render_ms_;          // OutputCollage(s)(), OutputHtml() or OutputDeepZoom().
+  double write_ms_;           // cv::imwrite().
+  double total_ms_;
+  int layout_attempts_;       // Aspect ratio adjustments (only when tracing).
+};
+
+// True for the style codes OutputCollage() supports.
+bool IsCollageStyle(char style);
+// True for a non-empty string of supported style codes, each at most once.
+bool IsCollageStyleList(const std::string& styles);
+// Output path of one style of a multi-style job: "out.jpg" -> "out_m.jpg".
+std::string StyleOutputPath(const std::string& output_path, char style);
+// Parse a manifest file. Returns false if the file cannot be read or a line
+// is malformed.
+bool ReadManifest(const std::string& manifest_path, std::vector<BatchJob>* jobs);
+// Read an image list: one path per line.
+bool ReadImageList(const std::string& list_path, std::vector<std::string>* image_list);
+// Render a single job and fill in its timings.
+bool RunBatchJob(BatchJob* job);
+// Render all jobs with thread_num workers. Returns the number of failed jobs.
+int RunBatch(std::vector<BatchJob>* jobs, int thread_num);
+// Tab-separated report: a header line, one line per job and a summary line.
+void WriteBatchReport(const std::vector<BatchJob>& jobs,
+                      double wall_ms,
+                      std::ostream& out);
+
+#endif /* defined(__image_browser__BatchRenderer__) */
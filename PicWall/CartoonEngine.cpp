@@ -7,6 +7,7 @@
 //
 
 #include "CartoonEngine.h"
+#include "Trace.h"
 
 bool CartoonEngine::Convert2Cartoon(int iter_num,
                                     int d,
@@ -14,6 +15,7 @@ bool CartoonEngine::Convert2Cartoon(int iter_num,
                                     double sigma_space,
                                     double max_gradient,
                                     double min_edge_strength) {
+  TRACE_SCOPE("Convert2Cartoon");
   // Step 1: bilateral filter the original image.
   if(!Bilateral2(iter_num, d, sigma_color, sigma_space))
     return false;
@@ -56,8 +58,9 @@ cv::Mat CartoonEngine::ImageAbstraction(double max_gradient,
 //    }
 //  }
 //  return edge_map;
-  CoherentLine cl(image_);
-  return cl.fdog_edge();
+  if (cl_.empty())
+    cl_ = new CoherentLine(image_);
+  return cl_->fdog_edge();
 }
 
 
@@ -165,6 +168,7 @@ bool CartoonEngine::LuminanceQuantization(cv::Mat* luminance, int levels){
 }
 
 bool CartoonEngine::Convert2Painting(int neighbor, int levels) {
+  TRACE_SCOPE("Convert2Painting");
   if ((image_.empty()) || (CV_8UC3 != image_.type()))
     return false;
   
@@ -30,15 +30,12 @@ public:
     }
   }
   explicit CartoonEngine(const cv::Mat& image) {
-    if (!image.empty()) {
-      if (3 == image.channels()) {
-        image.copyTo(image_);
-      } else {
-        cv::cvtColor(image, image_, CV_GRAY2BGR);
-      }
-      rows_ = image_.rows;
-      cols_ = image_.cols;
-    }
+    SetImage(image);
+  }
+  // Reuse the edge analysis of image, e.g. shared with a MangaEngine.
+  CartoonEngine(const cv::Mat& image, const cv::Ptr<CoherentLine>& cl)
+  : cl_(cl) {
+    SetImage(image);
   }
   
   // Accessers:
@@ -66,6 +63,18 @@ public:
   }
   
 private:
+  void SetImage(const cv::Mat& image) {
+    if (!image.empty()) {
+      if (3 == image.channels()) {
+        image.copyTo(image_);
+      } else {
+        cv::cvtColor(image, image_, CV_GRAY2BGR);
+      }
+      rows_ = image_.rows;
+      cols_ = image_.cols;
+    }
+  }
+  
   // A: do bilateral filter for R, G, and B channels.
   bool Bilateral(int iter_num,
                  int d,
@@ -82,6 +91,7 @@ private:
   cv::Mat ImageAbstraction(double max_gradient, double min_edge_strength);
   // Luminance quantization.
   bool LuminanceQuantization(cv::Mat* luminance, int levels);
+  cv::Ptr<CoherentLine> cl_;  // Edge analysis of image_, built on demand.
   cv::Mat image_;      // Original input image.
   cv::Mat cartoon_;    // Converted cartoon image.
   cv::Mat painting_;   // COnverted oil painting image.
@@ -7,6 +7,8 @@
 //
 
 #include "CoherentLine.h"
+#include "Log.h"
+#include "Trace.h"
 
 #define	 DISCRETE_FILTER_SIZE	2048
 #define  LOWPASS_FILTR_LENGTH	10.00000f
@@ -61,6 +63,7 @@ static void GetDiffGaussianWeights(float* weights,
 }
 
 void CoherentLine::GetEdegTangentFlow() {
+  TRACE_SCOPE("ETF");
   // Step 1: Cclculate the structure tensor.
   cv::Mat st;  // CV_32FC3 (E, G, F)
   CalcStructureTensor(&st);
@@ -114,21 +117,22 @@ void CoherentLine::GetDogEdge() {
       }
     }
   }
-  cv::imshow("dog_edge", dog_edge());
-  cv::waitKey();
+  Log::DebugImage("dog_edge", dog_edge_);
 }
 
 void CoherentLine::GetFDogEdge() {
+  TRACE_SCOPE("FDoG");
   if (etf_.empty()) {
     GetEdegTangentFlow();
-    cout << "EFT calculation finished." << endl;
+    LOG(LOG_DEBUG, "ETF calculation finished.");
   }
   fdog_edge_ = cv::Mat::zeros(rows_, cols_, CV_32FC1);
   // Step 1: do DoG along the gradient direction.
   cv::Mat f0(rows_, cols_, CV_32FC1);
   cv::Mat f1(rows_, cols_, CV_32FC1);
   cv::Mat u0(rows_, cols_, CV_8UC1);
-  cv::Mat u1(rows_, cols_, CV_8UC1);
+  fdog_mask_ = cv::Mat::zeros(rows_, cols_, CV_8UC1);
+  cv::Mat& u1 = fdog_mask_;
   float sigma_e = 1.0;
   float sigma_r = 1.6;
   float sigma_m = 3.0;
@@ -379,8 +383,7 @@ void CoherentLine::VisualizeByLIC(const cv::Mat& vf) {
     }
   }
   
-  cv::imshow("Visualized Field", show_field);
-  cv::waitKey();
+  Log::DebugImage("field_lic", show_field);
 }
 
 void CoherentLine::VisualizeByArrow(const cv::Mat &vf) {
@@ -410,13 +413,11 @@ void CoherentLine::VisualizeByArrow(const cv::Mat &vf) {
       }
     }
   }
-  cv::imshow("Visualized Field", show_filed);
-  cv::waitKey();
+  Log::DebugImage("field_arrow", show_filed);
 }
 
 void CoherentLine::GetCannyEdge() {
   cv::Canny(gray_, canny_edge_, 60, 120);
   canny_edge_ = 255 - canny_edge_;
-  cv::imshow("Canny", canny_edge_);
-  cv::waitKey();
+  Log::DebugImage("canny", canny_edge_);
 }
@@ -32,6 +32,7 @@
 #include <iterator>
 #include <queue>
 #include <opencv2/opencv.hpp>
+#include "Log.h"
 
 using std::map;
 using std::pair;
@@ -50,7 +51,7 @@ public:
     cols_ = gray_.cols;
     cv::bilateralFilter(image_, bimage_, 6, 150, 150);
     cv::cvtColor(bimage_, bgray_, CV_BGR2GRAY);
-    cout << "CoherentLine object constructed." << endl;
+    LOG(LOG_DEBUG, "CoherentLine object constructed.");
   }
   CoherentLine(const cv::Mat& image) {
     srand (static_cast<unsigned int>(time(NULL)));
@@ -60,7 +61,7 @@ public:
     cols_ = gray_.cols;
     cv::bilateralFilter(image_, bimage_, 6, 150, 150);
     cv::cvtColor(bimage_, bgray_, CV_BGR2GRAY);
-    cout << "CoherentLine object constructed." << endl;
+    LOG(LOG_DEBUG, "CoherentLine object constructed.");
   }
   // Accessors:
   const int rows() const {
@@ -90,6 +91,12 @@ public:
       GetFDogEdge();
     return fdog_edge_;
   }
+  // Binary FDoG edge mask, CV_8UC1: 0 for edges, 255 otherwise.
+  const cv::Mat& fdog_mask() {
+    if (fdog_mask_.empty())
+      GetFDogEdge();
+    return fdog_mask_;
+  }
   const cv::Mat& canny_edge() {
     if (canny_edge_.empty())
       GetCannyEdge();
@@ -108,6 +115,7 @@ private:
   cv::Mat etf_;           // edge tangent flow.
   cv::Mat dog_edge_;      // edge response by using DoG operation.
   cv::Mat fdog_edge_;     // blur dog edge with edge tangent flow.
+  cv::Mat fdog_mask_;     // fdog_edge_ as CV_8UC1 (0/255).
   cv::Mat canny_edge_;    // canny edge detection.
   
   // Functions:
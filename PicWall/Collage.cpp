@@ -7,29 +7,233 @@
 //
 
 #include "Collage.h"
+#include "ContentHash.h"
+#include "CropFit.h"
+#include "ImagePrefetcher.h"
+#include "ImageStore.h"
+#include "Log.h"
+#include "TileCache.h"
+#include "Trace.h"
+#include "WorkQueue.h"
+#include <algorithm>
+#include <cstdio>
+#include <map>
+#include <set>
 #include <math.h>
-#include <fstream>
 #include <iostream>
+#include <sstream>
 #include <sys/stat.h>
 
 
+// File name suffix of html tiles, without the extension.
+static std::string TileSuffix(const char type) {
+  switch (type) {
+    case 'p': return "_photo";
+    case 'm': return "_manga";
+    case 'e': return "_pencil";
+    case 'o': return "_color_pencil";
+    case 'c': return "_cartoon";
+    case 'i': return "_painting";
+    default: return "";
+  }
+}
+
+// Render one tile of style type from image into tile, which keeps its size
+// and CV_8UC3 type (e.g. a canvas ROI). cl, if not empty, is the edge
+// analysis of image shared by the manga and cartoon engines. Returns false,
+// leaving tile as is, for an unsupported style or if the engine fails.
+static bool RenderTile(const char type,
+                       const cv::Mat& image,
+                       const cv::Ptr<TonalTexture>& tonal,
+                       const cv::Ptr<CoherentLine>& cl,
+                       cv::Mat* tile) {
+  switch (type) {
+    case 'p': {
+      // Create a photo collage.
+      cv::resize(image, *tile, tile->size());
+      break;
+    }
+    case 'm': {
+      // Create a manga collage.
+      std::auto_ptr<MangaEngine>
+      manga_engine(cl.empty() ? new MangaEngine(image) : new MangaEngine(image, cl));
+      manga_engine->set_fixed_point(true);
+      // The CV_8UC1 manga is resized, then expanded to BGR in the canvas.
+      if (!manga_engine->Convert2Manga() || !manga_engine->OutputBGR(tile))
+        return false;
+      break;
+    }
+    case 'c': {
+      // Create a cartoon manga.
+      std::auto_ptr<CartoonEngine>
+      cartoon_engine(cl.empty() ? new CartoonEngine(image) :
+                     new CartoonEngine(image, cl));
+      if (!cartoon_engine->Convert2Cartoon())
+        return false;
+      cv::Mat cartoon_img = cartoon_engine->cartoon();
+      cv::resize(cartoon_img, *tile, tile->size());
+      break;
+    }
+    case 'e': {
+      // Create a pencil sketch collage.
+      std::auto_ptr<SketchEngine>
+      sketch_engine(new SketchEngine(image, tonal));
+      if (!sketch_engine->Convert2Sketch())
+        return false;
+      cv::Mat pencil_img = sketch_engine->pencil_sketch();
+      cv::cvtColor(pencil_img, pencil_img, CV_GRAY2BGR);
+      cv::resize(pencil_img, *tile, tile->size());
+      break;
+    }
+    case 'o': {
+      // Create a color pencil sketch collage.
+      std::auto_ptr<SketchEngine>
+      sketch_engine(new SketchEngine(image, tonal));
+      if (!sketch_engine->Convert2Sketch())
+        return false;
+      cv::Mat color_pencil_img = sketch_engine->color_sketch();
+      cv::resize(color_pencil_img, *tile, tile->size());
+      break;
+    }
+    case 'i': {
+      // Create an oil painting collage.
+      std::auto_ptr<CartoonEngine>
+      painting_engine(new CartoonEngine(image));
+      if (!painting_engine->Convert2Painting())
+        return false;
+      cv::Mat painting_img = painting_engine->painting();
+      cv::resize(painting_img, *tile, tile->size());
+      break;
+    }
+    default: {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Non-photorealistic rendering of one html tile, with a white frame.
+// Returns false for an unsupported style or if the engine fails.
+static bool RenderFramedTile(const char type,
+                             const cv::Mat& image,
+                             const cv::Ptr<TonalTexture>& tonal,
+                             cv::Mat* framed) {
+  // *********Non-photorealistic rendering*******
+  cv::Mat img;
+  switch (type) {
+    case 'p': {
+      // Photo collage.
+      image.copyTo(img);
+      break;
+    }
+    case 'm': {
+      // Manga collage.
+      std::auto_ptr<MangaEngine> manga_engine(new MangaEngine(image));
+      manga_engine->set_fixed_point(true);
+      if (!manga_engine->Convert2Manga())
+        return false;
+      // manga_img is CV_8UC1 type, we convert it to CV_8UC3.
+      cv::cvtColor(manga_engine->manga(), img, CV_GRAY2BGR);
+      break;
+    }
+    case 'e': {
+      // Pencil sketch collage.
+      std::auto_ptr<SketchEngine>
+      sketch_engine(new SketchEngine(image, tonal));
+      if (!sketch_engine->Convert2Sketch())
+        return false;
+      img = sketch_engine->pencil_sketch();
+      cv::cvtColor(img, img, CV_GRAY2BGR);
+      break;
+    }
+    case 'o': {
+      // Color pencil sketch.
+      std::auto_ptr<SketchEngine>
+      sketch_engine(new SketchEngine(image, tonal));
+      if (!sketch_engine->Convert2Sketch())
+        return false;
+      img = sketch_engine->color_sketch();
+      break;
+    }
+    case 'c': {
+      // Cartoon collage.
+      std::auto_ptr<CartoonEngine>
+      cartoon_engine(new CartoonEngine(image));
+      if (!cartoon_engine->Convert2Cartoon())
+        return false;
+      img = cartoon_engine->cartoon();
+      break;
+    }
+    case 'i': {
+      // Oil painting collage.
+      std::auto_ptr<CartoonEngine>
+      painting_engine(new CartoonEngine(image));
+      if (!painting_engine->Convert2Painting())
+        return false;
+      img = painting_engine->painting();
+      break;
+    }
+    default: {
+      return false;
+    }
+  }
+  // ****************Add border******************
+  int border = std::max(img.rows, img.cols) / 30;
+  int new_height = img.rows - border * 2;
+  int new_width = img.cols - border * 2;
+  cv::Rect content_rect(border, border, new_width, new_height);
+  cv::Mat new_img(img.rows, img.cols, CV_8UC3, cv::Scalar::all(255));
+  cv::Mat roi(new_img, content_rect);
+  cv::resize(img, img, cv::Size2i(new_width, new_height));
+  img.copyTo(roi);
+  cv::rectangle(new_img, content_rect, cv::Scalar::all(0), border / 5);
+  *framed = new_img;
+  return true;
+}
+
 bool less_than(AlphaUnit m, AlphaUnit n) {
   return m.alpha_ < n.alpha_;
 }
 CollageAdvanced::CollageAdvanced(std::vector<std::string> input_image_list) {
+  // Only the dimensions are needed here; ImageStore keeps the decoded
+  // image for the output stage.
+  std::vector<cv::Size2i> image_sizes;
   for (int i = 0; i < input_image_list.size(); ++i) {
-    std::string img_path = input_image_list[i];
-    cv::Mat img = cv::imread(img_path.c_str());
+    image_sizes.push_back(ImageStore::Instance()->GetSize(input_image_list[i]));
+  }
+  Init(input_image_list, image_sizes);
+}
+
+CollageAdvanced::CollageAdvanced(const std::vector<std::string>& input_image_list,
+                                 const std::vector<cv::Size2i>& image_sizes) {
+  Init(input_image_list, image_sizes);
+}
+
+void CollageAdvanced::Init(const std::vector<std::string>& input_image_list,
+                           const std::vector<cv::Size2i>& image_sizes) {
+  assert(input_image_list.size() == image_sizes.size());
+  for (int i = 0; i < static_cast<int>(input_image_list.size()); ++i) {
+    const cv::Size2i& img_size = image_sizes[i];
     AlphaUnit new_unit;
     new_unit.image_ind_ = i;
-    new_unit.alpha_ = static_cast<float>(img.cols) / img.rows;
-    new_unit.alpha_recip_ = static_cast<float>(img.rows) / img.cols;
-    new_unit.image_path_ = img_path;
+    new_unit.alpha_ = static_cast<float>(img_size.width) / img_size.height;
+    new_unit.alpha_recip_ = static_cast<float>(img_size.height) / img_size.width;
+    new_unit.image_path_ = input_image_list[i];
     image_alpha_vec_.push_back(new_unit);
   }
   canvas_width_ = -1;
   canvas_alpha_ = -1;
   canvas_height_ = -1;
+  prefetch_budget_ = PREFETCH_BUDGET;
+  weighted_layout_ = false;
+  tree_generation_ = 0;
+  root_split_ = 'N';
+  crop_fit_ = false;
+  layout_size_ = cv::Size2i(0, 0);
+  layout_border_ = 0;
+  layout_threshold_ = 1.1;
+  layout_manga_mode_ = false;
+  layout_style_ = 'u';
   image_num_ = static_cast<int>(input_image_list.size());
   srand(static_cast<unsigned>(time(0)));
   tree_root_ = new TreeNode();
@@ -39,10 +243,18 @@ int CollageAdvanced::CreateCollage(int width,
                                    float expect_alpha,
                                    float thresh
                                    ) {
+  TRACE_SCOPE("CreateCollage");
   assert(width > 0);
   assert(thresh > 1);
   assert(expect_alpha > 0);
   canvas_width_ = width;
+  // Positions follow the left-to-right reading order.
+  layout_size_ = cv::Size2i(width, std::max(1, cvRound(width / expect_alpha)));
+  layout_border_ = 0;
+  layout_threshold_ = thresh;
+  layout_manga_mode_ = false;
+  layout_style_ = 'u';
+  root_split_ = 'N';
   tree_root_->alpha_expect_ = expect_alpha;
   float lower_bound = expect_alpha / thresh;
   float upper_bound = expect_alpha * thresh;
@@ -52,7 +264,14 @@ int CollageAdvanced::CreateCollage(int width,
   // Step 1: Sort the image_alpha_ vector fot generate guided binary tree.
   std::sort(image_alpha_vec_.begin(), image_alpha_vec_.end(), less_than);
   // Step 2: Generate a guided binary tree by using divide-and-conquer.
-  GenerateTree(expect_alpha);
+  // Trees that cannot reach the bounds are dropped before adjusting them.
+  if (!ResolvePins())
+    return -1;
+  if (!GenerateFeasibleTree(expect_alpha, lower_bound, upper_bound, &tree_gene_counter)) {
+    LOG(LOG_WARNING, "collage generation failed after " << MAX_TREE_GENE_NUM
+        << " tree generations");
+    return -1;
+  }
   // Step 3: Calculate the actual aspect ratio for the generated collage.
   canvas_alpha_ = CalculateAlpha(tree_root_);
   
@@ -63,36 +282,31 @@ int CollageAdvanced::CreateCollage(int width,
     tree_root_->alpha_expect_ = expect_alpha;
     bool changed = false;
     changed = AdjustAlpha(tree_root_, thresh);
+    TRACE_COUNTER("layout_attempts", 1);
     // Calculate actual aspect ratio again.
     canvas_alpha_ = CalculateAlpha(tree_root_);
     ++iter_counter;
     ++total_iter_counter;
     if ((iter_counter > MAX_ITER_NUM) || (!changed)) {
-      std::cout << "********************************************" << std::endl;
       if (changed) {
-        std::cout << "max iteration number reached..." << std::endl;
+        LOG(LOG_DEBUG, "max iteration number reached, regenerating tree");
       } else {
-        std::cout << "tree structure unchanged after iteration: "
-        << iter_counter << std::endl;
+        LOG(LOG_DEBUG, "tree structure unchanged after iteration: " << iter_counter);
       }
-      std::cout << "********************************************" << std::endl;
       // We should generate binary tree again
       iter_counter = 1;
       ++total_iter_counter;
       /*************************************************************************/
       
-      GenerateTree(expect_alpha);
-      canvas_alpha_ = CalculateAlpha(tree_root_);
       ++tree_gene_counter;
-      if (tree_gene_counter > MAX_TREE_GENE_NUM) {
-        std::cout << "-------------------------------------------------------";
-        std::cout << std::endl;
-        std::cout << "WE HAVE DONE OUR BEST, BUT COLAAGE GENERATION FAILED...";
-        std::cout << std::endl;
-        std::cout << "-------------------------------------------------------";
-        std::cout << std::endl;
+      if ((tree_gene_counter > MAX_TREE_GENE_NUM) ||
+          !GenerateFeasibleTree(expect_alpha, lower_bound, upper_bound,
+                                &tree_gene_counter)) {
+        LOG(LOG_WARNING, "collage generation failed after " << MAX_TREE_GENE_NUM
+            << " tree generations");
         return -1;
       }
+      canvas_alpha_ = CalculateAlpha(tree_root_);
     }
   }
   canvas_height_ = static_cast<int>(canvas_width_ / canvas_alpha_);
@@ -123,8 +337,10 @@ cv::Mat CollageAdvanced::OutputCollageImage() const {
     cv::Rect pos_cv(pos.x_, pos.y_, pos.width_, pos.height_);
     cv::Mat roi(canvas, pos_cv);
     cv::Mat resized_img(pos_cv.height, pos_cv.width, CV_8UC3);
-    cv::Mat image = cv::imread(tree_leaves_[i]->img_path_.c_str());
+    cv::Mat image = ImageStore::Instance()->Get(tree_leaves_[i]->img_path_);
     assert(image.type() == CV_8UC3);
+    if (crop_fit_)
+      image = image(SaliencyCrop(image, resized_img.size()));
     cv::resize(image, resized_img, resized_img.size());
     resized_img.copyTo(roi);
   }
@@ -134,51 +350,7 @@ cv::Mat CollageAdvanced::OutputCollageImage() const {
 // After calling CreateCollage(), call this function to save result
 // collage to a html file specified by out_put_html_path.
 bool CollageAdvanced::OutputCollageHtml(const std::string output_html_path) {
-  assert(canvas_alpha_ != -1);
-  assert(canvas_width_ != -1);
-  std::ofstream output_html(output_html_path.c_str());
-  if (!output_html) {
-    std::cout << "Error: OutputCollageHtml" << std::endl;
-  }
-  
-  output_html << "<!DOCTYPE html>\n";
-  output_html << "<html>\n";
-  output_html << "<script src=\"/Users/wu/Softwares/prettyPhoto_uncompressed_3.1.5/js/jquery-1.6.1.min.js\" type=\"text/javascript\" charset=\"utf-8\"></script> <link rel=\"stylesheet\" href=\"/Users/wu/Softwares/prettyPhoto_uncompressed_3.1.5/css/prettyPhoto.css\" type=\"text/css\" media=\"screen\" charset=\"utf-8\" /> <script src=\"/Users/wu/Softwares/prettyPhoto_uncompressed_3.1.5/js/jquery.prettyPhoto.js\" type=\"text/javascript\" charset=\"utf-8\"></script>\n";
-  output_html << "<style type=\"text/css\">\n";
-  output_html << "body {background-image:url(/Users/WU/Projects/2012Collage/JMM_Demo/bg_resize.png);  background-position: top; background-repeat:repeat-x; background-attachment:fixed}\n";
-  output_html << "</style>\n";
-  output_html << "\t<body>\n";
-  output_html << "<script type=\"text/javascript\" charset=\"utf-8\"> $(document).ready(function(){$(\"a[rel^='prettyPhoto']\").prettyPhoto();});</script>";
-  output_html << "\t\t<div style=\"margin:20px auto; width:70%; position:relative;\">\n";
-  for (int i = 0; i < image_num_; ++i) {
-    output_html << "\t\t\t<a href=\"";
-    output_html << tree_leaves_[i]->img_path_;
-    output_html << "\" rel=\"prettyPhoto[pp_gal]\">\n";
-    output_html << "\t\t\t\t<img src=\"";
-    output_html << tree_leaves_[i]->img_path_;
-    output_html << "\" style=\"position:absolute; width:";
-    output_html << tree_leaves_[i]->position_.width_ - 1;
-    output_html << "px; height:";
-    output_html << tree_leaves_[i]->position_.height_ - 1;
-    output_html << "px; left:";
-    output_html << tree_leaves_[i]->position_.x_ - 1;
-    output_html << "px; top:";
-    output_html << tree_leaves_[i]->position_.y_ - 1;
-    output_html << "px;\">\n";
-    output_html << "\t\t\t</a>\n";
-  }
-  output_html << "\t\t</div>\n";
-  //  output_html << "\t\t<div style=\"text-align:center\">\n";
-  //  output_html << "\t\t<p style=\"position:relative; top:";
-  //  output_html << canvas_height() << "px\">\n";
-  //  output_html << "\t\t\t<a href=\"   \"><-Back</a>\n";
-  //  output_html << "\t\t\t&nbsp&nbsp&nbsp&nbsp&nbsp&nbsp";
-  //  output_html << "\t\t\t<a href=\"   \">Next-></a>\n</p>\n";
-  //  output_html << "\t\t</div>\n";
-  output_html << "\t</body>\n";
-  output_html << "</html>";
-  output_html.close();
-  return true;
+  return OutputHtml('p', output_html_path, HtmlOptions());
 }
 
 
@@ -189,6 +361,7 @@ float CollageAdvanced::CalculateAlpha(TreeNode* node) {
   if (!node->is_leaf_) {
     float left_alpha = CalculateAlpha(node->left_child_);
     float right_alpha = CalculateAlpha(node->right_child_);
+    node->weight_ = node->left_child_->weight_ + node->right_child_->weight_;
     if (node->split_type_ == 'v') {
       node->alpha_ = left_alpha + right_alpha;
       return node->alpha_;
@@ -196,7 +369,7 @@ float CollageAdvanced::CalculateAlpha(TreeNode* node) {
       node->alpha_ = (left_alpha * right_alpha) / (left_alpha + right_alpha);
       return node->alpha_;
     } else {
-      std::cout << "Error: CalculateAlpha" << std::endl;
+      LOG(LOG_ERROR, "CalculateAlpha");
       return -1;
     }
   } else {
@@ -217,7 +390,7 @@ bool CollageAdvanced::CalculatePositions(TreeNode* node) {
       node->position_.width_ = node->parent_->position_.width_ -
       node->parent_->left_child_->position_.width_;
     } else {
-      std::cout << "Error: CalculatePositions step 0" << std::endl;
+      LOG(LOG_ERROR, "CalculatePositions step 0");
       return false;
     }
   } else if (node->parent_->split_type_ == 'h') {
@@ -230,7 +403,7 @@ bool CollageAdvanced::CalculatePositions(TreeNode* node) {
       node->parent_->left_child_->position_.height_;
     }
   } else {
-    std::cout << "Error: CalculatePositions step 1" << std::endl;
+    LOG(LOG_ERROR, "CalculatePositions step 1");
     return false;
   }
   
@@ -253,10 +426,10 @@ bool CollageAdvanced::CalculatePositions(TreeNode* node) {
       node->parent_->position_.height_ -
       node->position_.height_;
     } else {
-      std::cout << "Error: CalculatePositions step 2 - 1" << std::endl;
+      LOG(LOG_ERROR, "CalculatePositions step 2 - 1");
     }
   } else {
-    std::cout << "Error: CalculatePositions step 2 - 2" << std::endl;
+    LOG(LOG_ERROR, "CalculatePositions step 2 - 2");
     return false;
   }
   
@@ -282,19 +455,45 @@ void CollageAdvanced::ReleaseTree(TreeNode* node) {
 }
 
 void CollageAdvanced::GenerateTree(float expect_alpha) {
-  if (tree_root_) ReleaseTree(tree_root_);
+  TRACE_SCOPE("GenerateTree");
+  TRACE_COUNTER("tree_generations", 1);
+  ReleaseTree(tree_root_);
+  tree_root_ = NULL;
   tree_leaves_.clear();
   // Copy image_alpha_vec_ for local computation.
+  // Pinned images are placed by rank and left out of the pool.
   std::vector<AlphaUnit> local_alpha;
+  std::map<std::string, int> pinned_paths;
+  for (std::map<int, AlphaUnit>::const_iterator it = pinned_leaves_.begin();
+       it != pinned_leaves_.end(); ++it) {
+    ++pinned_paths[it->second.image_path_];
+  }
+  weighted_layout_ = false;
   for (int i = 0; i < image_alpha_vec_.size(); ++i) {
+    if (image_alpha_vec_[i].weight_ != image_alpha_vec_[0].weight_)
+      weighted_layout_ = true;
+    std::map<std::string, int>::iterator pin = pinned_paths.find(image_alpha_vec_[i].image_path_);
+    if ((pin != pinned_paths.end()) && (pin->second > 0)) {
+      --pin->second;
+      continue;
+    }
     local_alpha.push_back(image_alpha_vec_[i]);
   }
   
   // Generate a new tree by using divide-and-conquer.
-  tree_root_ = GuidedTree(tree_root_, 'N', expect_alpha,
+  tree_root_ = GuidedTree(NULL, 'N', expect_alpha,
                           image_num_, local_alpha, expect_alpha);
   // After guided tree generation, all the images have been dispatched to leaves.
   assert(local_alpha.size() == 0);
+  if (weighted_layout_) {
+    std::map<std::string, float> weights;
+    for (int i = 0; i < static_cast<int>(image_alpha_vec_.size()); ++i) {
+      weights[image_alpha_vec_[i].image_path_] = image_alpha_vec_[i].weight_;
+    }
+    for (int i = 0; i < static_cast<int>(tree_leaves_.size()); ++i) {
+      tree_leaves_[i]->weight_ = weights[tree_leaves_[i]->img_path_];
+    }
+  }
   return;
 }
 
@@ -305,8 +504,12 @@ TreeNode* CollageAdvanced::GuidedTree(TreeNode* parent,
                                       int img_num,
                                       std::vector<AlphaUnit>& alpha_array,
                                       float root_alpha) {
-  if (alpha_array.size() == 0) {
-    std::cout << "Error: GuidedTree 0" << std::endl;
+  // Leaves are created in reading order: this node's first leaf has the
+  // rank of the leaves created so far.
+  int first_leaf = static_cast<int>(tree_leaves_.size());
+  int pinned_num = PinnedLeaves(first_leaf, img_num, NULL);
+  if ((alpha_array.size() == 0) && (pinned_num < img_num)) {
+    LOG(LOG_ERROR, "GuidedTree 0");
     return NULL;
   }
   
@@ -314,21 +517,28 @@ TreeNode* CollageAdvanced::GuidedTree(TreeNode* parent,
   TreeNode* node = new TreeNode();
   node->parent_ = parent;
   node->child_type_ = child_type;
+  bool forced_split = ('N' == child_type) && ('N' != root_split_);
   
   if (img_num == 1) {
     // Set the new node.
     node->is_leaf_ = true;
-    // Find the best fit aspect ratio.
-    bool success = FindOneImage(expect_alpha,
-                                alpha_array,
-                                node->alpha_,
-                                node->img_path_);
-    if (!success) {
-      std::cout << "Error: GuidedTree 1" << std::endl;
-      return NULL;
+    std::map<int, AlphaUnit>::const_iterator pin = pinned_leaves_.find(first_leaf);
+    if (pin != pinned_leaves_.end()) {
+      node->alpha_ = pin->second.alpha_;
+      node->img_path_ = pin->second.image_path_;
+    } else {
+      // Find the best fit aspect ratio.
+      bool success = FindOneImage(expect_alpha,
+                                  alpha_array,
+                                  node->alpha_,
+                                  node->img_path_);
+      if (!success) {
+        LOG(LOG_ERROR, "GuidedTree 1");
+        return NULL;
+      }
     }
     tree_leaves_.push_back(node);
-  } else if (img_num == 2) {
+  } else if ((img_num == 2) && (0 == pinned_num) && !forced_split) {
     // Set the new node.
     node->is_leaf_ = false;
     TreeNode* l_child = new TreeNode();
@@ -352,7 +562,7 @@ TreeNode* CollageAdvanced::GuidedTree(TreeNode* parent,
                                  r_child->alpha_,
                                  r_child->img_path_);
     if (!success) {
-      std::cout << "Error: GuidedTree 2" << std::endl;
+      LOG(LOG_ERROR, "GuidedTree 2");
       return NULL;
     }
     tree_leaves_.push_back(l_child);
@@ -364,6 +574,7 @@ TreeNode* CollageAdvanced::GuidedTree(TreeNode* parent,
     int v_h = random(2);
     if (expect_alpha > root_alpha * 2) v_h = 1;
     if (expect_alpha < root_alpha / 2) v_h = 0;
+    if (forced_split) v_h = ('v' == root_split_) ? 1 : 0;
     if (v_h == 1) {
       node->split_type_ = 'v';
       new_exp_alpha = expect_alpha / 2;
@@ -371,6 +582,52 @@ TreeNode* CollageAdvanced::GuidedTree(TreeNode* parent,
       node->split_type_ = 'h';
       new_exp_alpha = expect_alpha * 2;
     }
+    if (weighted_layout_) {
+      // Each subtree gets its own images, about half of the weight each,
+      // and picks its leaves among them only. Its expected ratio follows
+      // its share of the weight.
+      std::vector<AlphaUnit> left_array;
+      std::vector<AlphaUnit> right_array;
+      PartitionByWeight(alpha_array, -1, tree_generation_, &left_array, &right_array);
+      // Pinned leaves falling into the left range come on top of its
+      // images; repartition if that leaves the left a different number.
+      int left_num = static_cast<int>(left_array.size());
+      int left_leaves = left_num;
+      for (int k = 0; k <= pinned_num; ++k) {
+        left_leaves = left_num + PinnedLeaves(first_leaf, left_leaves, NULL);
+      }
+      left_leaves = std::max(1, std::min(img_num - 1, left_leaves));
+      int left_images = left_leaves - PinnedLeaves(first_leaf, left_leaves, NULL);
+      if (left_images != left_num) {
+        left_array.clear();
+        right_array.clear();
+        PartitionByWeight(alpha_array, left_images, tree_generation_,
+                          &left_array, &right_array);
+      }
+      alpha_array.clear();
+      float left_weight = 0;
+      float right_weight = 0;
+      PinnedLeaves(first_leaf, left_leaves, &left_weight);
+      PinnedLeaves(first_leaf + left_leaves, img_num - left_leaves, &right_weight);
+      for (int i = 0; i < static_cast<int>(left_array.size()); ++i) {
+        left_weight += left_array[i].weight_;
+      }
+      for (int i = 0; i < static_cast<int>(right_array.size()); ++i) {
+        right_weight += right_array[i].weight_;
+      }
+      float left_share = left_weight / (left_weight + right_weight);
+      float right_share = right_weight / (left_weight + right_weight);
+      bool v_split = (node->split_type_ == 'v');
+      node->left_child_ = GuidedTree(node, 'l',
+                                     v_split ? expect_alpha * left_share :
+                                               expect_alpha / left_share,
+                                     left_leaves, left_array, root_alpha);
+      node->right_child_ = GuidedTree(node, 'r',
+                                      v_split ? expect_alpha * right_share :
+                                                expect_alpha / right_share,
+                                      img_num - left_leaves, right_array, root_alpha);
+      return node;
+    }
     int new_img_num_1 = static_cast<int>(img_num / 2);
     int new_img_num_2 = img_num - new_img_num_1;
     if (new_img_num_1 > 0) {
@@ -389,6 +646,65 @@ TreeNode* CollageAdvanced::GuidedTree(TreeNode* parent,
   return node;
 }
 
+namespace {
+
+// Heavier first; equal weights keep the alpha order.
+class WeightIndex {
+public:
+  WeightIndex(float weight, int index) : weight_(weight), index_(index) {}
+  bool operator< (const WeightIndex& other) const {
+    return (weight_ > other.weight_) ||
+           ((weight_ == other.weight_) && (index_ < other.index_));
+  }
+  float weight_;
+  int index_;
+};
+
+}  // namespace
+
+void CollageAdvanced::PartitionByWeight(const std::vector<AlphaUnit>& alpha_array,
+                                        int left_num,
+                                        int rotation,
+                                        std::vector<AlphaUnit>* left_array,
+                                        std::vector<AlphaUnit>* right_array) {
+  // Greedy: the heaviest image left goes to the lighter part. Equal weights
+  // alternate between the parts, so both span the range of ratios.
+  int num = static_cast<int>(alpha_array.size());
+  int left_count = 0;
+  std::vector<WeightIndex> order;
+  for (int i = 0; i < num; ++i) {
+    order.push_back(WeightIndex(alpha_array[i].weight_, i));
+  }
+  std::sort(order.begin(), order.end());
+  for (int begin = 0, end = 0; begin < num; begin = end) {
+    while ((end < num) && (order[end].weight_ == order[begin].weight_)) {
+      ++end;
+    }
+    std::rotate(order.begin() + begin, order.begin() + begin + rotation % (end - begin),
+                order.begin() + end);
+  }
+  std::vector<char> left(num, 0);
+  double left_weight = 0;
+  double right_weight = 0;
+  for (int k = 0; k < num; ++k) {
+    bool to_left = (left_weight <= right_weight);
+    if (left_num < 0) {
+      // Keep one image for the right part.
+      to_left = to_left && (k + 1 < num);
+    } else if (left_count == left_num) {
+      to_left = false;
+    } else if (num - k == left_num - left_count) {
+      to_left = true;
+    }
+    left_count += to_left;
+    left[order[k].index_] = to_left;
+    (to_left ? left_weight : right_weight) += order[k].weight_;
+  }
+  for (int i = 0; i < num; ++i) {
+    (left[i] ? left_array : right_array)->push_back(alpha_array[i]);
+  }
+}
+
 // Find the best-match aspect ratio image in the given array.
 // alpha_array is the array storing aspect ratios.
 // find_img_alpha is the best-match alpha value.
@@ -569,7 +885,8 @@ bool CollageAdvanced::FindTwoImages(float expect_alpha,
   return true;
 }
 
-bool CollageAdvanced::AdjustAlpha(TreeNode *node, float thresh) {
+bool CollageAdvanced::AdjustAlpha(TreeNode *node, float thresh,
+                                  const std::set<const TreeNode*>* path) {
   assert(thresh > 1);
   if (node->is_leaf_) return false;
   if (node == NULL) return false;
@@ -577,34 +894,72 @@ bool CollageAdvanced::AdjustAlpha(TreeNode *node, float thresh) {
   bool changed = false;
   
   float thresh_2 = 1 + (thresh - 1) / 2;
+  // Children are expected to cover halves of the node, or shares in
+  // proportion to their weights once SetImageWeight() made them differ.
+  float left_share = 0.5;
+  float right_share = 0.5;
+  if (weighted_layout_) {
+    left_share = node->left_child_->weight_ /
+                 (node->left_child_->weight_ + node->right_child_->weight_);
+    right_share = node->right_child_->weight_ /
+                  (node->left_child_->weight_ + node->right_child_->weight_);
+  }
   
-  if (node->alpha_ > node->alpha_expect_ * thresh_2) {
+  if ((node == tree_root_) && ('N' != root_split_)) {
+    // The root's split is fixed; only its subtrees adapt.
+    if (node->split_type_ != root_split_) changed = true;
+    node->split_type_ = root_split_;
+    if (node->split_type_ == 'h') {
+      node->left_child_->alpha_expect_ = node->alpha_expect_ / left_share;
+      node->right_child_->alpha_expect_ = node->alpha_expect_ / right_share;
+    } else {
+      node->left_child_->alpha_expect_ = node->alpha_expect_ * left_share;
+      node->right_child_->alpha_expect_ = node->alpha_expect_ * right_share;
+    }
+  } else if (node->alpha_ > node->alpha_expect_ * thresh_2) {
     // Too big actual aspect ratio.
     if (node->split_type_ == 'v') changed = true;
     node->split_type_ = 'h';
-    node->left_child_->alpha_expect_ = node->alpha_expect_ * 2;
-    node->right_child_->alpha_expect_ = node->alpha_expect_ * 2;
+    node->left_child_->alpha_expect_ = node->alpha_expect_ / left_share;
+    node->right_child_->alpha_expect_ = node->alpha_expect_ / right_share;
   } else if (node->alpha_ < node->alpha_expect_ / thresh_2 ) {
     // Too small actual aspect ratio.
     if (node->split_type_ == 'h') changed = true;
     node->split_type_ = 'v';
-    node->left_child_->alpha_expect_ = node->alpha_expect_ / 2;
-    node->right_child_->alpha_expect_ = node->alpha_expect_ / 2;
+    node->left_child_->alpha_expect_ = node->alpha_expect_ * left_share;
+    node->right_child_->alpha_expect_ = node->alpha_expect_ * right_share;
   } else {
     // Aspect ratio is okay.
     if (node->split_type_ == 'h') {
-      node->left_child_->alpha_expect_ = node->alpha_expect_ * 2;
-      node->right_child_->alpha_expect_ = node->alpha_expect_ * 2;
+      node->left_child_->alpha_expect_ = node->alpha_expect_ / left_share;
+      node->right_child_->alpha_expect_ = node->alpha_expect_ / right_share;
     } else if (node->split_type_ == 'v') {
-      node->left_child_->alpha_expect_ = node->alpha_expect_ / 2;
-      node->right_child_->alpha_expect_ = node->alpha_expect_ / 2;
+      node->left_child_->alpha_expect_ = node->alpha_expect_ * left_share;
+      node->right_child_->alpha_expect_ = node->alpha_expect_ * right_share;
     } else {
-      std::cout << "Error: AdjustAlpha" << std::endl;
+      LOG(LOG_ERROR, "AdjustAlpha");
       return false;
     }
   }
-  bool changed_l = AdjustAlpha(node->left_child_, thresh);
-  bool changed_r = AdjustAlpha(node->right_child_, thresh);
+  if (weighted_layout_ && (tree_generation_ > 1) &&
+      (node->left_child_->is_leaf_ != node->right_child_->is_leaf_)) {
+    // A leaf keeps its ratio whatever its share; its sibling is expected
+    // to complete the node instead, or both would be fixed and the node
+    // could never reach its ratio.
+    TreeNode* leaf = node->left_child_->is_leaf_ ? node->left_child_ : node->right_child_;
+    TreeNode* sibling = (leaf == node->left_child_) ? node->right_child_ : node->left_child_;
+    float rest = (node->split_type_ == 'v') ?
+                 node->alpha_expect_ - leaf->alpha_ :
+                 1 / (1 / node->alpha_expect_ - 1 / leaf->alpha_);
+    if (rest > 0)
+      sibling->alpha_expect_ = rest;
+  }
+  bool changed_l = false;
+  bool changed_r = false;
+  if (!path || path->count(node->left_child_))
+    changed_l = AdjustAlpha(node->left_child_, thresh, path);
+  if (!path || path->count(node->right_child_))
+    changed_r = AdjustAlpha(node->right_child_, thresh, path);
   return changed||changed_l||changed_r;
 }
 
@@ -616,8 +971,9 @@ bool CollageAdvanced::CreateCollage (const cv::Size2i canvas_size,
                                      const float threshold,
                                      const bool manga_mode,
                                      const char style) {
+  TRACE_SCOPE("CreateCollage");
   if ((image_num_ <= 0) || canvas_size.width <= 0 || canvas_size.height <= 0) {
-    std::cout << "error in CreateCollage..." << std::endl;
+    LOG(LOG_ERROR, "CreateCollage...");
     return false;
   }
   srand(static_cast<unsigned>(time(0)));
@@ -626,6 +982,13 @@ bool CollageAdvanced::CreateCollage (const cv::Size2i canvas_size,
   canvas_size.height;
   
   canvas_width_ = canvas_size.width;
+  layout_size_ = canvas_size;
+  layout_border_ = border_size;
+  layout_threshold_ = threshold;
+  layout_manga_mode_ = manga_mode;
+  layout_style_ = style;
+  // Manga pages are read band by band, from the top.
+  root_split_ = manga_mode ? 'h' : 'N';
   tree_root_->alpha_expect_ = expect_alpha;
   float lower_bound = expect_alpha / threshold;
   float upper_bound = expect_alpha * threshold;
@@ -635,7 +998,14 @@ bool CollageAdvanced::CreateCollage (const cv::Size2i canvas_size,
   // Step 1: Sort the image_alpha_ vector fot generate guided binary tree.
   std::sort(image_alpha_vec_.begin(), image_alpha_vec_.end(), less_than);
   // Step 2: Generate a guided binary tree by using divide-and-conquer.
-  GenerateTree(expect_alpha);
+  // Trees that cannot reach the bounds are dropped before adjusting them.
+  if (!ResolvePins())
+    return false;
+  if (!GenerateFeasibleTree(expect_alpha, lower_bound, upper_bound, &tree_gene_counter)) {
+    LOG(LOG_WARNING, "collage generation failed after " << MAX_TREE_GENE_NUM
+        << " tree generations");
+    return false;
+  }
   // Step 3: Calculate the actual aspect ratio for the generated collage.
   canvas_alpha_ = CalculateAlpha(tree_root_);
   
@@ -646,36 +1016,31 @@ bool CollageAdvanced::CreateCollage (const cv::Size2i canvas_size,
     tree_root_->alpha_expect_ = expect_alpha;
     bool changed = false;
     changed = AdjustAlpha(tree_root_, threshold);
+    TRACE_COUNTER("layout_attempts", 1);
     // Calculate actual aspect ratio again.
     canvas_alpha_ = CalculateAlpha(tree_root_);
     ++iter_counter;
     ++total_iter_counter;
     if ((iter_counter > MAX_ITER_NUM) || (!changed)) {
-      std::cout << "********************************************" << std::endl;
       if (changed) {
-        std::cout << "max iteration number reached..." << std::endl;
+        LOG(LOG_DEBUG, "max iteration number reached, regenerating tree");
       } else {
-        std::cout << "tree structure unchanged after iteration: "
-        << iter_counter << std::endl;
+        LOG(LOG_DEBUG, "tree structure unchanged after iteration: " << iter_counter);
       }
-      std::cout << "********************************************" << std::endl;
       // We should generate binary tree again
       iter_counter = 1;
       ++total_iter_counter;
       /*************************************************************************/
       
-      GenerateTree(expect_alpha);
-      canvas_alpha_ = CalculateAlpha(tree_root_);
       ++tree_gene_counter;
-      if (tree_gene_counter > MAX_TREE_GENE_NUM) {
-        std::cout << "-------------------------------------------------------";
-        std::cout << std::endl;
-        std::cout << "WE HAVE DONE OUR BEST, BUT COLAAGE GENERATION FAILED...";
-        std::cout << std::endl;
-        std::cout << "-------------------------------------------------------";
-        std::cout << std::endl;
+      if ((tree_gene_counter > MAX_TREE_GENE_NUM) ||
+          !GenerateFeasibleTree(expect_alpha, lower_bound, upper_bound,
+                                &tree_gene_counter)) {
+        LOG(LOG_WARNING, "collage generation failed after " << MAX_TREE_GENE_NUM
+            << " tree generations");
         return false;
       }
+      canvas_alpha_ = CalculateAlpha(tree_root_);
     }
   }
   canvas_height_ = static_cast<int>(canvas_width_ / canvas_alpha_);
@@ -707,7 +1072,7 @@ bool CollageAdvanced::CalculatePositions(const char style, TreeNode* node) {
         node->parent_->position_.width_ -
         node->position_.width_;
       } else {
-        std::cout << "error: CalculatePositions style not supported..." << std::endl;
+        LOG(LOG_ERROR, "CalculatePositions style not supported...");
         return false;
       }
     } else if (node->child_type_ == 'r') {
@@ -722,12 +1087,12 @@ bool CollageAdvanced::CalculatePositions(const char style, TreeNode* node) {
         node->parent_->position_.width_ -
         node->position_.width_;
       } else {
-        std::cout << "error: CalculatePositions style not supported..." << std::endl;
+        LOG(LOG_ERROR, "CalculatePositions style not supported...");
         return false;
       }
       
     } else {
-      std::cout << "error: CalculatePositions V" << std::endl;
+      LOG(LOG_ERROR, "CalculatePositions V");
       return false;
     }
   } else if (node->parent_->split_type_ == 'h') {
@@ -747,11 +1112,11 @@ bool CollageAdvanced::CalculatePositions(const char style, TreeNode* node) {
       node->parent_->position_.height_ -
       node->position_.height_;
     } else {
-      std::cout << "error: CalculatePositions H" << std::endl;
+      LOG(LOG_ERROR, "CalculatePositions H");
       return false;
     }
   } else {
-    std::cout << "error: CalculatePositions undefiend..." << std::endl;
+    LOG(LOG_ERROR, "CalculatePositions undefiend...");
   }
   
   // Calculation for children.
@@ -766,245 +1131,1370 @@ bool CollageAdvanced::CalculatePositions(const char style, TreeNode* node) {
   return true;
 }
 
+bool CollageAdvanced::AddImages(const std::vector<std::string>& image_list) {
+  std::vector<cv::Size2i> image_sizes;
+  for (int i = 0; i < static_cast<int>(image_list.size()); ++i) {
+    image_sizes.push_back(ImageStore::Instance()->GetSize(image_list[i]));
+  }
+  return AddImages(image_list, image_sizes);
+}
+
+bool CollageAdvanced::AddImages(const std::vector<std::string>& image_list,
+                                const std::vector<cv::Size2i>& image_sizes) {
+  TRACE_SCOPE("AddImages");
+  assert(image_list.size() == image_sizes.size());
+  for (int i = 0; i < static_cast<int>(image_sizes.size()); ++i) {
+    if ((image_sizes[i].width <= 0) || (image_sizes[i].height <= 0)) {
+      LOG(LOG_ERROR, "cannot add " << image_list[i]);
+      return false;
+    }
+  }
+  bool laid_out = (-1 != canvas_width_);
+  std::map<const TreeNode*, FloatRect> old_positions;
+  for (int i = 0; i < static_cast<int>(tree_leaves_.size()); ++i) {
+    old_positions[tree_leaves_[i]] = tree_leaves_[i]->position_;
+  }
+  std::set<TreeNode*> edited;
+  for (int i = 0; i < static_cast<int>(image_list.size()); ++i) {
+    AlphaUnit new_unit;
+    new_unit.image_ind_ = image_num_;
+    new_unit.alpha_ = static_cast<float>(image_sizes[i].width) / image_sizes[i].height;
+    new_unit.alpha_recip_ = static_cast<float>(image_sizes[i].height) / image_sizes[i].width;
+    new_unit.image_path_ = image_list[i];
+    image_alpha_vec_.insert(std::upper_bound(image_alpha_vec_.begin(), image_alpha_vec_.end(),
+                                             new_unit, less_than), new_unit);
+    ++image_num_;
+    if (!laid_out)
+      continue;
+    // The leaf becomes the left child of a new inner node, the image its
+    // right sibling. Side by side if the leaf is the wider of the two,
+    // stacked otherwise, which keeps the node's ratio closest to the leaf's.
+    TreeNode* leaf = FindSplitLeaf(new_unit.alpha_);
+    TreeNode* node = new TreeNode();
+    node->is_leaf_ = false;
+    node->parent_ = leaf->parent_;
+    node->child_type_ = leaf->child_type_;
+    node->split_type_ = (leaf->alpha_ >= new_unit.alpha_) ? 'v' : 'h';
+    if ((leaf == tree_root_) && ('N' != root_split_))
+      node->split_type_ = root_split_;
+    if (leaf == tree_root_)
+      tree_root_ = node;
+    else if (leaf->parent_->left_child_ == leaf)
+      leaf->parent_->left_child_ = node;
+    else
+      leaf->parent_->right_child_ = node;
+    leaf->parent_ = node;
+    leaf->child_type_ = 'l';
+    node->left_child_ = leaf;
+    TreeNode* new_leaf = new TreeNode();
+    new_leaf->parent_ = node;
+    new_leaf->child_type_ = 'r';
+    new_leaf->alpha_ = new_unit.alpha_;
+    new_leaf->weight_ = new_unit.weight_;
+    new_leaf->img_path_ = new_unit.image_path_;
+    node->right_child_ = new_leaf;
+    tree_leaves_.push_back(new_leaf);
+    edited.insert(node);
+  }
+  if (!laid_out)
+    return true;
+  return Relayout(old_positions, edited);
+}
+
+bool CollageAdvanced::RemoveImages(const std::vector<std::string>& image_list) {
+  TRACE_SCOPE("RemoveImages");
+  // Check every path first, so that a bad list changes nothing.
+  std::vector<std::string> remaining;
+  for (int i = 0; i < static_cast<int>(image_alpha_vec_.size()); ++i) {
+    remaining.push_back(image_alpha_vec_[i].image_path_);
+  }
+  for (int i = 0; i < static_cast<int>(image_list.size()); ++i) {
+    std::vector<std::string>::iterator it =
+        std::find(remaining.begin(), remaining.end(), image_list[i]);
+    if (it == remaining.end()) {
+      LOG(LOG_ERROR, image_list[i] << " is not in the collage");
+      return false;
+    }
+    remaining.erase(it);
+  }
+  
+  bool laid_out = (-1 != canvas_width_);
+  std::map<const TreeNode*, FloatRect> old_positions;
+  for (int i = 0; i < static_cast<int>(tree_leaves_.size()); ++i) {
+    old_positions[tree_leaves_[i]] = tree_leaves_[i]->position_;
+  }
+  std::set<TreeNode*> edited;
+  for (int i = 0; i < static_cast<int>(image_list.size()); ++i) {
+    pins_.erase(image_list[i]);
+    for (int k = 0; k < static_cast<int>(image_alpha_vec_.size()); ++k) {
+      if (image_alpha_vec_[k].image_path_ == image_list[i]) {
+        image_alpha_vec_.erase(image_alpha_vec_.begin() + k);
+        break;
+      }
+    }
+    --image_num_;
+    if (!laid_out || (0 == image_num_))
+      continue;
+    for (int k = 0; k < static_cast<int>(tree_leaves_.size()); ++k) {
+      if (tree_leaves_[k]->img_path_ == image_list[i]) {
+        // The leaf and its parent are freed; an earlier edit may have
+        // been recorded at either.
+        TreeNode* leaf = tree_leaves_[k];
+        edited.erase(leaf);
+        edited.erase(leaf->parent_);
+        TreeNode* sibling = RemoveLeaf(leaf);
+        edited.insert(sibling->parent_ ? sibling->parent_ : sibling);
+        break;
+      }
+    }
+  }
+  changed_leaves_.clear();
+  if (0 == image_num_) {
+    // Nothing left to lay out: back to the state before CreateCollage().
+    ReleaseTree(tree_root_);
+    tree_root_ = new TreeNode();
+    tree_leaves_.clear();
+    canvas_width_ = -1;
+    canvas_alpha_ = -1;
+    canvas_height_ = -1;
+    return true;
+  }
+  if (!laid_out)
+    return true;
+  return Relayout(old_positions, edited);
+}
+
+bool CollageAdvanced::PinImage(const std::string& img_path, int rank) {
+  bool found = false;
+  for (int i = 0; !found && (i < static_cast<int>(image_alpha_vec_.size())); ++i) {
+    found = (image_alpha_vec_[i].image_path_ == img_path);
+  }
+  if (!found) {
+    LOG(LOG_ERROR, img_path << " is not in the collage");
+    return false;
+  }
+  pins_[img_path] = rank;
+  return true;
+}
+
+bool CollageAdvanced::ResolvePins() {
+  pinned_leaves_.clear();
+  for (std::map<std::string, int>::const_iterator it = pins_.begin();
+       it != pins_.end(); ++it) {
+    int rank = (it->second < 0) ? image_num_ + it->second : it->second;
+    int k = 0;
+    while ((k < static_cast<int>(image_alpha_vec_.size())) &&
+           (image_alpha_vec_[k].image_path_ != it->first)) {
+      ++k;
+    }
+    // No tree can satisfy these: fail before generating any.
+    if ((rank < 0) || (rank >= image_num_) || pinned_leaves_.count(rank) ||
+        (k == static_cast<int>(image_alpha_vec_.size()))) {
+      LOG(LOG_ERROR, "cannot pin " << it->first << " at " << it->second
+          << " among " << image_num_ << " images");
+      pinned_leaves_.clear();
+      return false;
+    }
+    pinned_leaves_[rank] = image_alpha_vec_[k];
+  }
+  return true;
+}
+
+int CollageAdvanced::PinnedLeaves(int first_leaf, int leaf_num, float* weight) const {
+  int pinned_num = 0;
+  for (std::map<int, AlphaUnit>::const_iterator it = pinned_leaves_.lower_bound(first_leaf);
+       (it != pinned_leaves_.end()) && (it->first < first_leaf + leaf_num); ++it) {
+    ++pinned_num;
+    if (NULL != weight)
+      *weight += it->second.weight_;
+  }
+  return pinned_num;
+}
+
+void CollageAdvanced::AlphaRange(const TreeNode* node,
+                                 float* min_alpha,
+                                 float* max_alpha) const {
+  if (node->is_leaf_) {
+    *min_alpha = node->alpha_;
+    *max_alpha = node->alpha_;
+    return;
+  }
+  float left_min, left_max, right_min, right_max;
+  AlphaRange(node->left_child_, &left_min, &left_max);
+  AlphaRange(node->right_child_, &right_min, &right_max);
+  // Both combinations grow with the children's ratios, and stacking ('h')
+  // always gives less than side by side ('v').
+  *min_alpha = left_min * right_min / (left_min + right_min);
+  *max_alpha = left_max + right_max;
+  if ((node == tree_root_) && ('h' == root_split_))
+    *max_alpha = left_max * right_max / (left_max + right_max);
+  if ((node == tree_root_) && ('v' == root_split_))
+    *min_alpha = left_min + right_min;
+}
+
+bool CollageAdvanced::GenerateFeasibleTree(float expect_alpha,
+                                           float lower_bound,
+                                           float upper_bound,
+                                           int* tree_gene_counter) {
+  while (true) {
+    tree_generation_ = *tree_gene_counter;
+    GenerateTree(expect_alpha);
+    float min_alpha = 0;
+    float max_alpha = 0;
+    AlphaRange(tree_root_, &min_alpha, &max_alpha);
+    if ((max_alpha >= lower_bound) && (min_alpha <= upper_bound))
+      return true;
+    // No choice of split types brings this tree within the bounds.
+    TRACE_COUNTER("pruned_trees", 1);
+    if (++*tree_gene_counter > MAX_TREE_GENE_NUM)
+      return false;
+  }
+}
+
+bool CollageAdvanced::LeafPosition(const std::string& img_path,
+                                   FloatRect* position) const {
+  for (int i = 0; i < static_cast<int>(tree_leaves_.size()); ++i) {
+    if (tree_leaves_[i]->img_path_ == img_path) {
+      *position = tree_leaves_[i]->position_;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool CollageAdvanced::SetImageWeight(const std::string& img_path, float weight) {
+  if (!(weight > 0)) {
+    LOG(LOG_ERROR, "image weights must be positive");
+    return false;
+  }
+  bool found = false;
+  for (int i = 0; i < static_cast<int>(image_alpha_vec_.size()); ++i) {
+    if (image_alpha_vec_[i].image_path_ == img_path) {
+      image_alpha_vec_[i].weight_ = weight;
+      found = true;
+    }
+  }
+  if (!found)
+    LOG(LOG_ERROR, img_path << " is not in the collage");
+  return found;
+}
+
+bool CollageAdvanced::ReplaceImage(const std::string& old_path,
+                                   const std::string& new_path) {
+  cv::Size2i size = ImageStore::Instance()->GetSize(new_path);
+  if ((size.width <= 0) || (size.height <= 0)) {
+    LOG(LOG_ERROR, "cannot add " << new_path);
+    return false;
+  }
+  int k = 0;
+  while ((k < static_cast<int>(image_alpha_vec_.size())) &&
+         (image_alpha_vec_[k].image_path_ != old_path)) {
+    ++k;
+  }
+  if (k == static_cast<int>(image_alpha_vec_.size())) {
+    LOG(LOG_ERROR, old_path << " is not in the collage");
+    return false;
+  }
+  // image_alpha_vec_ gets the new ratio for later layouts, while the leaf
+  // keeps its ratio and rect: only its tile changes.
+  AlphaUnit new_unit = image_alpha_vec_[k];
+  new_unit.alpha_ = static_cast<float>(size.width) / size.height;
+  new_unit.alpha_recip_ = static_cast<float>(size.height) / size.width;
+  new_unit.image_path_ = new_path;
+  image_alpha_vec_.erase(image_alpha_vec_.begin() + k);
+  image_alpha_vec_.insert(std::upper_bound(image_alpha_vec_.begin(), image_alpha_vec_.end(),
+                                           new_unit, less_than), new_unit);
+  std::map<std::string, int>::iterator pin = pins_.find(old_path);
+  if (pin != pins_.end()) {
+    int rank = pin->second;
+    pins_.erase(pin);
+    pins_[new_path] = rank;
+  }
+  changed_leaves_.clear();
+  for (int i = 0; i < static_cast<int>(tree_leaves_.size()); ++i) {
+    if (tree_leaves_[i]->img_path_ == old_path) {
+      tree_leaves_[i]->img_path_ = new_path;
+      changed_leaves_.push_back(i);
+      break;
+    }
+  }
+  return true;
+}
+
+TreeNode* CollageAdvanced::FindSplitLeaf(float alpha) const {
+  // GuidedTree() leaves differ in depth by at most one; splitting the
+  // shallowest keeps it that way while images are added. Among those, the
+  // leaf whose ratio differs most from alpha changes its node least.
+  TreeNode* best_leaf = NULL;
+  int best_depth = 0;
+  float best_change = 0;
+  for (int i = 0; i < static_cast<int>(tree_leaves_.size()); ++i) {
+    TreeNode* leaf = tree_leaves_[i];
+    // A split pinned leaf would stop being the first or last one.
+    if (pins_.count(leaf->img_path_) && (pins_.size() < tree_leaves_.size()))
+      continue;
+    int depth = 0;
+    for (const TreeNode* node = leaf; node != tree_root_; node = node->parent_) {
+      ++depth;
+    }
+    float change = (leaf->alpha_ + alpha) / std::max(leaf->alpha_, alpha);
+    if ((NULL == best_leaf) || (depth < best_depth) ||
+        ((depth == best_depth) && (change < best_change))) {
+      best_leaf = leaf;
+      best_depth = depth;
+      best_change = change;
+    }
+  }
+  return best_leaf;
+}
+
+TreeNode* CollageAdvanced::RemoveLeaf(TreeNode* leaf) {
+  tree_leaves_.erase(std::find(tree_leaves_.begin(), tree_leaves_.end(), leaf));
+  TreeNode* parent = leaf->parent_;
+  TreeNode* sibling = (parent->left_child_ == leaf) ? parent->right_child_ :
+                                                      parent->left_child_;
+  sibling->child_type_ = parent->child_type_;
+  if (parent == tree_root_) {
+    tree_root_ = sibling;
+    sibling->parent_ = NULL;
+  } else {
+    sibling->parent_ = parent->parent_;
+    if (parent->parent_->left_child_ == parent)
+      parent->parent_->left_child_ = sibling;
+    else
+      parent->parent_->right_child_ = sibling;
+  }
+  delete leaf;
+  delete parent;
+  return sibling;
+}
+
+void CollageAdvanced::CollectLeaves(TreeNode* node) {
+  if (node->is_leaf_) {
+    tree_leaves_.push_back(node);
+    return;
+  }
+  CollectLeaves(node->left_child_);
+  CollectLeaves(node->right_child_);
+}
+
+bool CollageAdvanced::Relayout(const std::map<const TreeNode*, FloatRect>& old_positions,
+                               const std::set<TreeNode*>& edited) {
+  TRACE_SCOPE("Relayout");
+  float expect_alpha = static_cast<float>(layout_size_.width) / layout_size_.height;
+  float lower_bound = expect_alpha / layout_threshold_;
+  float upper_bound = expect_alpha * layout_threshold_;
+  // Only the edited nodes and their ancestors are adjusted at first.
+  std::set<const TreeNode*> path;
+  for (std::set<TreeNode*>::const_iterator it = edited.begin();
+       it != edited.end(); ++it) {
+    for (const TreeNode* node = *it; ; node = node->parent_) {
+      if (!path.insert(node).second || (node == tree_root_)) break;
+    }
+  }
+  canvas_alpha_ = CalculateAlpha(tree_root_);
+  int iter_counter = 0;
+  bool local = true;
+  bool regenerated = false;
+  while ((canvas_alpha_ < lower_bound) || (canvas_alpha_ > upper_bound)) {
+    tree_root_->alpha_expect_ = expect_alpha;
+    bool changed = AdjustAlpha(tree_root_, layout_threshold_, local ? &path : NULL);
+    TRACE_COUNTER("layout_attempts", 1);
+    canvas_alpha_ = CalculateAlpha(tree_root_);
+    ++iter_counter;
+    if ((!changed || (iter_counter > MAX_ITER_NUM)) &&
+        ((canvas_alpha_ < lower_bound) || (canvas_alpha_ > upper_bound))) {
+      if (local) {
+        LOG(LOG_DEBUG, "local repair failed, adjusting the whole tree");
+        local = false;
+        iter_counter = 0;
+        continue;
+      }
+      LOG(LOG_DEBUG, "tree repair failed, regenerating tree");
+      if (!CreateCollage(layout_size_, layout_border_, layout_threshold_,
+                         layout_manga_mode_, layout_style_))
+        return false;
+      regenerated = true;
+      break;
+    }
+  }
+  if (!regenerated) {
+    canvas_height_ = static_cast<int>(canvas_width_ / canvas_alpha_);
+    tree_root_->position_.x_ = 0;
+    tree_root_->position_.y_ = 0;
+    tree_root_->position_.height_ = canvas_height_;
+    tree_root_->position_.width_ = canvas_width_;
+    if (tree_root_->left_child_)
+      CalculatePositions(layout_style_, tree_root_->left_child_);
+    if (tree_root_->right_child_)
+      CalculatePositions(layout_style_, tree_root_->right_child_);
+    tree_leaves_.clear();
+    CollectLeaves(tree_root_);
+  }
+  
+  // A regenerated tree may reuse the addresses of freed nodes, so every
+  // leaf counts as changed.
+  changed_leaves_.clear();
+  for (int i = 0; i < image_num_; ++i) {
+    std::map<const TreeNode*, FloatRect>::const_iterator it =
+        regenerated ? old_positions.end() : old_positions.find(tree_leaves_[i]);
+    const FloatRect& pos = tree_leaves_[i]->position_;
+    if ((it == old_positions.end()) ||
+        (it->second.x_ != pos.x_) || (it->second.y_ != pos.y_) ||
+        (it->second.width_ != pos.width_) || (it->second.height_ != pos.height_))
+      changed_leaves_.push_back(i);
+  }
+  return true;
+}
+
 cv::Mat CollageAdvanced::OutputCollage(const char type, bool accurate) {
+  TRACE_SCOPE("OutputCollage");
   cv::Mat canvas(cv::Size(canvas_width_, canvas_height_),
                  CV_8UC3, cv::Scalar(0, 0, 0));
   if ((-1 == canvas_alpha_) || (-1 == canvas_width_) || (-1 == canvas_height_)) {
-    std::cout << "error: OutputCollage..." << std::endl;
+    LOG(LOG_ERROR, "OutputCollage...");
     return canvas;
   }
   // Traverse tree_leaves_ vector. Resize tile image and paste it on the canvas.
   assert(canvas_alpha_ != -1);
   assert(canvas_width_ != -1);
+  std::vector<int> leaves;
+  std::vector<char> types;
+  for (int i = 0; i < image_num_; ++i) {
+    leaves.push_back(i);
+    types.push_back(LeafStyle(i, type));
+  }
+  RenderLeaves(leaves, types, accurate, &canvas);
+  return canvas;
+}
 
+cv::Mat CollageAdvanced::UpdateCollage(const char type, bool accurate,
+                                       std::vector<cv::Rect>* damage) {
+  TRACE_SCOPE("UpdateCollage");
+  damage->clear();
+  if ((-1 == canvas_alpha_) || (-1 == canvas_width_) || (-1 == canvas_height_)) {
+    LOG(LOG_ERROR, "UpdateCollage...");
+    return cv::Mat();
+  }
+  cv::Size2i canvas_size(canvas_width_, canvas_height_);
+  bool same_size = (rendered_canvas_.size() == canvas_size);
+  cv::Mat canvas = rendered_canvas_;
+  if (!same_size) {
+    canvas = cv::Mat(canvas_size, CV_8UC3, cv::Scalar(0, 0, 0));
+    damage->push_back(cv::Rect(0, 0, canvas_width_, canvas_height_));
+  }
+  
+  // Match every leaf with the previous render of its image, by path.
+  std::multimap<std::string, int> previous;
+  for (int k = 0; k < static_cast<int>(rendered_leaves_.size()); ++k) {
+    previous.insert(std::make_pair(rendered_leaves_[k].img_path_, k));
+  }
+  std::vector<LeafState> states(image_num_);
+  std::vector<int> sources(image_num_, -1);  // Previous render to copy.
+  std::vector<char> kept(rendered_leaves_.size(), 0);
+  std::vector<int> leaves;
+  std::vector<char> types;
+  bool moved = false;
   for (int i = 0; i < image_num_; ++i) {
     FloatRect pos = tree_leaves_[i]->position_;
-    cv::Rect pos_cv(pos.x_, pos.y_, pos.width_, pos.height_);
-    cv::Mat roi(canvas, pos_cv);
-    cv::Mat resized_img(pos_cv.height, pos_cv.width, CV_8UC3);
-    cv::Mat image = cv::imread(tree_leaves_[i]->img_path_.c_str(), 1);
-    assert(image.type() == CV_8UC3);
-    switch (type) {
-      case 'p': {
-        // Create a photo collage.
-        cv::resize(image, resized_img, resized_img.size());
-        break;
-      }
-      case 'm': {
-        // Create a manga collage.
-        std::auto_ptr<MangaEngine>
-        manga_engine(new MangaEngine(image));
-        manga_engine->Convert2Manga();
-        cv::Mat manga_img = manga_engine->manga() * 255;
-        // manga_img is CV_32FC1 type, we have to convert it to CV_8UC1.
-        manga_img.convertTo(manga_img, CV_8UC1);
-        // we then convert it to CV_8UC3 (gray -> color).
-        cv::cvtColor(manga_img, manga_img, CV_GRAY2BGR);
-        cv::resize(manga_img, resized_img, resized_img.size());
+    LeafState& state = states[i];
+    state.rect_ = cv::Rect(pos.x_, pos.y_, pos.width_, pos.height_);
+    state.style_ = LeafStyle(i, type);
+    state.accurate_ = accurate;
+    state.crop_fit_ = crop_fit_;
+    state.img_path_ = tree_leaves_[i]->img_path_;
+    struct stat st;
+    if (0 == stat(state.img_path_.c_str(), &st)) {
+      state.mtime_ = st.st_mtime;
+      state.file_size_ = st.st_size;
+    }
+    typedef std::multimap<std::string, int>::iterator Iterator;
+    std::pair<Iterator, Iterator> range = previous.equal_range(state.img_path_);
+    for (Iterator it = range.first; it != range.second; ++it) {
+      const LeafState& old_state = rendered_leaves_[it->second];
+      if ((old_state.rect_.size() == state.rect_.size()) &&
+          (old_state.style_ == state.style_) &&
+          (old_state.accurate_ == state.accurate_) &&
+          (old_state.crop_fit_ == state.crop_fit_) &&
+          (old_state.mtime_ == state.mtime_) &&
+          (old_state.file_size_ == state.file_size_)) {
+        sources[i] = it->second;
+        previous.erase(it);
         break;
       }
-      case 'c': {
-        // Create a cartoon manga.
-        std::auto_ptr<CartoonEngine>
-        cartoon_engine(new CartoonEngine(image));
-        cartoon_engine->Convert2Cartoon();
-        cv::Mat cartoon_img = cartoon_engine->cartoon();
-        cv::resize(cartoon_img, resized_img, resized_img.size());
-        break;
+    }
+    if (-1 == sources[i]) {
+      leaves.push_back(i);
+      types.push_back(state.style_);
+    } else if (!same_size || (rendered_leaves_[sources[i]].rect_ != state.rect_)) {
+      moved = true;
+    } else {
+      kept[sources[i]] = 1;
+    }
+  }
+  
+  // Moved tiles are copied from the previous canvas, which the new one may
+  // overwrite where they overlap.
+  cv::Mat old_canvas = rendered_canvas_;
+  if (same_size && moved)
+    old_canvas = rendered_canvas_.clone();
+  if (same_size) {
+    // Clear what the previous render showed except the tiles that stay.
+    for (int k = 0; k < static_cast<int>(rendered_leaves_.size()); ++k) {
+      if (kept[k])
+        continue;
+      const cv::Rect& rect = rendered_leaves_[k].rect_;
+      canvas(rect).setTo(cv::Scalar(0, 0, 0));
+      damage->push_back(rect);
+    }
+  }
+  for (int i = 0; i < image_num_; ++i) {
+    const cv::Rect& rect = states[i].rect_;
+    if ((-1 == sources[i]) || (same_size && kept[sources[i]]))
+      continue;
+    cv::Mat target(canvas, rect);
+    old_canvas(rendered_leaves_[sources[i]].rect_).copyTo(target);
+    if (same_size)
+      damage->push_back(rect);
+  }
+  if (!RenderLeaves(leaves, types, accurate, &canvas)) {
+    // Render everything again next time.
+    rendered_canvas_ = cv::Mat();
+    rendered_leaves_.clear();
+    return canvas;
+  }
+  if (same_size) {
+    for (int k = 0; k < static_cast<int>(leaves.size()); ++k) {
+      damage->push_back(states[leaves[k]].rect_);
+    }
+  }
+  rendered_canvas_ = canvas;
+  rendered_leaves_.swap(states);
+  return canvas;
+}
+
+bool CollageAdvanced::RenderLeaves(const std::vector<int>& leaves,
+                                   const std::vector<char>& types,
+                                   bool accurate,
+                                   cv::Mat* canvas) {
+  assert(leaves.size() == types.size());
+  int leaf_num = static_cast<int>(leaves.size());
+  // Pencil styles share one preloaded tonal texture.
+  cv::Ptr<TonalTexture> tonal;
+  if (!LoadTonal(std::string(types.begin(), types.end()), &tonal))
+    return false;
+  // Stylized tiles are looked up in the tile cache (if enabled) before
+  // running the engines. Photo tiles are only a resize and are not cached.
+  TileCache* tile_cache = TileCache::Instance();
+  std::map<char, std::string> style_params;
+  // Every tile of a fast preview starts from the smallest indexed thumbnail
+  // that covers the tile instead of the full image.
+  std::vector<char> use_thumbnails(leaf_num, 0);
+
+  // Sources of the tiles missing from the cache are read ahead on I/O
+  // threads while the current tile is stylized.
+  std::vector<std::string> tile_keys(leaf_num);
+  std::vector<char> prefetched(leaf_num, 0);
+  std::vector<PrefetchRequest> requests;
+  for (int k = 0; k < leaf_num; ++k) {
+    const char type = types[k];
+    const std::string& img_path = tree_leaves_[leaves[k]]->img_path_;
+    FloatRect pos = tree_leaves_[leaves[k]]->position_;
+    cv::Size2i tile_size(static_cast<int>(pos.width_), static_cast<int>(pos.height_));
+    use_thumbnails[k] = !accurate;
+    if (tile_cache->enabled() && ('p' != type)) {
+      if (style_params.find(type) == style_params.end())
+        style_params[type] = StyleParams(type) + (accurate ? "" : " fast") +
+                             (crop_fit_ ? " crop" : "");
+      tile_keys[k] = tile_cache->Key(img_path, type, style_params[type], tile_size);
+    }
+    if (tile_cache->Contains(tile_keys[k]))
+      continue;
+    prefetched[k] = 1;
+    if (use_thumbnails[k])
+      requests.push_back(PrefetchRequest(img_path, tile_size));
+    else
+      requests.push_back(PrefetchRequest(img_path));
+  }
+  ImagePrefetcher prefetcher(requests, PREFETCH_THREADS, PREFETCH_DEPTH,
+                             prefetch_budget_);
+
+  for (int k = 0; k < leaf_num; ++k) {
+    TRACE_SCOPE("tile");
+    const TreeNode* leaf = tree_leaves_[leaves[k]];
+    FloatRect pos = leaf->position_;
+    cv::Rect pos_cv(pos.x_, pos.y_, pos.width_, pos.height_);
+    // Every style resizes its result straight into the canvas.
+    cv::Mat resized_img(*canvas, pos_cv);
+    const std::string& tile_key = tile_keys[k];
+    if (!prefetched[k] && tile_cache->Get(tile_key, &resized_img))
+      continue;
+    cv::Mat image;
+    if (prefetched[k])
+      image = prefetcher.Next();
+    else if (use_thumbnails[k])
+      image = ImageStore::Instance()->GetThumbnail(leaf->img_path_,
+                                                   resized_img.size());
+    else
+      image = ImageStore::Instance()->Get(leaf->img_path_);
+    assert(image.type() == CV_8UC3);
+    if (crop_fit_)
+      image = image(SaliencyCrop(image, resized_img.size()));
+    if (TileSuffix(types[k]).empty()) {
+      LOG(LOG_ERROR, "OutputCollage.. " << types[k] << " not supported...");
+      return false;
+    }
+    // A failed tile stays black in the canvas, but is not cached.
+    if (!RenderTile(types[k], image, tonal, cv::Ptr<CoherentLine>(), &resized_img)) {
+      LOG(LOG_WARNING, "cannot render " << leaf->img_path_ << " as " << types[k]);
+      continue;
+    }
+    tile_cache->Put(tile_key, resized_img);
+  }
+  return true;
+}
+
+char CollageAdvanced::LeafStyle(int leaf, const char type) const {
+  std::map<std::string, char>::const_iterator it =
+      leaf_styles_.find(tree_leaves_[leaf]->img_path_);
+  return (it == leaf_styles_.end()) ? type : it->second;
+}
+
+void CollageAdvanced::SetLeafStyle(const std::string& img_path, const char type) {
+  if (0 == type)
+    leaf_styles_.erase(img_path);
+  else
+    leaf_styles_[img_path] = type;
+}
+
+namespace {
+
+// Runs the engines of the missing styles of one leaf in parallel.
+class StyleBody : public cv::ParallelLoopBody {
+public:
+  StyleBody(const std::vector<char>& types,
+            const std::vector<cv::Mat>& tiles,
+            const std::vector<std::string>& tile_keys,
+            const cv::Mat& image,
+            const cv::Ptr<TonalTexture>& tonal,
+            const cv::Ptr<CoherentLine>& cl,
+            TraceSession* session)
+  : types_(types), tiles_(tiles), tile_keys_(tile_keys),
+    image_(image), tonal_(tonal), cl_(cl), session_(session) {}
+  virtual void operator() (const cv::Range& range) const {
+    // Runs on parallel_for_ threads, which know nothing of the job's
+    // trace session.
+    TraceSessionScope session_scope(session_);
+    for (int k = range.start; k < range.end; ++k) {
+      // The Mat header is copied; its pixels are the canvas ROI.
+      cv::Mat tile = tiles_[k];
+      if (RenderTile(types_[k], image_, tonal_, cl_, &tile))
+        TileCache::Instance()->Put(tile_keys_[k], tile);
+    }
+  }
+private:
+  const std::vector<char>& types_;
+  const std::vector<cv::Mat>& tiles_;
+  const std::vector<std::string>& tile_keys_;
+  const cv::Mat& image_;
+  const cv::Ptr<TonalTexture>& tonal_;
+  const cv::Ptr<CoherentLine>& cl_;
+  TraceSession* session_;
+};
+
+// Shared analysis and style fan-out of one leaf.
+class LeafItem : public WorkItem {
+public:
+  LeafItem(const cv::Ptr<TonalTexture>& tonal, bool crop_fit)
+  : tonal_(tonal), crop_fit_(crop_fit) {
+    session_ = Trace::enabled() ? Trace::session() : NULL;
+  }
+  void set_image(const cv::Mat& image) {
+    image_ = image;
+  }
+  void AddTile(char type, const cv::Mat& tile, const std::string& tile_key) {
+    types_.push_back(type);
+    tiles_.push_back(tile);
+    tile_keys_.push_back(tile_key);
+  }
+  virtual void Run() {
+    TraceSessionScope session_scope(session_);
+    TRACE_SCOPE("leaf");
+    if (image_.empty()) {
+      LOG(LOG_WARNING, "cannot read a collage source, its tiles stay black");
+      return;
+    }
+    // All styles of a leaf share the crop and its edge analysis.
+    if (crop_fit_)
+      image_ = image_(SaliencyCrop(image_, tiles_[0].size()));
+    cv::Ptr<CoherentLine> cl;
+    if ((std::find(types_.begin(), types_.end(), 'm') != types_.end()) ||
+        (std::find(types_.begin(), types_.end(), 'c') != types_.end())) {
+      // Compute everything the engines read (fdog_edge for cartoons and
+      // float mangas, fdog_mask for fixed-point mangas) before the style
+      // workers start, so that they only read cl.
+      cl = new CoherentLine(image_);
+      cl->fdog_edge();
+      cl->fdog_mask();
+    }
+    cv::parallel_for_(cv::Range(0, static_cast<int>(types_.size())),
+                      StyleBody(types_, tiles_, tile_keys_, image_, tonal_, cl,
+                                session_));
+  }
+private:
+  cv::Mat image_;
+  cv::Ptr<TonalTexture> tonal_;
+  bool crop_fit_;
+  TraceSession* session_;
+  std::vector<char> types_;
+  std::vector<cv::Mat> tiles_;
+  std::vector<std::string> tile_keys_;
+};
+
+}  // namespace
+
+bool CollageAdvanced::OutputCollages(const std::string& types,
+                                     int thread_num,
+                                     std::vector<cv::Mat>* canvases) {
+  TRACE_SCOPE("OutputCollages");
+  canvases->clear();
+  if ((-1 == canvas_alpha_) || (-1 == canvas_width_) || (-1 == canvas_height_)) {
+    LOG(LOG_ERROR, "OutputCollages...");
+    return false;
+  }
+  int style_num = static_cast<int>(types.size());
+  for (int s = 0; s < style_num; ++s) {
+    if (std::string("pmeoci").find(types[s]) == std::string::npos) {
+      LOG(LOG_ERROR, "OutputCollages.. " << types[s] << " not supported...");
+      return false;
+    }
+    // The styles of a leaf run in parallel on one edge analysis; two
+    // workers of one style would render the same tiles twice.
+    if (types.find(types[s]) != static_cast<size_t>(s)) {
+      LOG(LOG_ERROR, "OutputCollages.. " << types[s] << " given twice...");
+      return false;
+    }
+    canvases->push_back(cv::Mat(cv::Size(canvas_width_, canvas_height_),
+                                CV_8UC3, cv::Scalar(0, 0, 0)));
+  }
+  // Pencil styles share one preloaded tonal texture.
+  cv::Ptr<TonalTexture> tonal;
+  if (!LoadTonal(types, &tonal))
+    return false;
+  TileCache* tile_cache = TileCache::Instance();
+  std::vector<std::string> style_params(style_num);
+  for (int s = 0; s < style_num; ++s) {
+    if (tile_cache->enabled() && ('p' != types[s]))
+      style_params[s] = StyleParams(types[s]) + (crop_fit_ ? " crop" : "");
+  }
+  
+  // Cached tiles are copied straight into the canvases. Every other leaf
+  // becomes one LeafItem, whose source is decoded once on the prefetcher's
+  // I/O threads for all of its styles.
+  std::vector<LeafItem*> items(image_num_, static_cast<LeafItem*>(NULL));
+  std::vector<PrefetchRequest> requests;
+  for (int i = 0; i < image_num_; ++i) {
+    const std::string& img_path = tree_leaves_[i]->img_path_;
+    FloatRect pos = tree_leaves_[i]->position_;
+    cv::Rect pos_cv(pos.x_, pos.y_, pos.width_, pos.height_);
+    for (int s = 0; s < style_num; ++s) {
+      cv::Mat tile((*canvases)[s], pos_cv);
+      std::string tile_key;
+      if (!style_params[s].empty()) {
+        tile_key = tile_cache->Key(img_path, types[s], style_params[s], tile.size());
+        if (tile_cache->Get(tile_key, &tile))
+          continue;
       }
-      case 'e': {
-        // Create a pencil sketch collage.
-        string tonal_path = "/Users/WU/Dropbox/reserch/VCIP2013/Image_morphing/"
-        "code/Matlab/E_Pencil/TT3.jpg";
-        cv::Mat tonal = cv::imread(tonal_path, 0);
-        std::auto_ptr<SketchEngine>
-        sketch_engine(new SketchEngine(image, tonal));
-        sketch_engine->Convert2Sketch();
-        cv::Mat pencil_img = sketch_engine->pencil_sketch();
-        cv::cvtColor(pencil_img, pencil_img, CV_GRAY2BGR);
-        cv::resize(pencil_img, resized_img, resized_img.size());
-        break;
+      if (NULL == items[i]) {
+        items[i] = new LeafItem(tonal, crop_fit_);
+        requests.push_back(PrefetchRequest(img_path));
       }
-      case 'o': {
-        // Create a color pencil sketch collage.
-        std::string tonal_path = "/Users/WU/Dropbox/reserch/VCIP2013/Image_morphing/"
-        "code/Matlab/E_Pencil/TT3.jpg";
-        cv::Mat tonal = cv::imread(tonal_path, 0);
-        std::auto_ptr<SketchEngine>
-        sketch_engine(new SketchEngine(image, tonal));
-        sketch_engine->Convert2Sketch();
-        cv::Mat color_pencil_img = sketch_engine->color_sketch();
-        cv::resize(color_pencil_img, resized_img, resized_img.size());
-        break;
+      items[i]->AddTile(types[s], tile, tile_key);
+    }
+  }
+  ImagePrefetcher prefetcher(requests, PREFETCH_THREADS, PREFETCH_DEPTH,
+                             prefetch_budget_);
+  {
+    // At most two leaves wait per worker, bounding the decoded sources.
+    thread_num = std::max(1, thread_num);
+    WorkQueue queue(thread_num, 2 * thread_num);
+    for (int i = 0; i < image_num_; ++i) {
+      if (NULL == items[i])
+        continue;
+      items[i]->set_image(prefetcher.Next());
+      queue.Push(items[i]);
+    }
+    queue.Wait();
+  }
+  return true;
+}
+
+namespace {
+
+// Longest side of image capped at max_size, keeping the aspect ratio.
+cv::Size2i CappedSize(const cv::Size2i& size, int max_size) {
+  int longer = std::max(size.width, size.height);
+  if ((max_size <= 0) || (longer <= max_size))
+    return size;
+  double scale = static_cast<double>(max_size) / longer;
+  return cv::Size2i(std::max(1, cvRound(size.width * scale)),
+                    std::max(1, cvRound(size.height * scale)));
+}
+
+// Stylizes, frames and encodes the tile of one leaf for OutputHtml().
+class HtmlTileItem : public WorkItem {
+public:
+  HtmlTileItem(const char type,
+               const std::string& img_path,
+               const std::string& tile_key,
+               const std::string& lightbox_path,
+               const std::string& grid_path,
+               const cv::Size2i& grid_size,
+               const cv::Ptr<TonalTexture>& tonal,
+               const HtmlOptions& options,
+               char* success)
+  : type_(type), img_path_(img_path), tile_key_(tile_key),
+    lightbox_path_(lightbox_path), grid_path_(grid_path), grid_size_(grid_size),
+    tonal_(tonal), options_(options), success_(success) {
+    session_ = Trace::enabled() ? Trace::session() : NULL;
+  }
+  void set_image(const cv::Mat& image) {
+    image_ = image;
+  }
+  virtual void Run() {
+    TraceSessionScope session_scope(session_);
+    TRACE_SCOPE("tile");
+    cv::Mat tile;
+    if (!TileCache::Instance()->Get(tile_key_, &tile)) {
+      int lightbox_size = options_.lightbox_size_;
+      if (image_.empty() && (lightbox_size > 0)) {
+        cv::Size2i size = ImageStore::Instance()->GetSize(img_path_);
+        image_ = ImageStore::Instance()->GetThumbnail(img_path_,
+                                                      CappedSize(size, lightbox_size));
+      } else if (image_.empty()) {
+        image_ = ImageStore::Instance()->Get(img_path_);
       }
-      case 'i': {
-        // Create an oil painting collage.
-        std::auto_ptr<CartoonEngine>
-        painting_engine(new CartoonEngine(image));
-        painting_engine->Convert2Painting();
-        cv::Mat painting_img = painting_engine->painting();
-        cv::resize(painting_img, resized_img, resized_img.size());
-        break;
+      if (image_.empty()) {
+        LOG(LOG_WARNING, "cannot read " << img_path_);
+        return;
       }
-      default: {
-        std::cout << "error in OutputCollage.. " << type << " not supported..." << std::endl;
-        return canvas;
+      // Pre-sized export: the engines only see the lightbox resolution.
+      cv::Mat source = image_;
+      cv::Size2i source_size = CappedSize(image_.size(), lightbox_size);
+      if (source_size != image_.size())
+        cv::resize(image_, source, source_size, 0, 0, cv::INTER_AREA);
+      if ('p' == type_) {
+        tile = source;
+      } else if (!RenderFramedTile(type_, source, tonal_, &tile)) {
+        LOG(LOG_WARNING, "cannot render " << img_path_ << " as " << type_);
+        return;
       }
+      TileCache::Instance()->Put(tile_key_, tile);
     }
-
-    resized_img.copyTo(roi);
+    TRACE_SCOPE("encode");
+    std::vector<int> params;
+    params.push_back(options_.webp_ ? CV_IMWRITE_WEBP_QUALITY : CV_IMWRITE_JPEG_QUALITY);
+    params.push_back(options_.quality_);
+    bool success = cv::imwrite(lightbox_path_, tile, params);
+    if (success && !grid_path_.empty()) {
+      cv::Mat grid_tile;
+      cv::resize(tile, grid_tile, grid_size_, 0, 0, cv::INTER_AREA);
+      success = cv::imwrite(grid_path_, grid_tile, params);
+    }
+    *success_ = success;
   }
-  return canvas;
-}
+private:
+  const char type_;
+  std::string img_path_;
+  std::string tile_key_;
+  std::string lightbox_path_;
+  std::string grid_path_;
+  cv::Size2i grid_size_;
+  cv::Ptr<TonalTexture> tonal_;
+  const HtmlOptions& options_;
+  char* success_;
+  TraceSession* session_;
+  cv::Mat image_;
+};
+
+}  // namespace
 
 bool CollageAdvanced::OutputHtml(const char type, const std::string output_html_path) {
+  return OutputHtml(type, output_html_path, HtmlOptions());
+}
+
+bool CollageAdvanced::OutputHtml(const char type,
+                                 const std::string output_html_path,
+                                 const HtmlOptions& options) {
+  TRACE_SCOPE("OutputHtml");
   assert(canvas_alpha_ != -1);
-  assert(canvas_width_ != -1);  
-  std::ofstream output_html(output_html_path.c_str());
-  if (!output_html) {
-    std::cout << "error: OutputHtmlManga" << std::endl;
+  assert(canvas_width_ != -1);
+  if (options.sprite_)
+    return OutputSpriteHtml(type, output_html_path, options);
+  // Photo collages link the source images, unless tiles are pre-sized.
+  HtmlBundle bundle(output_html_path, options);
+  if (!bundle.Open())
     return false;
-  }  
-  
-  output_html << "<!DOCTYPE html>\n";
-  output_html << "<html>\n";
-  output_html << "<script src=\"/Users/wu/Dropbox/reserch/APSIPA2013/demo/PicWall_1.03/prettyPhoto/js/jquery-1.6.1.min.js\" type=\"text/javascript\" charset=\"utf-8\"></script> <link rel=\"stylesheet\" href=\"/Users/wu/Dropbox/reserch/APSIPA2013/demo/PicWall_1.03/prettyPhoto/css/prettyPhoto.css\" type=\"text/css\" media=\"screen\" charset=\"utf-8\" /> <script src=\"/Users/wu/Dropbox/reserch/APSIPA2013/demo/PicWall_1.03/prettyPhoto/js/jquery.prettyPhoto.js\" type=\"text/javascript\" charset=\"utf-8\"></script>\n";
-  output_html << "<style type=\"text/css\">\n";
-  output_html << "body {background-image:url(/Users/WU/Dropbox/reserch/MidTerm/FriendWall/data/others/bg_resize.png);  background-position: top; background-repeat:repeat-x; background-attachment:fixed}\n";
-  output_html << "</style>\n";
-  output_html << "\t<body>\n";
-  output_html << "<script type=\"text/javascript\" charset=\"utf-8\"> $(document).ready(function(){$(\"a[rel^='prettyPhoto']\").prettyPhoto();});</script>";
-  output_html << "\t\t<div style=\"margin:20px auto; width:60%; position:relative;\">\n";
-  if (type != 'p') {
-    std::string temp_path = output_html_path.substr(0, output_html_path.rfind('.')) + "/";
-    mkdir(temp_path.c_str(), S_IRWXU);
-    char buff[255];
-    std::string save_path = temp_path;
+  std::vector<std::string> lightbox_paths(image_num_);
+  std::vector<std::string> grid_paths(image_num_);
+  if (('p' != type) || (options.lightbox_size_ > 0)) {
+    if (!ExportHtmlTiles(type, bundle.tile_dir(), options, &lightbox_paths, &grid_paths))
+      return false;
+  } else {
     for (int i = 0; i < image_num_; ++i) {
-      // *****************Load image*****************
-      cv::Mat image = cv::imread(tree_leaves_[i]->img_path_.c_str(), 1);
-      // *********Non-photorealistic rendering*******
-      cv::Mat img;
-      std::sprintf(buff, "%d", i);
-      save_path = temp_path + buff;
-      switch (type) {
-        case 'p': {
-          // Photo collage.
-          image.copyTo(img);
-          save_path += "_photo.jpg";
-          break;
-        }
-        case 'm': {
-          // Manga collage.
-          std::auto_ptr<MangaEngine> manga_engine(new MangaEngine(image));
-          manga_engine->Convert2Manga();
-          img = manga_engine->manga() * 255;
-          // manga_img is CV_32FC1 type, we have to convert it to CV_8UC3.
-          img.convertTo(img, CV_8UC1);
-          cv::cvtColor(img, img, CV_GRAY2BGR);
-          save_path += "_manga.jpg";
-          break;
-        }
-        case 'e': {
-          // Pencil sketch collage.
-          string tonal_path = "/Users/WU/Dropbox/reserch/VCIP2013/Image_morphing/code/Matlab/E_Pencil/t2.jpg";
-          cv::Mat tonal = cv::imread(tonal_path, 0);
-          std::auto_ptr<SketchEngine>
-          sketch_engine(new SketchEngine(image, tonal));
-          sketch_engine->Convert2Sketch();
-          img = sketch_engine->pencil_sketch();
-          cv::cvtColor(img, img, CV_GRAY2BGR);
-          save_path += "_pencil.jpg";
-          break;
-        }
-        case 'o': {
-          // Color pencil sketch.
-          string tonal_path = "/Users/WU/Dropbox/reserch/VCIP2013/Image_morphing/code/Matlab/E_Pencil/t2.jpg";
-          cv::Mat tonal = cv::imread(tonal_path, 0);
-          std::auto_ptr<SketchEngine>
-          sketch_engine(new SketchEngine(image, tonal));
-          sketch_engine->Convert2Sketch();
-          img = sketch_engine->color_sketch();
-          save_path += "_color_pencil.jpg";
-          break;
-        }
-        case 'c': {
-          // Cartoon collage.
-          std::auto_ptr<CartoonEngine>
-          cartoon_engine(new CartoonEngine(image));
-          cartoon_engine->Convert2Cartoon();
-          img = cartoon_engine->cartoon();
-          save_path += "_cartoon.jpg";
-          break;
-        }
-        case 'i': {
-          // Oil painting collage.
-          std::auto_ptr<CartoonEngine>
-          painting_engine(new CartoonEngine(image));
-          painting_engine->Convert2Painting();
-          img = painting_engine->painting();
-          save_path += "_painting.jpg";
-          break;
-        }
-        default: {
-          break;
-        }
+      lightbox_paths[i] = tree_leaves_[i]->img_path_;
+      grid_paths[i] = tree_leaves_[i]->img_path_;
+    }
+  }
+  for (int i = 0; i < image_num_; ++i) {
+    if (!bundle.Link(lightbox_paths[i], &lightbox_paths[i]) ||
+        !bundle.Link(grid_paths[i], &grid_paths[i]))
+      return false;
+  }
+  
+  // About 300 bytes per leaf; the page is written in one call.
+  HtmlWriter output_html(HTML_WRITER_RESERVE + 300 * image_num_);
+  bundle.WriteHead(output_html);
+  for (int i = 0; i < image_num_; ++i) {
+    // ***************Print Html*******************
+    // Explicit width and height let the browser lay out the page before
+    // any tile has loaded.
+    FloatRect pos = tree_leaves_[i]->position_;
+    output_html << "\t\t\t<a href=\"";
+    output_html.Escaped(lightbox_paths[i]);
+    output_html << "\" rel=\"prettyPhoto[pp_gal]\">\n";
+    output_html << "\t\t\t\t<img src=\"";
+    output_html.Escaped(grid_paths[i]);
+    output_html << "\" width=\"" << HtmlTileSize(pos).width;
+    output_html << "\" height=\"" << HtmlTileSize(pos).height;
+    output_html << "\" style=\"position:absolute; width:";
+    output_html << pos.width_ - 1;
+    output_html << "px; height:";
+    output_html << pos.height_ - 1;
+    output_html << "px; left:";
+    output_html << pos.x_ - 1;
+    output_html << "px; top:";
+    output_html << pos.y_ - 1;
+    output_html << "px;\">\n";
+    output_html << "\t\t\t</a>\n";
+  }
+  output_html << "\t\t</div>\n";
+  output_html << "\t</body>\n";
+  output_html << "</html>";
+  return output_html.Write(output_html_path, options.compression_);
+}
+
+bool CollageAdvanced::OutputSpriteHtml(const char type,
+                                       const std::string& output_html_path,
+                                       const HtmlOptions& options) {
+  TRACE_SCOPE("OutputSpriteHtml");
+  cv::Mat canvas = OutputCollage(type);
+  if (canvas.empty())
+    return false;
+  HtmlBundle bundle(output_html_path, options);
+  if (!bundle.Open())
+    return false;
+  int strip_height = (options.strip_height_ > 0) ? options.strip_height_ : canvas.rows;
+  std::vector<int> params;
+  params.push_back(options.webp_ ? CV_IMWRITE_WEBP_QUALITY : CV_IMWRITE_JPEG_QUALITY);
+  params.push_back(options.quality_);
+#if CV_MAJOR_VERSION >= 3
+  // Progressive JPEGs show a coarse collage before the strip has loaded.
+  if (!options.webp_) {
+    params.push_back(cv::IMWRITE_JPEG_PROGRESSIVE);
+    params.push_back(1);
+  }
+#endif
+  
+  HtmlWriter output_html;
+  bundle.WriteHead(output_html);
+  char buff[255];
+  for (int top = 0, k = 0; top < canvas.rows; top += strip_height, ++k) {
+    cv::Rect strip_rect(0, top, canvas.cols, std::min(strip_height, canvas.rows - top));
+    std::sprintf(buff, "sprite_%d", k);
+    std::string strip_path = bundle.tile_dir() + buff + TileSuffix(type) +
+                             (options.webp_ ? ".webp" : ".jpg");
+    {
+      TRACE_SCOPE("encode");
+      if (!cv::imwrite(strip_path, canvas(strip_rect), params)) {
+        LOG(LOG_ERROR, "cannot write " << strip_path);
+        return false;
       }
-      // ****************Add border******************
-      int border = std::max(img.rows, img.cols) / 30;
-      int new_height = img.rows - border * 2;
-      int new_width = img.cols - border * 2;
-      cv::Rect content_rect(border, border, new_width, new_height);
-      cv::Mat new_img(img.rows, img.cols, CV_8UC3, cv::Scalar::all(255));
-      cv::Mat roi(new_img, content_rect);
-      cv::resize(img, img, cv::Size2i(new_width, new_height));
-      img.copyTo(roi);
-      cv::rectangle(new_img, content_rect, cv::Scalar::all(0), border / 5);
-      // ****************Save image******************
-      cv::imwrite(save_path, new_img);
-      // ***************Print Html*******************
-      output_html << "\t\t\t<a href=\"";
-      output_html << save_path;
-      output_html << "\" rel=\"prettyPhoto[pp_gal]\">\n";
-      output_html << "\t\t\t\t<img src=\"";
-      output_html << save_path;
-      output_html << "\" style=\"position:absolute; width:";
-      output_html << tree_leaves_[i]->position_.width_ - 1;
-      output_html << "px; height:";
-      output_html << tree_leaves_[i]->position_.height_ - 1;
-      output_html << "px; left:";
-      output_html << tree_leaves_[i]->position_.x_ - 1;
-      output_html << "px; top:";
-      output_html << tree_leaves_[i]->position_.y_ - 1;
-      output_html << "px;\">\n";
-      output_html << "\t\t\t</a>\n";
     }
-  } else {
+    std::string strip_href;
+    if (!bundle.Link(strip_path, &strip_href))
+      return false;
+    // ***************Print Html*******************
+    // Leaves crossing a strip boundary get an area in both strips.
+    output_html << "\t\t\t<img src=\"";
+    output_html.Escaped(strip_href) << "\" usemap=\"#" << buff
+                << "\" width=\"" << strip_rect.width
+                << "\" height=\"" << strip_rect.height
+                << "\" style=\"display:block; border:0;\">\n";
+    output_html << "\t\t\t<map name=\"" << buff << "\">\n";
     for (int i = 0; i < image_num_; ++i) {
-      // ***************Print Html*******************
-      output_html << "\t\t\t<a href=\"";
-      output_html << tree_leaves_[i]->img_path_.c_str();
-      output_html << "\" rel=\"prettyPhoto[pp_gal]\">\n";
-      output_html << "\t\t\t\t<img src=\"";
-      output_html << tree_leaves_[i]->img_path_.c_str();
-      output_html << "\" style=\"position:absolute; width:";
-      output_html << tree_leaves_[i]->position_.width_ - 1;
-      output_html << "px; height:";
-      output_html << tree_leaves_[i]->position_.height_ - 1;
-      output_html << "px; left:";
-      output_html << tree_leaves_[i]->position_.x_ - 1;
-      output_html << "px; top:";
-      output_html << tree_leaves_[i]->position_.y_ - 1;
-      output_html << "px;\">\n";
-      output_html << "\t\t\t</a>\n";
+      FloatRect pos = tree_leaves_[i]->position_;
+      cv::Rect leaf_rect = cv::Rect(pos.x_, pos.y_, pos.width_, pos.height_) & strip_rect;
+      std::string href;
+      if (leaf_rect.area() <= 0)
+        continue;
+      if (!bundle.Link(tree_leaves_[i]->img_path_, &href))
+        return false;
+      output_html << "\t\t\t\t<area shape=\"rect\" coords=\""
+                  << leaf_rect.x << "," << leaf_rect.y - top << ","
+                  << leaf_rect.x + leaf_rect.width << ","
+                  << leaf_rect.y + leaf_rect.height - top
+                  << "\" href=\"";
+      output_html.Escaped(href) << "\" rel=\"prettyPhoto[pp_gal]\" alt=\"\">\n";
     }
+    output_html << "\t\t\t</map>\n";
   }
   output_html << "\t\t</div>\n";
   output_html << "\t</body>\n";
   output_html << "</html>";
-  output_html.close();
+  return output_html.Write(output_html_path, options.compression_);
+}
+
+cv::Size2i CollageAdvanced::HtmlTileSize(const FloatRect& position) {
+  return cv::Size2i(std::max(1, cvRound(position.width_ - 1)),
+                    std::max(1, cvRound(position.height_ - 1)));
+}
+
+bool CollageAdvanced::ExportHtmlTiles(const char type,
+                                      const std::string& tile_dir,
+                                      const HtmlOptions& options,
+                                      std::vector<std::string>* lightbox_paths,
+                                      std::vector<std::string>* grid_paths) {
+  TRACE_SCOPE("ExportHtmlTiles");
+  mkdir(tile_dir.c_str(), S_IRWXU);
+  bool presized = options.lightbox_size_ > 0;
+  std::string extension = options.webp_ ? ".webp" : ".jpg";
+  // Pencil styles share one preloaded tonal texture.
+  cv::Ptr<TonalTexture> tonal;
+  if (!LoadTonal(std::string(1, type), &tonal))
+    return false;
+  // Stylized tiles are looked up in the tile cache (if enabled) before
+  // running the engines. Pre-sized photo tiles are only a resize.
+  TileCache* tile_cache = TileCache::Instance();
+  std::string style_params;
+  if (tile_cache->enabled() && ('p' != type)) {
+    std::ostringstream params;
+    params << StyleParams(type) << " framed";
+    if (presized)
+      params << " lightbox=" << options.lightbox_size_;
+    style_params = params.str();
+  }
+  
+  // Sources of the tiles missing from the cache are read ahead on I/O
+  // threads, then tiles are stylized and encoded on thread_num_ workers.
+  std::vector<HtmlTileItem*> items(image_num_);
+  std::vector<char> prefetched(image_num_, 0);
+  std::vector<char> success(image_num_, 0);
+  std::vector<PrefetchRequest> requests;
+  char buff[255];
+  for (int i = 0; i < image_num_; ++i) {
+    const std::string& img_path = tree_leaves_[i]->img_path_;
+    std::sprintf(buff, "%d", i);
+    (*lightbox_paths)[i] = tile_dir + buff + TileSuffix(type) + extension;
+    (*grid_paths)[i] = presized ?
+        tile_dir + buff + "_grid" + TileSuffix(type) + extension :
+        (*lightbox_paths)[i];
+    cv::Size2i size = ImageStore::Instance()->GetSize(img_path);
+    std::string tile_key;
+    if (!style_params.empty())
+      tile_key = tile_cache->Key(img_path, type, style_params, size);
+    items[i] = new HtmlTileItem(type, img_path, tile_key, (*lightbox_paths)[i],
+                                presized ? (*grid_paths)[i] : std::string(),
+                                HtmlTileSize(tree_leaves_[i]->position_),
+                                tonal, options, &success[i]);
+    if (tile_cache->Contains(tile_key))
+      continue;
+    prefetched[i] = 1;
+    if (presized)
+      requests.push_back(PrefetchRequest(img_path, CappedSize(size, options.lightbox_size_)));
+    else
+      requests.push_back(PrefetchRequest(img_path));
+  }
+  ImagePrefetcher prefetcher(requests, PREFETCH_THREADS, PREFETCH_DEPTH,
+                             prefetch_budget_);
+  {
+    // At most two tiles wait per worker, bounding the decoded sources.
+    int thread_num = std::max(1, options.thread_num_);
+    WorkQueue queue(thread_num, 2 * thread_num);
+    for (int i = 0; i < image_num_; ++i) {
+      if (prefetched[i])
+        items[i]->set_image(prefetcher.Next());
+      queue.Push(items[i]);
+    }
+    queue.Wait();
+  }
+  for (int i = 0; i < image_num_; ++i) {
+    if (!success[i]) {
+      LOG(LOG_ERROR, "cannot export html tile " << (*lightbox_paths)[i]);
+      return false;
+    }
+  }
   return true;
 }
 
+namespace {
 
+// Rect of a leaf on a canvas scaled by scale. Edges are rounded, so
+// neighbouring leaves stay adjacent at every level.
+cv::Rect ScaledRect(const FloatRect& pos, double scale) {
+  int left = cvRound(pos.x_ * scale);
+  int top = cvRound(pos.y_ * scale);
+  int right = cvRound((pos.x_ + pos.width_) * scale);
+  int bottom = cvRound((pos.y_ + pos.height_) * scale);
+  return cv::Rect(left, top, right - left, bottom - top);
+}
 
+// Renders one leaf at the size of a deep zoom level.
+class ZoomLeafItem : public WorkItem {
+public:
+  ZoomLeafItem(const char type,
+               const std::string& img_path,
+               const std::string& tile_key,
+               const cv::Ptr<TonalTexture>& tonal,
+               bool crop_fit,
+               const cv::Mat& tile)
+  : type_(type), img_path_(img_path), tile_key_(tile_key), tonal_(tonal),
+    crop_fit_(crop_fit), tile_(tile) {
+    session_ = Trace::enabled() ? Trace::session() : NULL;
+  }
+  virtual void Run() {
+    TraceSessionScope session_scope(session_);
+    TRACE_SCOPE("leaf");
+    if (TileCache::Instance()->Get(tile_key_, &tile_))
+      return;
+    // The engines run at the level's resolution, but not below
+    // DEEPZOOM_MIN_STYLED pixels, where their strokes fall apart.
+    cv::Size2i size = tile_.size();
+    int longer = std::max(size.width, size.height);
+    if (('p' != type_) && (longer < DEEPZOOM_MIN_STYLED)) {
+      double scale = static_cast<double>(DEEPZOOM_MIN_STYLED) / longer;
+      size = cv::Size2i(cvRound(size.width * scale), cvRound(size.height * scale));
+    }
+    cv::Mat image = ImageStore::Instance()->GetThumbnail(img_path_, size);
+    if (image.empty()) {
+      LOG(LOG_WARNING, "cannot read " << img_path_ << ", its tiles stay black");
+      return;
+    }
+    if (crop_fit_)
+      image = image(SaliencyCrop(image, tile_.size()));
+    cv::Mat source = image;
+    if (('p' != type_) && (image.cols > size.width) && (image.rows > size.height))
+      cv::resize(image, source, size, 0, 0, cv::INTER_AREA);
+    bool rendered = false;
+    if (size == tile_.size()) {
+      rendered = RenderTile(type_, source, tonal_, cv::Ptr<CoherentLine>(), &tile_);
+    } else {
+      cv::Mat styled(size, CV_8UC3);
+      rendered = RenderTile(type_, source, tonal_, cv::Ptr<CoherentLine>(), &styled);
+      if (rendered)
+        cv::resize(styled, tile_, tile_.size(), 0, 0, cv::INTER_AREA);
+    }
+    if (!rendered) {
+      LOG(LOG_WARNING, "cannot render " << img_path_ << ", its tiles stay black");
+      return;
+    }
+    TileCache::Instance()->Put(tile_key_, tile_);
+  }
+private:
+  const char type_;
+  std::string img_path_;
+  std::string tile_key_;
+  cv::Ptr<TonalTexture> tonal_;
+  bool crop_fit_;
+  cv::Mat tile_;  // Shares pixels with the level's leaf map entry.
+  TraceSession* session_;
+};
+
+// Encodes one pyramid tile.
+class ZoomTileItem : public WorkItem {
+public:
+  ZoomTileItem(const std::string& path,
+               const cv::Mat& tile,
+               const std::vector<int>& params,
+               char* success)
+  : path_(path), tile_(tile), params_(params), success_(success) {}
+  virtual void Run() {
+    TRACE_SCOPE("encode");
+    if (!cv::imwrite(path_, tile_, params_))
+      *success_ = 0;
+  }
+private:
+  std::string path_;
+  cv::Mat tile_;
+  const std::vector<int>& params_;
+  char* success_;
+};
+
+}  // namespace
+
+bool CollageAdvanced::OutputDeepZoom(const char type,
+                                     const std::string& dzi_path,
+                                     const DeepZoomOptions& options) {
+  TRACE_SCOPE("OutputDeepZoom");
+  if ((-1 == canvas_alpha_) || (-1 == canvas_width_) || (-1 == canvas_height_)) {
+    LOG(LOG_ERROR, "OutputDeepZoom...");
+    return false;
+  }
+  if ((std::string("pmeoci").find(type) == std::string::npos) ||
+      (options.tile_size_ < 1) || (options.overlap_ < 0) || (options.scale_ <= 0)) {
+    LOG(LOG_ERROR, "unsupported deep zoom style or options");
+    return false;
+  }
+  const int tile_size = options.tile_size_;
+  const int overlap = options.overlap_;
+  const int width = std::max(1, cvRound(canvas_width_ * options.scale_));
+  const int height = std::max(1, cvRound(canvas_height_ * options.scale_));
+  // Level max_level is width x height; each level below halves it, down to
+  // a single pixel at level 0.
+  int max_level = 0;
+  while ((1 << max_level) < std::max(width, height)) {
+    ++max_level;
+  }
+  std::string extension = options.webp_ ? "webp" : "jpg";
+  std::string files_dir = dzi_path.substr(0, dzi_path.rfind('.')) + "_files/";
+  mkdir(files_dir.c_str(), S_IRWXU);
+  std::vector<int> params;
+  params.push_back(options.webp_ ? CV_IMWRITE_WEBP_QUALITY : CV_IMWRITE_JPEG_QUALITY);
+  params.push_back(options.quality_);
+  // Pencil styles share one preloaded tonal texture.
+  cv::Ptr<TonalTexture> tonal;
+  if (!LoadTonal(std::string(1, type), &tonal))
+    return false;
+  TileCache* tile_cache = TileCache::Instance();
+  std::string style_params;
+  if (tile_cache->enabled() && ('p' != type))
+    style_params = StyleParams(type) + " zoom" + (crop_fit_ ? " crop" : "");
+  
+  int thread_num = std::max(1, options.thread_num_);
+  WorkQueue queue(thread_num, 2 * thread_num);
+  char buff[255];
+  for (int level = max_level; level >= 0; --level) {
+    TRACE_SCOPE("level");
+    const int shift = max_level - level;
+    const cv::Rect level_rect(0, 0, ((width - 1) >> shift) + 1, ((height - 1) >> shift) + 1);
+    const double scale = options.scale_ / (1 << shift);
+    std::sprintf(buff, "%d/", level);
+    std::string level_dir = files_dir + buff;
+    mkdir(level_dir.c_str(), S_IRWXU);
+    std::vector<cv::Rect> leaf_rects(image_num_);
+    for (int i = 0; i < image_num_; ++i) {
+      leaf_rects[i] = ScaledRect(tree_leaves_[i]->position_, scale) & level_rect;
+    }
+    
+    // One band of tile rows at a time. Each leaf is rendered once per
+    // level, when the first band crossing it is reached, and dropped after
+    // the last one.
+    std::map<int, cv::Mat> leaves;
+    const int row_num = (level_rect.height - 1) / tile_size + 1;
+    const int col_num = (level_rect.width - 1) / tile_size + 1;
+    for (int row = 0; row < row_num; ++row) {
+      int band_top = std::max(0, row * tile_size - overlap);
+      int band_bottom = std::min(level_rect.height, (row + 1) * tile_size + overlap);
+      cv::Rect band_rect(0, band_top, level_rect.width, band_bottom - band_top);
+      cv::Mat band(band_rect.size(), CV_8UC3, cv::Scalar(0, 0, 0));
+      std::vector<int> band_leaves;
+      for (int i = 0; i < image_num_; ++i) {
+        if ((leaf_rects[i] & band_rect).area() <= 0)
+          continue;
+        band_leaves.push_back(i);
+        if (leaves.count(i))
+          continue;
+        const std::string& img_path = tree_leaves_[i]->img_path_;
+        cv::Mat tile(leaf_rects[i].size(), CV_8UC3, cv::Scalar(0, 0, 0));
+        std::string tile_key;
+        if (!style_params.empty())
+          tile_key = tile_cache->Key(img_path, type, style_params, tile.size());
+        leaves[i] = tile;
+        queue.Push(new ZoomLeafItem(type, img_path, tile_key, tonal, crop_fit_, tile));
+      }
+      queue.Wait();
+      for (int k = 0; k < static_cast<int>(band_leaves.size()); ++k) {
+        int i = band_leaves[k];
+        cv::Rect visible = leaf_rects[i] & band_rect;
+        cv::Mat source(leaves[i], visible - leaf_rects[i].tl());
+        cv::Mat target(band, visible - band_rect.tl());
+        source.copyTo(target);
+        // Leaves ending above the next band are not needed any more.
+        if (leaf_rects[i].br().y <= (row + 1) * tile_size - overlap)
+          leaves.erase(i);
+      }
+      
+      char success = 1;
+      for (int col = 0; col < col_num; ++col) {
+        int left = std::max(0, col * tile_size - overlap);
+        int right = std::min(level_rect.width, (col + 1) * tile_size + overlap);
+        std::sprintf(buff, "%d_%d.", col, row);
+        queue.Push(new ZoomTileItem(level_dir + buff + extension,
+                                    band(cv::Rect(left, 0, right - left, band.rows)),
+                                    params, &success));
+      }
+      queue.Wait();
+      if (!success) {
+        LOG(LOG_ERROR, "cannot write deep zoom tiles to " << level_dir);
+        return false;
+      }
+    }
+  }
+  
+  HtmlWriter dzi;
+  dzi << "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+  dzi << "<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" TileSize=\""
+      << tile_size << "\" Overlap=\"" << overlap << "\" Format=\"" << extension << "\">\n";
+  dzi << "  <Size Width=\"" << width << "\" Height=\"" << height << "\"/>\n";
+  dzi << "</Image>\n";
+  return dzi.Write(dzi_path, HTML_PLAIN);
+}
+
+bool CollageAdvanced::LoadTonal(const std::string& types,
+                                cv::Ptr<TonalTexture>* tonal) const {
+  if ((types.find('e') == std::string::npos) && (types.find('o') == std::string::npos))
+    return true;
+  if (tonal_path_.empty()) {
+    LOG(LOG_ERROR, "pencil styles need a tonal texture (set_tonal_path)");
+    return false;
+  }
+  *tonal = TonalTexturePool::Instance()->Get(tonal_path_);
+  if (tonal->empty()) {
+    LOG(LOG_ERROR, "cannot read tonal texture " << tonal_path_);
+    return false;
+  }
+  return true;
+}
+
+std::string CollageAdvanced::StyleParams(const char type) const {
+  // Bump NPR_VERSION whenever an engine changes its output.
+  std::ostringstream params;
+  params << "v" << NPR_VERSION << " ";
+  switch (type) {
+    case 'm': {
+      params << "manga fixed_point dither=" << BAYER_2X2;
+      break;
+    }
+    case 'e':
+    case 'o': {
+      // Textures are identified by content, not by path.
+      uint64 tonal_hash = 0;
+      HashFile(tonal_path_, &tonal_hash);
+      params << "sketch tonal=" << HashToHex(tonal_hash);
+      break;
+    }
+    case 'c': {
+      params << "cartoon";
+      break;
+    }
+    case 'i': {
+      params << "painting";
+      break;
+    }
+    default: {
+      params << "photo";
+      break;
+    }
+  }
+  return params.str();
+}
@@ -12,14 +12,22 @@
 #include "MangaEngine.h"
 #include "CartoonEngine.h"
 #include "SketchEngine.h"
+#include "HtmlBundle.h"
 #include <iostream>
+#include <map>
 #include <opencv2/opencv.hpp>
+#include <set>
 #include <string>
 #include <vector>
 #include <time.h>
 #define random(x) (rand() % x)
 #define MAX_ITER_NUM 100      // Max number of aspect ratio adjustment.
 #define MAX_TREE_GENE_NUM 10000  // Max number of tree re-generation.
+#define NPR_VERSION 1            // Version of stylized output, part of tile cache keys.
+#define DEEPZOOM_TILE_SIZE 254  // DZI tiles of 256 pixels with the overlap.
+#define DEEPZOOM_OVERLAP 1
+#define DEEPZOOM_SCALE 4
+#define DEEPZOOM_MIN_STYLED 64   // Smallest leaf side the style engines see.
 
 class FloatRect {
 public:
@@ -43,6 +51,7 @@ public:
     is_leaf_ = true;
     alpha_ = 0;
     alpha_expect_ = 0;
+    weight_ = 1;
     position_ = FloatRect();
     left_child_ = NULL;
     right_child_ = NULL;
@@ -55,6 +64,7 @@ public:
   bool is_leaf_;         // Is this node a leaf node or a inner node.
   float alpha_expect_;   // If this node is a leaf, we set expected aspect ratio of this node.
   float alpha_;          // If this node is a leaf, we set actual aspect ratio of this node.
+  float weight_;         // Image weight of a leaf, sum of the leaves' for an inner node.
   FloatRect position_;    // The position of the node on canvas.
   TreeNode* left_child_;
   TreeNode* right_child_;
@@ -64,12 +74,49 @@ public:
 
 class AlphaUnit {
 public:
+  AlphaUnit() : image_ind_(0), alpha_(0), alpha_recip_(0), weight_(1) {}
   int image_ind_;          // The related image index.
   float alpha_;            // Aspect ratio value.
   float alpha_recip_;      // Reciprocal sapect ratio value.
+  float weight_;           // Importance: relative share of the canvas area.
   std::string image_path_; // The related image path.
 };
 
+// Settings of CollageAdvanced::OutputDeepZoom().
+class DeepZoomOptions {
+public:
+  DeepZoomOptions() {
+    tile_size_ = DEEPZOOM_TILE_SIZE;
+    overlap_ = DEEPZOOM_OVERLAP;
+    scale_ = DEEPZOOM_SCALE;
+    quality_ = HTML_QUALITY;
+    webp_ = false;
+    thread_num_ = 1;
+  }
+  int tile_size_;   // Tile side, without the overlap.
+  int overlap_;     // Pixels shared with each neighbouring tile.
+  // The full-resolution level is the canvas scaled by scale_, so leaves
+  // can be zoomed into beyond their size on the canvas.
+  float scale_;
+  int quality_;     // 1 - 100.
+  bool webp_;       // Encode tiles as WebP instead of JPEG.
+  int thread_num_;  // Leaves rendered and tiles encoded in parallel.
+};
+
+// Render state of one leaf on the canvas kept by UpdateCollage().
+class LeafState {
+public:
+  LeafState() : style_(0), accurate_(false), crop_fit_(false), mtime_(0), file_size_(0) {}
+  cv::Rect rect_;
+  char style_;
+  bool accurate_;
+  bool crop_fit_;
+  std::string img_path_;
+  // Stamp of the source file: a rewritten image is rendered again.
+  int64 mtime_;
+  int64 file_size_;
+};
+
 // Collage with pre-defined aspect ratio
 class CollageAdvanced {
 public:
@@ -78,6 +125,11 @@ public:
   // Since the aspect ratio will be calculate by our program, we can compute
   // canvas width accordingly.
   CollageAdvanced(const std::vector<std::string> input_image_list);
+  // Image sizes are given by the caller, e.g. from an index or for
+  // benchmarking the layout on synthetic aspect ratios. No file is read
+  // until the collage is rendered.
+  CollageAdvanced(const std::vector<std::string>& input_image_list,
+                  const std::vector<cv::Size2i>& image_sizes);
   ~CollageAdvanced() {
     ReleaseTree(tree_root_);
     image_alpha_vec_.clear();
@@ -107,6 +159,7 @@ public:
   // threshold: the threshold to stop collage generation.
   // manga_mode: if it is true, the split-type for root node is set to 'h'.
   // style: reading style. ('u': left-to-right; 'j': right-to_left).
+  // Returns false at once if the pins (see PinImage) cannot be satisfied.
   bool CreateCollage(const cv::Size2i canvas_size,
                      const int border_size,
                      const float threshold,
@@ -147,6 +200,52 @@ public:
     return B5Manga('u');
   }
   
+  // Incremental editing of a created collage, without re-probing the other
+  // images or regenerating the tree. image_alpha_vec_ stays sorted, an
+  // added image splits one of the shallowest leaves, and a removed image's
+  // sibling takes the place of their parent. AdjustAlpha() then brings the
+  // canvas ratio back within the bounds of the last CreateCollage(), first
+  // on the edited nodes' ancestors only, so the rest of the tree keeps its
+  // splits, then on the whole tree; only if that fails is the tree
+  // regenerated. Before the first CreateCollage() only the image set
+  // changes.
+  bool AddImages(const std::vector<std::string>& image_list);
+  bool AddImages(const std::vector<std::string>& image_list,
+                 const std::vector<cv::Size2i>& image_sizes);
+  // Removes one image per listed path. Returns false, changing nothing, if
+  // a path is not in the collage.
+  bool RemoveImages(const std::vector<std::string>& image_list);
+  // Indices into the leaf order of the leaves that are new or whose rect
+  // changed in the last AddImages() / RemoveImages(), e.g. to re-render
+  // only those.
+  const std::vector<int>& changed_leaves() const {
+    return changed_leaves_;
+  }
+  // Canvas rect of the leaf showing img_path. False if it has none.
+  bool LeafPosition(const std::string& img_path, FloatRect* position) const;
+  // Importance of img_path (default 1), e.g. higher for starred photos or
+  // faces. The next CreateCollage() splits the images into subtrees of
+  // equal total weight, so leaves get areas roughly in proportion to their
+  // weights. Returns false if img_path is not in the collage or weight <= 0.
+  bool SetImageWeight(const std::string& img_path, float weight);
+  // Place img_path at position rank of the reading order in the next
+  // CreateCollage(); negative ranks count from the end. Leaves are read
+  // in tree order with style 'u' (left child on the left or top) and 'j'
+  // (left child on the right or top), so rank 0 is at the top-left ('u')
+  // or top-right ('j') corner and rank -1 at the opposite bottom corner.
+  // AddImages() / RemoveImages() keep the first and last leaf in place.
+  bool PinImage(const std::string& img_path, int rank);
+  void ClearPins() {
+    pins_.clear();
+  }
+  // Show new_path in the leaf of old_path. The leaf keeps its rect, so no
+  // other leaf moves. Returns false if old_path is not in the collage or
+  // new_path cannot be read.
+  bool ReplaceImage(const std::string& old_path, const std::string& new_path);
+  // Render the leaf of img_path in style type instead of the collage's
+  // style (OutputCollage() and UpdateCollage()); 0 restores the default.
+  void SetLeafStyle(const std::string& img_path, const char type);
+  
   // Collage output:
   // 'type' refers to the kind of non-photorealistic features we provide.
   // 'type = 'p': Output as a photo collage.
@@ -155,18 +254,47 @@ public:
   // 'type = 'o': Output as a color pencil sketch collage.
   // 'type = 'c': Output as a cartoon collage.
   // 'type = 'i': Output as a oil painting collage.
+  // 'accurate = false': fast preview, styles run on indexed thumbnails
+  // (see ImageStore::set_index) instead of full-resolution images.
   cv::Mat OutputCollage(const char type, bool accurate);
   cv::Mat OutputCollage(const char type) {
     return OutputCollage(type, true);
   }
+  // Re-render the canvas of the previous UpdateCollage() after edits.
+  // Leaves whose size, style and source file are unchanged are kept or
+  // moved; only the others run through the style engines. damage receives
+  // the canvas areas that changed (the whole canvas if its size changed).
+  // The collage keeps the returned canvas for the next call: clone it
+  // before drawing on it.
+  cv::Mat UpdateCollage(const char type,
+                        bool accurate,
+                        std::vector<cv::Rect>* damage);
+  // Output the collage in every style of types (e.g. "pmc"), one canvas per
+  // style in the same order. Each source image is decoded and its edges
+  // analyzed once for all styles; leaves are rendered on thread_num workers
+  // and the styles of a leaf run in parallel. A style may appear only once.
+  bool OutputCollages(const std::string& types,
+                      int thread_num,
+                      std::vector<cv::Mat>* canvases);
   
   // B. Output as a html file.
   bool OutputHtml(const char type, const std::string output_html_path);
+  bool OutputHtml(const char type,
+                  const std::string output_html_path,
+                  const HtmlOptions& options);
+  // C. Output as a Deep Zoom (DZI) pyramid for pan-and-zoom viewers such
+  // as OpenSeadragon: dzi_path ("wall.dzi") describes the image and tiles
+  // go to wall_files/<level>/<column>_<row>.jpg. Every level is rendered
+  // from the leaves crossing each tile, stylized at that level's size.
+  bool OutputDeepZoom(const char type,
+                      const std::string& dzi_path,
+                      const DeepZoomOptions& options);
   /****************************************************************************/
   
   // Output collage into a single image.
   cv::Mat OutputCollageImage() const;
-  // Output collage into a html page.
+  // Output collage into a html page linking the source photos, i.e.
+  // OutputHtml('p', ...) with default options.
   bool OutputCollageHtml (const std::string output_html_path);
   
   // Accessors:
@@ -182,8 +310,32 @@ public:
   float canvas_alpha() const {
     return canvas_alpha_;
   }
+  const std::string& tonal_path() const {
+    return tonal_path_;
+  }
+  // Tonal texture for 'e' and 'o' output, which fails without one.
+  // Textures are loaded once per process by TonalTexturePool.
+  void set_tonal_path(const std::string& tonal_path) {
+    tonal_path_ = tonal_path;
+  }
+  // Bytes of decoded source images read ahead of the renderer.
+  void set_prefetch_budget(size_t prefetch_budget) {
+    prefetch_budget_ = prefetch_budget;
+  }
+  bool crop_fit() const {
+    return crop_fit_;
+  }
+  // Crop fit mode: each source is cropped to its leaf's aspect ratio around
+  // its most salient region (see SaliencyCrop) instead of being stretched.
+  // Applies to the canvas outputs and deep zoom, not to html lightboxes.
+  void set_crop_fit(bool crop_fit) {
+    crop_fit_ = crop_fit;
+  }
   
 private:
+  // Shared by the constructors.
+  void Init(const std::vector<std::string>& input_image_list,
+            const std::vector<cv::Size2i>& image_sizes);
   // Recursively calculate aspect ratio for all the inner nodes.
   // The return value is the aspect ratio for the node.
   float CalculateAlpha(TreeNode* node);
@@ -202,6 +354,31 @@ private:
                        int image_num,
                        std::vector<AlphaUnit>& alpha_array,
                        float root_alpha);
+  // Split alpha_array into two parts of about equal total weight, each
+  // keeping the alpha order.
+  // left_num >= 0 puts exactly that many images into left_array.
+  // Images of equal weight are dealt in their alpha order rotated by
+  // rotation, which gives regenerated trees other splits of the same
+  // weight balance.
+  static void PartitionByWeight(const std::vector<AlphaUnit>& alpha_array,
+                                int left_num,
+                                int rotation,
+                                std::vector<AlphaUnit>* left_array,
+                                std::vector<AlphaUnit>* right_array);
+  // Resolve pins_ into pinned_leaves_. False if two share a rank or a rank
+  // is out of range.
+  bool ResolvePins();
+  // Number of pinned leaves among the leaf_num leaves from first_leaf,
+  // adding their weights to weight if not NULL.
+  int PinnedLeaves(int first_leaf, int leaf_num, float* weight) const;
+  // Bounds of the aspect ratio node reaches over all split types below it.
+  void AlphaRange(const TreeNode* node, float* min_alpha, float* max_alpha) const;
+  // GenerateTree() until a tree whose AlphaRange() meets the bounds comes
+  // up, counting trees in tree_gene_counter. False past MAX_TREE_GENE_NUM.
+  bool GenerateFeasibleTree(float expect_alpha,
+                            float lower_bound,
+                            float upper_bound,
+                            int* tree_gene_counter);
   // Find the best-match aspect ratio image in the given array.
   // alpha_array is the array storing aspect ratios.
   // find_img_alpha is the best-match alpha value.
@@ -223,8 +400,48 @@ private:
                      std::string& find_img_path_1,
                      float& find_img_alpha_2,
                      std::string& find_img_path_2);
-  // Top-down adjust aspect ratio for the final collage.
-  bool AdjustAlpha(TreeNode* node, float thresh);
+  // Top-down adjust aspect ratio for the final collage. With a path, only
+  // the nodes in it are adjusted and recursed into.
+  bool AdjustAlpha(TreeNode* node, float thresh,
+                   const std::set<const TreeNode*>* path = NULL);
+  // Write the html tiles of every leaf into tile_dir and return their
+  // paths, in leaf order.
+  bool ExportHtmlTiles(const char type,
+                       const std::string& tile_dir,
+                       const HtmlOptions& options,
+                       std::vector<std::string>* lightbox_paths,
+                       std::vector<std::string>* grid_paths);
+  // OutputHtml() in sprite mode.
+  bool OutputSpriteHtml(const char type,
+                        const std::string& output_html_path,
+                        const HtmlOptions& options);
+  // Integer display size of a leaf in the html page.
+  static cv::Size2i HtmlTileSize(const FloatRect& position);
+  // Render leaves (indices into tree_leaves_), each in its style of types,
+  // into their rects of canvas.
+  bool RenderLeaves(const std::vector<int>& leaves,
+                    const std::vector<char>& types,
+                    bool accurate,
+                    cv::Mat* canvas);
+  // Style of a leaf in output of type, see SetLeafStyle().
+  char LeafStyle(int leaf, const char type) const;
+  // Tonal texture of the pencil styles among types into tonal. Returns
+  // false if there are some and the texture cannot be loaded.
+  bool LoadTonal(const std::string& types, cv::Ptr<TonalTexture>* tonal) const;
+  // Engine parameters of style type, as part of tile cache keys.
+  std::string StyleParams(const char type) const;
+  // Shallowest leaf to split for a new image of aspect ratio alpha.
+  TreeNode* FindSplitLeaf(float alpha) const;
+  // Unlink a leaf; its sibling takes the place of their parent. Returns
+  // the sibling.
+  TreeNode* RemoveLeaf(TreeNode* leaf);
+  // Rebuild tree_leaves_ in left-to-right tree order.
+  void CollectLeaves(TreeNode* node);
+  // Restore the canvas ratio and positions after a tree edit at the nodes
+  // of edited and record changed_leaves_ against the positions before the
+  // edit.
+  bool Relayout(const std::map<const TreeNode*, FloatRect>& old_positions,
+                const std::set<TreeNode*>& edited);
   
   // Vector containing input images' aspect ratios.
   std::vector<AlphaUnit> image_alpha_vec_;
@@ -232,6 +449,15 @@ private:
   std::vector<TreeNode*> tree_leaves_;
   // Number of images in the collage. (number of leaf nodes in the tree)
   int image_num_;
+  // Set by GenerateTree() if the image weights differ.
+  bool weighted_layout_;
+  // Number of the tree GenerateFeasibleTree() is generating.
+  int tree_generation_;
+  // PinImage() ranks by path, and the images they resolve to by leaf rank.
+  std::map<std::string, int> pins_;
+  std::map<int, AlphaUnit> pinned_leaves_;
+  // Split type forced on the root ('h' in manga mode), or 'N'.
+  char root_split_;
   // Full balanced binary for collage generation.
   TreeNode* tree_root_;
   // Canvas height, this is decided by the user.
@@ -240,6 +466,22 @@ private:
   float canvas_alpha_;
   // Canvas width, this is computed according to canvas_aspect_ratio_.
   int canvas_width_;
+  // Tonal texture path for pencil sketch output.
+  std::string tonal_path_;
+  size_t prefetch_budget_;
+  bool crop_fit_;
+  // Parameters of the last CreateCollage(), reused by Relayout().
+  cv::Size2i layout_size_;
+  int layout_border_;
+  float layout_threshold_;
+  bool layout_manga_mode_;
+  char layout_style_;
+  std::vector<int> changed_leaves_;
+  // Styles set by SetLeafStyle(), by image path.
+  std::map<std::string, char> leaf_styles_;
+  // Canvas of the last UpdateCollage() and the state of each leaf on it.
+  cv::Mat rendered_canvas_;
+  std::vector<LeafState> rendered_leaves_;
   
 };
 
@@ -0,0 +1,47 @@
+//
+//  ContentHash.cpp
+//  image-browser
+//
+
+#include "ContentHash.h"
+#include <stdio.h>
+
+uint64 HashBytes(const void* data, size_t size, uint64 hash) {
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+uint64 HashString(const std::string& str, uint64 hash) {
+  // Include the length, so that consecutive strings cannot collide by
+  // moving characters between them.
+  uint64 size = str.size();
+  hash = HashBytes(&size, sizeof(size), hash);
+  return HashBytes(str.data(), str.size(), hash);
+}
+
+bool HashFile(const std::string& path, uint64* hash) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (NULL == file)
+    return false;
+  uint64 result = FNV_OFFSET_BASIS;
+  unsigned char buff[1 << 16];
+  size_t read_size = 0;
+  while ((read_size = fread(buff, 1, sizeof(buff), file)) > 0) {
+    result = HashBytes(buff, read_size, result);
+  }
+  bool success = !ferror(file);
+  fclose(file);
+  if (success)
+    *hash = result;
+  return success;
+}
+
+std::string HashToHex(uint64 hash) {
+  char buff[17];
+  snprintf(buff, sizeof(buff), "%016llx", static_cast<unsigned long long>(hash));
+  return std::string(buff);
+}
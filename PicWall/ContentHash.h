@@ -0,0 +1,24 @@
+//
+//  ContentHash.h
+//  image-browser
+//
+//  64-bit FNV-1a hashing of memory and files.
+//
+
+#ifndef __image_browser__ContentHash__
+#define __image_browser__ContentHash__
+
+#include <opencv2/opencv.hpp>
+#include <string>
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+// Continue hash over size bytes. Start with FNV_OFFSET_BASIS.
+uint64 HashBytes(const void* data, size_t size, uint64 hash);
+uint64 HashString(const std::string& str, uint64 hash);
+// Hash of a file's content. Returns false if the file cannot be read.
+bool HashFile(const std::string& path, uint64* hash);
+// 16 lowercase hex digits.
+std::string HashToHex(uint64 hash);
+
+#endif /* defined(__image_browser__ContentHash__) */
@@ -0,0 +1,73 @@
+//
+//  CropFit.cpp
+//  image-browser
+//
+
+#include "CropFit.h"
+#include <algorithm>
+#include <math.h>
+#include <vector>
+
+cv::Rect SaliencyCrop(const cv::Mat& image, const cv::Size2i& target_size) {
+  cv::Rect whole(0, 0, image.cols, image.rows);
+  if (image.empty() || (target_size.width <= 0) || (target_size.height <= 0))
+    return whole;
+  double image_alpha = static_cast<double>(image.cols) / image.rows;
+  double target_alpha = static_cast<double>(target_size.width) / target_size.height;
+  if (fabs(image_alpha / target_alpha - 1) < CROP_TOLERANCE)
+    return whole;
+  // Wider than the leaf: crop columns, otherwise rows.
+  bool crop_width = (image_alpha > target_alpha);
+
+  cv::Mat map = image;
+  int longer = std::max(image.cols, image.rows);
+  if (longer > CROP_MAP_SIZE) {
+    double scale = static_cast<double>(CROP_MAP_SIZE) / longer;
+    cv::Size2i map_size(std::max(1, cvRound(image.cols * scale)),
+                        std::max(1, cvRound(image.rows * scale)));
+    cv::resize(image, map, map_size, 0, 0, cv::INTER_AREA);
+  }
+  cv::Mat gray;
+  if (3 == map.channels())
+    cv::cvtColor(map, gray, CV_BGR2GRAY);
+  else
+    gray = map;
+  cv::Mat dx, dy, saliency;
+  cv::Sobel(gray, dx, CV_32F, 1, 0);
+  cv::Sobel(gray, dy, CV_32F, 0, 1);
+  cv::magnitude(dx, dy, saliency);
+  cv::GaussianBlur(saliency, saliency, cv::Size(5, 5), 0);
+  // Only the cropped axis matters: sum saliency across the other one.
+  cv::Mat profile;
+  cv::reduce(saliency, profile, crop_width ? 0 : 1, CV_REDUCE_SUM);
+  profile = profile.reshape(1, 1);
+  int length = profile.cols;
+  double mean = cv::sum(profile)[0] / length;
+  std::vector<double> prefix(length + 1, 0);
+  for (int i = 0; i < length; ++i) {
+    double center = 1 - fabs(2 * (i + 0.5) / length - 1);
+    prefix[i + 1] = prefix[i] + profile.at<float>(0, i) +
+                    CROP_CENTER_WEIGHT * mean * center;
+  }
+
+  int image_length = crop_width ? image.cols : image.rows;
+  int window = crop_width ? cvRound(image.rows * target_alpha) :
+                            cvRound(image.cols / target_alpha);
+  window = std::max(1, std::min(image_length, window));
+  double map_scale = static_cast<double>(length) / image_length;
+  int map_window = std::max(1, std::min(length, cvRound(window * map_scale)));
+  int best_start = 0;
+  double best_sum = -1;
+  for (int start = 0; start + map_window <= length; ++start) {
+    double sum = prefix[start + map_window] - prefix[start];
+    if (sum > best_sum) {
+      best_sum = sum;
+      best_start = start;
+    }
+  }
+  int offset = std::max(0, std::min(image_length - window,
+                                    cvRound(best_start / map_scale)));
+  if (crop_width)
+    return cv::Rect(offset, 0, window, image.rows);
+  return cv::Rect(0, offset, image.cols, window);
+}
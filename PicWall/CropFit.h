@@ -0,0 +1,23 @@
+//
+//  CropFit.h
+//  image-browser
+//
+//  Saliency-guided cropping of collage sources to the aspect ratio of their leaf.
+//
+
+#ifndef __image_browser__CropFit__
+#define __image_browser__CropFit__
+
+#include <opencv2/opencv.hpp>
+#define CROP_MAP_SIZE 64         // Longer side of the saliency map.
+#define CROP_TOLERANCE 0.02      // Relative ratio mismatch that is only resized.
+#define CROP_CENTER_WEIGHT 0.5   // Center prior, relative to the mean saliency.
+
+// Largest window of image with the aspect ratio of target_size, placed over
+// its most salient part. Saliency is the smoothed gradient magnitude of a
+// CROP_MAP_SIZE thumbnail plus a center prior, so the cost does not depend
+// on the image size beyond one downscale. Returns the whole image if the
+// ratios already match within CROP_TOLERANCE.
+cv::Rect SaliencyCrop(const cv::Mat& image, const cv::Size2i& target_size);
+
+#endif /* defined(__image_browser__CropFit__) */
@@ -0,0 +1,181 @@
+//
+//  Halftone.cpp
+//  image-browser
+//
+
+#include "Halftone.h"
+#include <math.h>
+#include <vector>
+
+// Side length of the blue-noise mask.
+#define BLUE_NOISE_SIZE 32
+// Gaussian sigma of the void-and-cluster energy filter.
+#define BLUE_NOISE_SIGMA 1.5f
+
+// Recursive Bayer index matrix of size n (a power of 2), values [0, n * n).
+static cv::Mat BayerIndex(int n) {
+  cv::Mat index(1, 1, CV_32SC1, cv::Scalar(0));
+  for (int size = 1; size < n; size *= 2) {
+    cv::Mat next(size * 2, size * 2, CV_32SC1);
+    for (int r = 0; r < size; ++r) {
+      for (int c = 0; c < size; ++c) {
+        int v = index.at<int>(r, c) * 4;
+        next.at<int>(r, c) = v;
+        next.at<int>(r, c + size) = v + 2;
+        next.at<int>(r + size, c) = v + 3;
+        next.at<int>(r + size, c + size) = v + 1;
+      }
+    }
+    index = next;
+  }
+  return index;
+}
+
+// Toroidal gaussian energy of one pixel, added to (or removed from) energy.
+static void SplatEnergy(const std::vector<float>& kernel,
+                        int r0,
+                        int c0,
+                        float sign,
+                        std::vector<float>* energy) {
+  int n = BLUE_NOISE_SIZE;
+  for (int r = 0; r < n; ++r) {
+    int dr = std::min(abs(r - r0), n - abs(r - r0));
+    for (int c = 0; c < n; ++c) {
+      int dc = std::min(abs(c - c0), n - abs(c - c0));
+      (*energy)[r * n + c] += sign * kernel[dr * n + dc];
+    }
+  }
+}
+
+// Index of the tightest cluster (max energy among set pixels) or of the
+// largest void (min energy among unset pixels).
+static int FindExtreme(const std::vector<float>& energy,
+                       const std::vector<bool>& pattern,
+                       bool cluster) {
+  int best = -1;
+  for (int i = 0; i < static_cast<int>(energy.size()); ++i) {
+    if (pattern[i] != cluster)
+      continue;
+    if ((best < 0) ||
+        (cluster && (energy[i] > energy[best])) ||
+        (!cluster && (energy[i] < energy[best])))
+      best = i;
+  }
+  return best;
+}
+
+// Blue-noise rank matrix by Ulichney's void-and-cluster method.
+static cv::Mat BlueNoiseIndex() {
+  int n = BLUE_NOISE_SIZE;
+  int total = n * n;
+  std::vector<float> kernel(total);
+  for (int r = 0; r < n; ++r) {
+    for (int c = 0; c < n; ++c) {
+      kernel[r * n + c] =
+      expf(-(r * r + c * c) / (2 * BLUE_NOISE_SIGMA * BLUE_NOISE_SIGMA));
+    }
+  }
+  // Step 1: initial pattern with 10% set pixels (fixed seed, reproducible).
+  std::vector<bool> pattern(total, false);
+  std::vector<float> energy(total, 0);
+  unsigned int seed = 12345;
+  int ones = 0;
+  while (ones < total / 10) {
+    seed = seed * 1103515245 + 12345;
+    int i = (seed >> 16) % total;
+    if (pattern[i])
+      continue;
+    pattern[i] = true;
+    SplatEnergy(kernel, i / n, i % n, 1, &energy);
+    ++ones;
+  }
+  // Step 2: move pixels from tightest clusters to largest voids until stable.
+  for (int iter = 0; iter < total; ++iter) {
+    int cluster = FindExtreme(energy, pattern, true);
+    pattern[cluster] = false;
+    SplatEnergy(kernel, cluster / n, cluster % n, -1, &energy);
+    int void_ind = FindExtreme(energy, pattern, false);
+    pattern[void_ind] = true;
+    SplatEnergy(kernel, void_ind / n, void_ind % n, 1, &energy);
+    if (void_ind == cluster)
+      break;
+  }
+  cv::Mat index(n, n, CV_32SC1);
+  // Step 3: rank the initial pixels by removing tightest clusters.
+  std::vector<bool> phase_pattern(pattern);
+  std::vector<float> phase_energy(energy);
+  for (int rank = ones - 1; rank >= 0; --rank) {
+    int cluster = FindExtreme(phase_energy, phase_pattern, true);
+    phase_pattern[cluster] = false;
+    SplatEnergy(kernel, cluster / n, cluster % n, -1, &phase_energy);
+    index.at<int>(cluster / n, cluster % n) = rank;
+  }
+  // Step 4: rank the remaining pixels by filling largest voids.
+  for (int rank = ones; rank < total; ++rank) {
+    int void_ind = FindExtreme(energy, pattern, false);
+    pattern[void_ind] = true;
+    SplatEnergy(kernel, void_ind / n, void_ind % n, 1, &energy);
+    index.at<int>(void_ind / n, void_ind % n) = rank;
+  }
+  return index;
+}
+
+// Map rank indices [0, n * n) to evenly spaced thresholds in (0, 255).
+static cv::Mat IndexToThreshold(const cv::Mat& index) {
+  int levels = index.rows * index.cols + 1;
+  cv::Mat threshold(index.rows, index.cols, CV_8UC1);
+  for (int r = 0; r < index.rows; ++r) {
+    for (int c = 0; c < index.cols; ++c) {
+      threshold.at<uchar>(r, c) =
+      static_cast<uchar>((index.at<int>(r, c) + 1) * 255 / levels);
+    }
+  }
+  return threshold;
+}
+
+static cv::Mat BuildBayer2x2() {
+  uchar bayer[4] = {102, 153, 204, 51};
+  return cv::Mat(2, 2, CV_8UC1, bayer).clone();
+}
+
+const cv::Mat& DitherMatrix(DitherType type) {
+  // Each matrix is built on first use.
+  switch (type) {
+    case BAYER_4X4: {
+      static const cv::Mat bayer_4x4 = IndexToThreshold(BayerIndex(4));
+      return bayer_4x4;
+    }
+    case BAYER_8X8: {
+      static const cv::Mat bayer_8x8 = IndexToThreshold(BayerIndex(8));
+      return bayer_8x8;
+    }
+    case BLUE_NOISE: {
+      static const cv::Mat blue_noise = IndexToThreshold(BlueNoiseIndex());
+      return blue_noise;
+    }
+    default: {
+      static const cv::Mat bayer_2x2 = BuildBayer2x2();
+      return bayer_2x2;
+    }
+  }
+}
+
+bool OrderedDither(const cv::Mat& gray, DitherType type, cv::Mat* halftoning) {
+  if ((NULL == halftoning) || gray.empty() || (CV_8UC1 != gray.type()))
+    return false;
+  const cv::Mat& matrix = DitherMatrix(type);
+  // Tile the threshold matrix along a full row once: matrix.rows x gray.cols.
+  cv::Mat thresholds;
+  cv::copyMakeBorder(matrix, thresholds, 0, 0, 0,
+                     std::max(0, gray.cols - matrix.cols), cv::BORDER_WRAP);
+  thresholds = thresholds.colRange(0, gray.cols);
+  halftoning->create(gray.rows, gray.cols, CV_8UC1);
+  // Compare matrix.rows image rows at a time (vectorized by OpenCV).
+  for (int r = 0; r < gray.rows; r += matrix.rows) {
+    int n = std::min(matrix.rows, gray.rows - r);
+    cv::Mat dst = halftoning->rowRange(r, r + n);
+    cv::compare(gray.rowRange(r, r + n), thresholds.rowRange(0, n), dst,
+                cv::CMP_GE);
+  }
+  return true;
+}
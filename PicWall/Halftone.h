@@ -0,0 +1,29 @@
+//
+//  Halftone.h
+//  image-browser
+//
+//  Ordered dithering with Bayer (2x2, 4x4, 8x8) and blue-noise threshold
+//  matrices. Threshold matrices are built once per process.
+//
+
+#ifndef __image_browser__Halftone__
+#define __image_browser__Halftone__
+
+#include <opencv2/opencv.hpp>
+
+// Threshold matrices for ordered dithering.
+enum DitherType {
+  BAYER_2X2,    // The original manga halftoning pattern.
+  BAYER_4X4,
+  BAYER_8X8,
+  BLUE_NOISE    // 32x32 void-and-cluster mask.
+};
+
+// Threshold matrix of the given type. type: CV_8UC1 [1, 254]
+const cv::Mat& DitherMatrix(DitherType type);
+
+// Ordered dithering of a CV_8UC1 image. halftoning receives a CV_8UC1 image,
+// 255 where gray >= threshold, 0 otherwise.
+bool OrderedDither(const cv::Mat& gray, DitherType type, cv::Mat* halftoning);
+
+#endif /* defined(__image_browser__Halftone__) */
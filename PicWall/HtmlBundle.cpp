@@ -0,0 +1,257 @@
+//
+//  HtmlBundle.cpp
+//  image-browser
+//
+
+#include "HtmlBundle.h"
+#include "ContentHash.h"
+#include "Log.h"
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+namespace {
+
+std::string DirName(const std::string& path) {
+  size_t slash = path.rfind('/');
+  return (std::string::npos == slash) ? std::string() : path.substr(0, slash + 1);
+}
+
+// "dir/name.ext" with hash -> "name.<hex>.ext".
+std::string HashedName(const std::string& path, uint64 hash) {
+  std::string name = path.substr(DirName(path).size());
+  size_t dot = name.rfind('.');
+  if (std::string::npos == dot)
+    dot = name.size();
+  return name.substr(0, dot) + "." + HashToHex(hash) + name.substr(dot);
+}
+
+// Components of path made absolute against the working directory, with
+// "." and ".." resolved.
+std::vector<std::string> AbsoluteComponents(const std::string& path) {
+  std::string absolute = path;
+  if (absolute.empty() || ('/' != absolute[0])) {
+    char cwd[4096];
+    if (NULL != getcwd(cwd, sizeof(cwd)))
+      absolute = std::string(cwd) + "/" + absolute;
+  }
+  std::vector<std::string> components;
+  std::istringstream stream(absolute);
+  std::string component;
+  while (std::getline(stream, component, '/')) {
+    if (component.empty() || ("." == component))
+      continue;
+    if (".." == component) {
+      if (!components.empty())
+        components.pop_back();
+      continue;
+    }
+    components.push_back(component);
+  }
+  return components;
+}
+
+// path as a url: characters with a meaning in urls, quotes and brackets
+// are percent-encoded, so it also stands in css url().
+std::string UrlPath(const std::string& path) {
+  const char unsafe[] = " \"#%'()<>?\\";
+  const char hex[] = "0123456789ABCDEF";
+  std::string url;
+  for (size_t i = 0; i < path.size(); ++i) {
+    unsigned char c = static_cast<unsigned char>(path[i]);
+    if ((c < 0x20) || (0x7f == c) || (NULL != strchr(unsafe, c))) {
+      url += '%';
+      url += hex[c >> 4];
+      url += hex[c & 15];
+    } else {
+      url += path[i];
+    }
+  }
+  return url;
+}
+
+bool ReadFile(const std::string& path, std::string* data) {
+  std::ifstream file(path.c_str(), std::ios::binary);
+  if (!file.is_open())
+    return false;
+  std::ostringstream buffer;
+  buffer << file.rdbuf();
+  *data = buffer.str();
+  return true;
+}
+
+// Write data to path through a temporary file, so readers never see a
+// partial file.
+bool WriteFile(const std::string& path, const std::string& data) {
+  std::string temp_path = path + ".tmp";
+  {
+    std::ofstream file(temp_path.c_str(), std::ios::binary);
+    if (!file.is_open() || !file.write(data.data(), data.size()))
+      return false;
+  }
+  if (0 != rename(temp_path.c_str(), path.c_str())) {
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Copy source into dest_dir under its content-hash name. Files already
+// there have the same content, so they are not written again.
+bool CopyHashed(const std::string& source, const std::string& dest_dir, std::string* dest) {
+  std::string data;
+  if (!ReadFile(source, &data)) {
+    LOG(LOG_ERROR, "cannot read " << source);
+    return false;
+  }
+  *dest = dest_dir + HashedName(source, HashBytes(data.data(), data.size(), FNV_OFFSET_BASIS));
+  struct stat st;
+  if ((0 == stat(dest->c_str(), &st)) || WriteFile(*dest, data))
+    return true;
+  LOG(LOG_ERROR, "cannot write " << *dest);
+  return false;
+}
+
+}  // namespace
+
+HtmlBundle::HtmlBundle(const std::string& html_path, const HtmlOptions& options) {
+  page_dir_ = DirName(html_path);
+  tile_dir_ = html_path.substr(0, html_path.rfind('.')) + "/";
+  bundle_ = options.bundle_;
+  asset_dir_ = options.asset_dir_;
+}
+
+bool HtmlBundle::Open() {
+  mkdir(tile_dir_.c_str(), S_IRWXU);
+  if (bundle_)
+    return CopyAssets(asset_dir_);
+  // Without assets the page is still written, as a plain grid of links.
+  if (asset_dir_.empty())
+    return true;
+  jquery_ = Relative(asset_dir_ + "/prettyPhoto/js/jquery-1.6.1.min.js");
+  prettyphoto_js_ = Relative(asset_dir_ + "/prettyPhoto/js/jquery.prettyPhoto.js");
+  prettyphoto_css_ = Relative(asset_dir_ + "/prettyPhoto/css/prettyPhoto.css");
+  background_ = Relative(asset_dir_ + "/image/bg_resize.png");
+  return true;
+}
+
+bool HtmlBundle::CopyAssets(const std::string& asset_dir) {
+  if (asset_dir.empty()) {
+    LOG(LOG_ERROR, "html bundles need the asset directory");
+    return false;
+  }
+  std::string dest_dir = tile_dir_ + "assets/";
+  mkdir(dest_dir.c_str(), S_IRWXU);
+  std::string path;
+  if (!CopyHashed(asset_dir + "/prettyPhoto/js/jquery-1.6.1.min.js", dest_dir, &path))
+    return false;
+  jquery_ = Relative(path);
+  if (!CopyHashed(asset_dir + "/prettyPhoto/js/jquery.prettyPhoto.js", dest_dir, &path))
+    return false;
+  prettyphoto_js_ = Relative(path);
+  if (!CopyHashed(asset_dir + "/image/bg_resize.png", dest_dir, &path))
+    return false;
+  background_ = Relative(path);
+  
+  // The stylesheet refers to its theme images by url(../images/...). They
+  // are copied flat next to it and the urls rewritten to their new names.
+  std::string css_path = asset_dir + "/prettyPhoto/css/prettyPhoto.css";
+  std::string css;
+  if (!ReadFile(css_path, &css)) {
+    LOG(LOG_ERROR, "cannot read " << css_path);
+    return false;
+  }
+  std::map<std::string, std::string> renamed;
+  size_t pos = 0;
+  while (std::string::npos != (pos = css.find("url(", pos))) {
+    size_t start = pos + 4;
+    size_t end = css.find(')', start);
+    if (std::string::npos == end)
+      break;
+    std::string url = css.substr(start, end - start);
+    if (!url.empty() && (('"' == url[0]) || ('\'' == url[0])))
+      url = url.substr(1, url.size() - 2);
+    std::map<std::string, std::string>::iterator it = renamed.find(url);
+    if (it == renamed.end()) {
+      if (!CopyHashed(DirName(css_path) + url, dest_dir, &path))
+        return false;
+      it = renamed.insert(std::make_pair(url, path.substr(dest_dir.size()))).first;
+    }
+    css.replace(start, end - start, it->second);
+    pos = start + it->second.size();
+  }
+  path = dest_dir + HashedName(css_path, HashBytes(css.data(), css.size(), FNV_OFFSET_BASIS));
+  if (!WriteFile(path, css)) {
+    LOG(LOG_ERROR, "cannot write " << path);
+    return false;
+  }
+  prettyphoto_css_ = Relative(path);
+  return true;
+}
+
+void HtmlBundle::WriteHead(HtmlWriter& html) const {
+  html << "<!DOCTYPE html>\n";
+  html << "<html>\n";
+  bool assets = !jquery_.empty();
+  if (assets) {
+    html << "<script src=\"";
+    html.Escaped(jquery_) << "\" type=\"text/javascript\" charset=\"utf-8\"></script> <link rel=\"stylesheet\" href=\"";
+    html.Escaped(prettyphoto_css_) << "\" type=\"text/css\" media=\"screen\" charset=\"utf-8\" /> <script src=\"";
+    html.Escaped(prettyphoto_js_) << "\" type=\"text/javascript\" charset=\"utf-8\"></script>\n";
+    html << "<style type=\"text/css\">\n";
+    html << "body {background-image:url(" << background_ << ");  background-position: top; background-repeat:repeat-x; background-attachment:fixed}\n";
+    html << "</style>\n";
+  }
+  html << "\t<body>\n";
+  if (assets)
+    html << "<script type=\"text/javascript\" charset=\"utf-8\"> $(document).ready(function(){$(\"a[rel^='prettyPhoto'], area[rel^='prettyPhoto']\").prettyPhoto();});</script>";
+  html << "\t\t<div style=\"margin:20px auto; width:60%; position:relative;\">\n";
+}
+
+bool HtmlBundle::Link(const std::string& path, std::string* href) {
+  std::map<std::string, std::string>::iterator it = links_.find(path);
+  if (it != links_.end()) {
+    *href = it->second;
+    return true;
+  }
+  std::string target = path;
+  if (bundle_) {
+    if (0 == path.compare(0, tile_dir_.size(), tile_dir_)) {
+      uint64 hash = 0;
+      if (!HashFile(path, &hash))
+        return false;
+      target = tile_dir_ + HashedName(path, hash);
+      if (0 != rename(path.c_str(), target.c_str())) {
+        LOG(LOG_ERROR, "cannot rename " << path);
+        return false;
+      }
+    } else if (!CopyHashed(path, tile_dir_, &target)) {
+      return false;
+    }
+  }
+  *href = Relative(target);
+  links_[path] = *href;
+  return true;
+}
+
+std::string HtmlBundle::Relative(const std::string& path) const {
+  std::vector<std::string> page = AbsoluteComponents(page_dir_.empty() ? "." : page_dir_);
+  std::vector<std::string> target = AbsoluteComponents(path);
+  // Keep the file name even if a directory of the same name holds the page.
+  size_t common = 0;
+  while ((common < page.size()) && (common + 1 < target.size()) &&
+         (page[common] == target[common]))
+    ++common;
+  std::string relative;
+  for (size_t i = common; i < page.size(); ++i) {
+    relative += "../";
+  }
+  for (size_t i = common; i < target.size(); ++i) {
+    relative += target[i] + ((i + 1 < target.size()) ? "/" : "");
+  }
+  return UrlPath(relative);
+}
@@ -0,0 +1,102 @@
+//
+//  HtmlBundle.h
+//  image-browser
+//
+//  Page assets and file references of the html collage outputs.
+//
+
+#ifndef __image_browser__HtmlBundle__
+#define __image_browser__HtmlBundle__
+
+#include "HtmlWriter.h"
+#include <map>
+#include <string>
+#define HTML_QUALITY 95  // Default JPEG / WebP quality of html tiles.
+// Directory holding prettyPhoto/ and image/bg_resize.png. The CMake build
+// points it at the source tree.
+#ifndef PICWALL_ASSET_DIR
+#define PICWALL_ASSET_DIR ""
+#endif
+
+// Settings of CollageAdvanced::OutputHtml(). The defaults write one framed,
+// full-resolution JPEG per leaf (photo collages link the sources), scaled
+// down by the browser.
+class HtmlOptions {
+public:
+  HtmlOptions() {
+    lightbox_size_ = 0;
+    quality_ = HTML_QUALITY;
+    webp_ = false;
+    thread_num_ = 1;
+    sprite_ = false;
+    strip_height_ = 0;
+    bundle_ = false;
+    asset_dir_ = PICWALL_ASSET_DIR;
+    compression_ = HTML_PLAIN;
+  }
+  // Pre-sized export if positive: every tile is stylized once at this
+  // longer side at most, and written both as the lightbox image and as a
+  // display-size grid tile.
+  int lightbox_size_;
+  int quality_;     // 1 - 100.
+  bool webp_;       // Encode tiles as WebP instead of JPEG.
+  int thread_num_;  // Tiles stylized and encoded in parallel.
+  // Sprite export: the rendered canvas is written as one image, or as
+  // strips of strip_height_ rows if positive, with an image map linking
+  // every leaf to its source. The browser fetches one file per strip.
+  bool sprite_;
+  int strip_height_;
+  // Self-contained output: assets, tiles and linked source photos are
+  // copied next to the page under content-hash names and referenced by
+  // relative paths, so the directory can be served with long expiry.
+  bool bundle_;
+  // prettyPhoto and background assets. Empty: the page links no assets,
+  // and bundles fail.
+  std::string asset_dir_;
+  // Also write a gzip or brotli copy of the page.
+  HtmlCompression compression_;
+};
+
+// Files of one html page at html_path ("out/wall.html"). Tiles go to the
+// tile directory named after the page ("out/wall/"); references written
+// into the page are urls relative to the page's directory, going up with
+// "../" for files outside it.
+class HtmlBundle {
+public:
+  HtmlBundle(const std::string& html_path, const HtmlOptions& options);
+  
+  // Create the tile directory and, in bundle mode, copy the assets into
+  // its assets/ subdirectory.
+  bool Open();
+  const std::string& tile_dir() const {
+    return tile_dir_;
+  }
+  // Page head up to the opening of the collage div. Links and map areas
+  // open in prettyPhoto, if there is an asset directory.
+  void WriteHead(HtmlWriter& html) const;
+  // Reference from the page to path, a url still to be escaped in
+  // attributes. In bundle mode files in the tile directory are renamed,
+  // and other files copied into it, to content-hash names first.
+  bool Link(const std::string& path, std::string* href);
+  
+private:
+  // path as a url relative to the page's directory.
+  std::string Relative(const std::string& path) const;
+  bool CopyAssets(const std::string& asset_dir);
+  
+  std::string page_dir_;      // Empty or ending with '/'.
+  std::string tile_dir_;      // Ends with '/'.
+  bool bundle_;
+  std::string asset_dir_;
+  std::string jquery_;        // Asset references written by WriteHead().
+  std::string prettyphoto_js_;
+  std::string prettyphoto_css_;
+  std::string background_;
+  std::map<std::string, std::string> links_;  // Link() results by path.
+  
+  // Disallow copy and assign.
+  void operator= (const HtmlBundle&);
+  HtmlBundle(const HtmlBundle&);
+};
+
+#endif /* defined(__image_browser__HtmlBundle__) */
@@ -0,0 +1,131 @@
+//
+//  HtmlWriter.cpp
+//  image-browser
+//
+
+#include "HtmlWriter.h"
+#include "Log.h"
+#include <math.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <vector>
+#ifdef PICWALL_WITH_ZLIB
+#include <zlib.h>
+#endif
+#ifdef PICWALL_WITH_BROTLI
+#include <brotli/encode.h>
+#endif
+#define HTML_BROTLI_QUALITY 9  // 11 is several times slower for ~5% less.
+
+namespace {
+
+bool WriteFile(const std::string& path, const char* data, size_t size) {
+  std::string temp_path = path + ".tmp";
+  FILE* file = fopen(temp_path.c_str(), "wb");
+  if (NULL == file)
+    return false;
+  bool success = (0 == size) || (fwrite(data, 1, size, file) == size);
+  success = (0 == fclose(file)) && success;
+  if (!success || (0 != rename(temp_path.c_str(), path.c_str()))) {
+    unlink(temp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool Gzip(const std::string& data, std::vector<char>* output) {
+#ifdef PICWALL_WITH_ZLIB
+  z_stream stream;
+  stream.zalloc = Z_NULL;
+  stream.zfree = Z_NULL;
+  stream.opaque = Z_NULL;
+  // 16 + MAX_WBITS: gzip header and trailer instead of a zlib stream.
+  if (Z_OK != deflateInit2(&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS,
+                           8, Z_DEFAULT_STRATEGY))
+    return false;
+  output->resize(deflateBound(&stream, data.size()) + 32);
+  stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+  stream.avail_in = static_cast<uInt>(data.size());
+  stream.next_out = reinterpret_cast<Bytef*>(&(*output)[0]);
+  stream.avail_out = static_cast<uInt>(output->size());
+  int result = deflate(&stream, Z_FINISH);
+  output->resize(stream.total_out);
+  deflateEnd(&stream);
+  return Z_STREAM_END == result;
+#else
+  (void)data;
+  (void)output;
+  LOG(LOG_ERROR, "built without zlib (PICWALL_WITH_ZLIB)");
+  return false;
+#endif
+}
+
+bool Brotli(const std::string& data, std::vector<char>* output) {
+#ifdef PICWALL_WITH_BROTLI
+  size_t size = BrotliEncoderMaxCompressedSize(data.size());
+  if (0 == size)
+    return false;
+  output->resize(size);
+  if (!BrotliEncoderCompress(HTML_BROTLI_QUALITY, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT,
+                             data.size(), reinterpret_cast<const uint8_t*>(data.data()),
+                             &size, reinterpret_cast<uint8_t*>(&(*output)[0])))
+    return false;
+  output->resize(size);
+  return true;
+#else
+  (void)data;
+  (void)output;
+  LOG(LOG_ERROR, "built without brotli (PICWALL_WITH_BROTLI)");
+  return false;
+#endif
+}
+
+}  // namespace
+
+HtmlWriter& HtmlWriter::Escaped(const std::string& text) {
+  for (size_t i = 0; i < text.size(); ++i) {
+    switch (text[i]) {
+      case '&': buffer_ += "&amp;"; break;
+      case '<': buffer_ += "&lt;"; break;
+      case '>': buffer_ += "&gt;"; break;
+      case '"': buffer_ += "&quot;"; break;
+      case '\'': buffer_ += "&#39;"; break;
+      default: buffer_ += text[i];
+    }
+  }
+  return *this;
+}
+
+void HtmlWriter::AppendFixed(double value) {
+  // Hundredths, rounded half away from zero; trailing zeros are dropped.
+  int64_t hundredths = static_cast<int64_t>(floor(fabs(value) * 100 + 0.5));
+  if ((value < 0) && (hundredths > 0))
+    buffer_ += '-';
+  AppendInteger(hundredths / 100);
+  int fraction = static_cast<int>(hundredths % 100);
+  if (0 == fraction)
+    return;
+  buffer_ += '.';
+  buffer_ += static_cast<char>('0' + fraction / 10);
+  if (0 != fraction % 10)
+    buffer_ += static_cast<char>('0' + fraction % 10);
+}
+
+bool HtmlWriter::Write(const std::string& path, HtmlCompression compression) const {
+  if (!WriteFile(path, buffer_.data(), buffer_.size())) {
+    LOG(LOG_ERROR, "cannot write " << path);
+    return false;
+  }
+  if (HTML_PLAIN == compression)
+    return true;
+  std::vector<char> compressed;
+  std::string compressed_path = path + ((HTML_GZIP == compression) ? ".gz" : ".br");
+  bool success = (HTML_GZIP == compression) ? Gzip(buffer_, &compressed) :
+                                              Brotli(buffer_, &compressed);
+  if (!success || compressed.empty() ||
+      !WriteFile(compressed_path, &compressed[0], compressed.size())) {
+    LOG(LOG_ERROR, "cannot write " << compressed_path);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,102 @@
+//
+//  HtmlWriter.h
+//  image-browser
+//
+//  Buffered writer of generated html pages.
+//
+
+#ifndef __image_browser__HtmlWriter__
+#define __image_browser__HtmlWriter__
+
+#include <stdint.h>
+#include <string>
+#define HTML_WRITER_RESERVE (1 << 16)  // Initial buffer, grown as needed.
+
+// Precompressed copies written next to the page, for servers that send
+// page.html.gz / page.html.br as is (nginx gzip_static / brotli_static).
+// Each needs the build flag of its library (PICWALL_WITH_ZLIB,
+// PICWALL_WITH_BROTLI).
+enum HtmlCompression {
+  HTML_PLAIN = 0,
+  HTML_GZIP = 1,
+  HTML_BROTLI = 2
+};
+
+// Formats a page into one growing buffer and writes it with a single
+// call. Numbers are formatted by hand: integers in full, floats in fixed
+// point with at most two decimals, independent of the locale.
+class HtmlWriter {
+public:
+  explicit HtmlWriter(size_t reserve = HTML_WRITER_RESERVE) {
+    buffer_.reserve(reserve);
+  }
+  
+  HtmlWriter& operator<<(const char* text) {
+    buffer_ += text;
+    return *this;
+  }
+  HtmlWriter& operator<<(const std::string& text) {
+    buffer_ += text;
+    return *this;
+  }
+  HtmlWriter& operator<<(char c) {
+    buffer_ += c;
+    return *this;
+  }
+  HtmlWriter& operator<<(int value) {
+    AppendInteger(static_cast<int64_t>(value));
+    return *this;
+  }
+  HtmlWriter& operator<<(size_t value) {
+    AppendInteger(static_cast<uint64_t>(value));
+    return *this;
+  }
+  HtmlWriter& operator<<(float value) {
+    AppendFixed(value);
+    return *this;
+  }
+  HtmlWriter& operator<<(double value) {
+    AppendFixed(value);
+    return *this;
+  }
+  // text with &, <, >, " and ' escaped, for attribute values and content.
+  HtmlWriter& Escaped(const std::string& text);
+  
+  const std::string& str() const {
+    return buffer_;
+  }
+  // Write the page to path, replacing it atomically, and a compressed
+  // copy to path.gz or path.br unless compression is HTML_PLAIN.
+  bool Write(const std::string& path, HtmlCompression compression) const;
+  
+private:
+  void AppendInteger(uint64_t value) {
+    char digits[24];
+    char* end = digits + sizeof(digits);
+    char* begin = end;
+    do {
+      *--begin = static_cast<char>('0' + value % 10);
+      value /= 10;
+    } while (0 != value);
+    buffer_.append(begin, end);
+  }
+  void AppendInteger(int64_t value) {
+    if (value >= 0) {
+      AppendInteger(static_cast<uint64_t>(value));
+      return;
+    }
+    // Negate in unsigned arithmetic so the most negative value does not
+    // overflow.
+    buffer_ += '-';
+    AppendInteger(0 - static_cast<uint64_t>(value));
+  }
+  void AppendFixed(double value);
+  
+  std::string buffer_;
+  
+  // Disallow copy and assign.
+  void operator= (const HtmlWriter&);
+  HtmlWriter(const HtmlWriter&);
+};
+
+#endif /* defined(__image_browser__HtmlWriter__) */
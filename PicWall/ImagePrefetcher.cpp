@@ -0,0 +1,141 @@
+//
+//  ImagePrefetcher.cpp
+//  image-browser
+//
+
+#include "ImagePrefetcher.h"
+#include "ImageStore.h"
+
+namespace {
+
+size_t ImageBytes(const cv::Mat& image) {
+  return image.total() * image.elemSize();
+}
+
+cv::Mat Load(const PrefetchRequest& request) {
+  TRACE_SCOPE("prefetch");
+  if (request.min_size_.area() > 0)
+    return ImageStore::Instance()->GetThumbnail(request.path_, request.min_size_);
+  return ImageStore::Instance()->Get(request.path_);
+}
+
+}  // namespace
+
+ImagePrefetcher::ImagePrefetcher(const std::vector<PrefetchRequest>& requests,
+                                 int thread_num,
+                                 int depth,
+                                 size_t budget)
+: requests_(requests), depth_(depth), budget_(budget) {
+  Start(thread_num);
+}
+
+ImagePrefetcher::ImagePrefetcher(const std::vector<PrefetchRequest>& requests)
+: requests_(requests), depth_(PREFETCH_DEPTH), budget_(PREFETCH_BUDGET) {
+  Start(PREFETCH_THREADS);
+}
+
+void ImagePrefetcher::Start(int thread_num) {
+  images_.resize(requests_.size());
+  loaded_.assign(requests_.size(), 0);
+  if (depth_ < 1)
+    depth_ = 1;
+  next_load_ = 0;
+  next_get_ = 0;
+  ready_bytes_ = 0;
+  stopping_ = false;
+  session_ = Trace::enabled() ? Trace::session() : NULL;
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&image_loaded_, NULL);
+  pthread_cond_init(&image_taken_, NULL);
+  // More threads than images ahead would only idle.
+  thread_num = std::max(1, std::min(thread_num, depth_));
+  for (int i = 0; i < thread_num; ++i) {
+    pthread_t thread;
+    if (0 == pthread_create(&thread, NULL, WorkerMain, this))
+      threads_.push_back(thread);
+  }
+}
+
+ImagePrefetcher::~ImagePrefetcher() {
+  pthread_mutex_lock(&mutex_);
+  stopping_ = true;
+  pthread_cond_broadcast(&image_taken_);
+  pthread_mutex_unlock(&mutex_);
+  for (int i = 0; i < static_cast<int>(threads_.size()); ++i) {
+    pthread_join(threads_[i], NULL);
+  }
+  pthread_cond_destroy(&image_taken_);
+  pthread_cond_destroy(&image_loaded_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+cv::Mat ImagePrefetcher::Next() {
+  cv::Mat image;
+  pthread_mutex_lock(&mutex_);
+  if (next_get_ < static_cast<int>(requests_.size())) {
+    int i = next_get_;
+    if (threads_.empty()) {
+      // No I/O thread could be started: load in the caller.
+      pthread_mutex_unlock(&mutex_);
+      image = Load(requests_[i]);
+      pthread_mutex_lock(&mutex_);
+    } else {
+      if (!loaded_[i])
+        TRACE_COUNTER("prefetch_stalls", 1);
+      while (!loaded_[i]) {
+        pthread_cond_wait(&image_loaded_, &mutex_);
+      }
+      image = images_[i];
+      images_[i].release();
+      ready_bytes_ -= ImageBytes(image);
+    }
+    ++next_get_;
+    pthread_cond_broadcast(&image_taken_);
+  }
+  pthread_mutex_unlock(&mutex_);
+  return image;
+}
+
+size_t ImagePrefetcher::ready_bytes() {
+  pthread_mutex_lock(&mutex_);
+  size_t bytes = ready_bytes_;
+  pthread_mutex_unlock(&mutex_);
+  return bytes;
+}
+
+bool ImagePrefetcher::CanLoad() const {
+  if (next_load_ >= static_cast<int>(requests_.size()))
+    return false;
+  // Never hold back the image Next() waits for.
+  if (next_load_ == next_get_)
+    return true;
+  return (next_load_ - next_get_ < depth_) && (ready_bytes_ < budget_);
+}
+
+void* ImagePrefetcher::WorkerMain(void* arg) {
+  ImagePrefetcher* prefetcher = static_cast<ImagePrefetcher*>(arg);
+  TraceSessionScope session_scope(prefetcher->session_);
+  prefetcher->WorkerLoop();
+  return NULL;
+}
+
+void ImagePrefetcher::WorkerLoop() {
+  pthread_mutex_lock(&mutex_);
+  while (true) {
+    while (!stopping_ && !CanLoad() &&
+           (next_load_ < static_cast<int>(requests_.size()))) {
+      pthread_cond_wait(&image_taken_, &mutex_);
+    }
+    if (stopping_ || !CanLoad())
+      break;
+    int i = next_load_++;
+    pthread_mutex_unlock(&mutex_);
+    cv::Mat image = Load(requests_[i]);
+    pthread_mutex_lock(&mutex_);
+    images_[i] = image;
+    loaded_[i] = 1;
+    ready_bytes_ += ImageBytes(image);
+    pthread_cond_broadcast(&image_loaded_);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
@@ -0,0 +1,83 @@
+//
+//  ImagePrefetcher.h
+//  image-browser
+//
+//  Loads a fixed schedule of images ahead of their consumer on I/O threads.
+//
+
+#ifndef __image_browser__ImagePrefetcher__
+#define __image_browser__ImagePrefetcher__
+
+#include "Trace.h"
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+#include <pthread.h>
+#define PREFETCH_THREADS 2            // I/O threads per prefetcher.
+#define PREFETCH_DEPTH 4              // Max images loaded ahead of Next().
+#define PREFETCH_BUDGET (128 << 20)   // Max bytes of loaded, unconsumed images.
+
+// One scheduled image. With a non-zero min_size the smallest indexed
+// thumbnail covering it is loaded (see ImageStore::GetThumbnail).
+class PrefetchRequest {
+public:
+  PrefetchRequest(const std::string& path, const cv::Size2i& min_size)
+  : path_(path), min_size_(min_size) {}
+  explicit PrefetchRequest(const std::string& path)
+  : path_(path), min_size_(0, 0) {}
+  std::string path_;
+  cv::Size2i min_size_;
+};
+
+// Images are read through ImageStore in schedule order, at most depth
+// ahead of the consumer. No new load starts while the loaded images waiting
+// for Next() hold budget bytes or more, except the one Next() is blocked
+// on; so memory stays within budget plus one image per I/O thread.
+// The trace session of the constructing thread also records the loads.
+class ImagePrefetcher {
+public:
+  ImagePrefetcher(const std::vector<PrefetchRequest>& requests,
+                  int thread_num,
+                  int depth,
+                  size_t budget);
+  explicit ImagePrefetcher(const std::vector<PrefetchRequest>& requests);
+  // Abandons the images not yet loaded and joins the I/O threads.
+  ~ImagePrefetcher();
+  
+  // Image of the next request in schedule order, blocking until it is
+  // loaded. The prefetcher drops its reference, so the caller owns the only
+  // one besides ImageStore's. Empty if the image cannot be read or every
+  // request has been consumed.
+  cv::Mat Next();
+  
+  // Bytes of loaded images waiting for Next().
+  size_t ready_bytes();
+  
+private:
+  void Start(int thread_num);
+  static void* WorkerMain(void* arg);
+  void WorkerLoop();
+  // Whether a worker may start loading request next_load_.
+  bool CanLoad() const;
+  
+  std::vector<PrefetchRequest> requests_;
+  std::vector<cv::Mat> images_;
+  std::vector<char> loaded_;
+  int depth_;
+  size_t budget_;
+  int next_load_;          // First request no worker has taken.
+  int next_get_;           // First request Next() has not returned.
+  size_t ready_bytes_;
+  bool stopping_;
+  TraceSession* session_;
+  std::vector<pthread_t> threads_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t image_loaded_;
+  pthread_cond_t image_taken_;
+  
+  // Disallow copy and assign.
+  void operator= (const ImagePrefetcher&);
+  ImagePrefetcher(const ImagePrefetcher&);
+};
+
+#endif /* defined(__image_browser__ImagePrefetcher__) */
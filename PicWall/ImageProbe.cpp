@@ -0,0 +1,162 @@
+//
+//  ImageProbe.cpp
+//  image-browser
+//
+
+#include "ImageProbe.h"
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#define EXIF_PROBE_SIZE (1 << 16)  // EXIF must sit in the first APP1 segment.
+
+namespace {
+
+unsigned ReadU16(const unsigned char* p, bool little_endian) {
+  return little_endian ? (p[0] | (p[1] << 8)) : ((p[0] << 8) | p[1]);
+}
+
+unsigned ReadU32(const unsigned char* p, bool little_endian) {
+  return little_endian ?
+  (p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<unsigned>(p[3]) << 24)) :
+  ((static_cast<unsigned>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3]);
+}
+
+// Orientation tag (0x0112) in IFD0 of a TIFF block.
+int ParseTiffOrientation(const unsigned char* tiff, size_t size) {
+  if (size < 8)
+    return 1;
+  bool little_endian = ('I' == tiff[0]) && ('I' == tiff[1]);
+  if (!little_endian && !(('M' == tiff[0]) && ('M' == tiff[1])))
+    return 1;
+  if (42 != ReadU16(tiff + 2, little_endian))
+    return 1;
+  size_t ifd = ReadU32(tiff + 4, little_endian);
+  if (ifd + 2 > size)
+    return 1;
+  unsigned entry_num = ReadU16(tiff + ifd, little_endian);
+  for (unsigned i = 0; i < entry_num; ++i) {
+    size_t entry = ifd + 2 + 12 * i;
+    if (entry + 12 > size)
+      break;
+    if (0x0112 == ReadU16(tiff + entry, little_endian)) {
+      int orientation = ReadU16(tiff + entry + 8, little_endian);
+      return ((orientation >= 1) && (orientation <= 8)) ? orientation : 1;
+    }
+  }
+  return 1;
+}
+
+}  // namespace
+
+int ReadExifOrientation(const unsigned char* data, size_t size) {
+  if ((size < 4) || (0xFF != data[0]) || (0xD8 != data[1]))
+    return 1;
+  size_t pos = 2;
+  while (pos + 4 <= size) {
+    if (0xFF != data[pos])
+      return 1;
+    unsigned char marker = data[pos + 1];
+    // Start of scan or end of image: no more metadata.
+    if ((0xDA == marker) || (0xD9 == marker))
+      return 1;
+    size_t length = ReadU16(data + pos + 2, false);
+    if (length < 2)
+      return 1;
+    const unsigned char* segment = data + pos + 4;
+    size_t segment_size = std::min(length - 2, size - (pos + 4));
+    if ((0xE1 == marker) && (segment_size > 6) &&
+        (0 == memcmp(segment, "Exif\0\0", 6))) {
+      return ParseTiffOrientation(segment + 6, segment_size - 6);
+    }
+    pos += 2 + length;
+  }
+  return 1;
+}
+
+int ReadExifOrientation(const std::string& path) {
+  FILE* file = fopen(path.c_str(), "rb");
+  if (NULL == file)
+    return 1;
+  std::vector<unsigned char> buff(EXIF_PROBE_SIZE);
+  size_t size = fread(&buff[0], 1, buff.size(), file);
+  fclose(file);
+  return ReadExifOrientation(&buff[0], size);
+}
+
+bool ReadImageSize(const unsigned char* data, size_t size, cv::Size2i* image_size) {
+  // PNG: signature, then the IHDR chunk with big-endian width and height.
+  static const unsigned char png_signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+  if ((size >= 24) && (0 == memcmp(data, png_signature, 8)) &&
+      (0 == memcmp(data + 12, "IHDR", 4))) {
+    image_size->width = static_cast<int>(ReadU32(data + 16, false));
+    image_size->height = static_cast<int>(ReadU32(data + 20, false));
+    return (image_size->width > 0) && (image_size->height > 0);
+  }
+  if ((size < 4) || (0xFF != data[0]) || (0xD8 != data[1]))
+    return false;
+  size_t pos = 2;
+  while (pos + 4 <= size) {
+    if (0xFF != data[pos])
+      return false;
+    unsigned char marker = data[pos + 1];
+    // Fill bytes before a marker.
+    if (0xFF == marker) {
+      ++pos;
+      continue;
+    }
+    if ((0xDA == marker) || (0xD9 == marker))
+      return false;
+    size_t length = ReadU16(data + pos + 2, false);
+    if (length < 2)
+      return false;
+    // SOF0 - SOF15, except DHT (C4), JPG (C8) and DAC (CC).
+    if ((marker >= 0xC0) && (marker <= 0xCF) &&
+        (0xC4 != marker) && (0xC8 != marker) && (0xCC != marker)) {
+      if (pos + 9 > size)
+        return false;
+      image_size->height = static_cast<int>(ReadU16(data + pos + 5, false));
+      image_size->width = static_cast<int>(ReadU16(data + pos + 7, false));
+      return (image_size->width > 0) && (image_size->height > 0);
+    }
+    pos += 2 + length;
+  }
+  return false;
+}
+
+cv::Size2i UprightSize(const cv::Size2i& stored_size, int orientation) {
+  // Orientations 5 - 8 swap the axes.
+  if (orientation >= 5)
+    return cv::Size2i(stored_size.height, stored_size.width);
+  return stored_size;
+}
+
+void ApplyOrientation(int orientation, cv::Mat* image) {
+#if CV_MAJOR_VERSION < 3
+  switch (orientation) {
+    case 2: cv::flip(*image, *image, 1); break;   // Mirror horizontal.
+    case 3: cv::flip(*image, *image, -1); break;  // Rotate 180.
+    case 4: cv::flip(*image, *image, 0); break;   // Mirror vertical.
+    case 5: cv::transpose(*image, *image); break; // Transpose.
+    case 6: {                                     // Rotate 90 clockwise.
+      cv::transpose(*image, *image);
+      cv::flip(*image, *image, 1);
+      break;
+    }
+    case 7: {                                     // Transverse.
+      cv::transpose(*image, *image);
+      cv::flip(*image, *image, -1);
+      break;
+    }
+    case 8: {                                     // Rotate 90 counter-clockwise.
+      cv::transpose(*image, *image);
+      cv::flip(*image, *image, 0);
+      break;
+    }
+    default: break;
+  }
+#else
+  (void)orientation;
+  (void)image;
+#endif
+}
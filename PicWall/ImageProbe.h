@@ -0,0 +1,28 @@
+//
+//  ImageProbe.h
+//  image-browser
+//
+//  Image metadata read from file headers, without decoding pixels.
+//
+
+#ifndef __image_browser__ImageProbe__
+#define __image_browser__ImageProbe__
+
+#include <opencv2/opencv.hpp>
+#include <string>
+
+// EXIF orientation (1 - 8) of a JPEG file held in data. Returns 1 (upright)
+// if there is no EXIF orientation tag.
+int ReadExifOrientation(const unsigned char* data, size_t size);
+int ReadExifOrientation(const std::string& path);
+// Stored pixel size of a JPEG or PNG file held in data, from the SOF or IHDR
+// header. Returns false for other formats or truncated headers.
+bool ReadImageSize(const unsigned char* data, size_t size, cv::Size2i* image_size);
+// Size of an image of stored_size once turned upright.
+cv::Size2i UprightSize(const cv::Size2i& stored_size, int orientation);
+// Turn a decoded image upright according to an EXIF orientation.
+// OpenCV 3 and later already do this in imread()/imdecode(), so there it is
+// a no-op.
+void ApplyOrientation(int orientation, cv::Mat* image);
+
+#endif /* defined(__image_browser__ImageProbe__) */
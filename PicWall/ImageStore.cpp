@@ -0,0 +1,182 @@
+//
+//  ImageStore.cpp
+//  image-browser
+//
+
+#include "ImageStore.h"
+#include "ImageProbe.h"
+#include "Trace.h"
+#include <sys/stat.h>
+
+namespace {
+
+bool FileStamp(const std::string& path, time_t* mtime, off_t* file_size) {
+  struct stat st;
+  if (0 != stat(path.c_str(), &st))
+    return false;
+  *mtime = st.st_mtime;
+  *file_size = st.st_size;
+  return true;
+}
+
+size_t ImageBytes(const cv::Mat& image) {
+  return image.total() * image.elemSize();
+}
+
+}  // namespace
+
+ImageStore* ImageStore::Instance() {
+  static ImageStore store;
+  return &store;
+}
+
+ImageStore::ImageStore() {
+  budget_ = IMAGE_STORE_BUDGET;
+  bytes_ = 0;
+  hits_ = 0;
+  misses_ = 0;
+}
+
+cv::Mat ImageStore::Get(const std::string& path) {
+  time_t mtime = 0;
+  off_t file_size = 0;
+  if (!FileStamp(path, &mtime, &file_size))
+    return cv::Mat();
+  {
+    cv::AutoLock lock(mutex_);
+    std::map<std::string, Entry>::iterator it = images_.find(path);
+    if (it != images_.end()) {
+      Entry& entry = it->second;
+      if ((entry.mtime_ == mtime) && (entry.file_size_ == file_size)) {
+        lru_.splice(lru_.begin(), lru_, entry.lru_);
+        ++hits_;
+        TRACE_COUNTER("image_cache_hits", 1);
+        return entry.image_;
+      }
+      bytes_ -= ImageBytes(entry.image_);
+      lru_.erase(entry.lru_);
+      images_.erase(it);
+    }
+    ++misses_;
+  }
+  // Decode outside the lock, so workers decode different images in parallel.
+  cv::Mat image;
+  std::vector<unsigned char> data;
+  if (ReadFile(path, 0, &data)) {
+    TRACE_SCOPE("decode");
+    image = cv::imdecode(cv::Mat(data), 1);
+    if (!image.empty() && !index_.empty())
+      ApplyOrientation(ReadExifOrientation(&data[0], data.size()), &image);
+  }
+  if (image.empty())
+    return image;
+  TRACE_COUNTER("image_cache_misses", 1);
+  TRACE_COUNTER("bytes_decoded", ImageBytes(image));
+  
+  cv::AutoLock lock(mutex_);
+  SizeEntry& size_entry = sizes_[path];
+  size_entry.size_ = image.size();
+  size_entry.mtime_ = mtime;
+  size_entry.file_size_ = file_size;
+  if (ImageBytes(image) > budget_)
+    return image;
+  // Another worker may have decoded the same file meanwhile.
+  std::map<std::string, Entry>::iterator it = images_.find(path);
+  if (it != images_.end()) {
+    bytes_ -= ImageBytes(it->second.image_);
+    lru_.erase(it->second.lru_);
+    images_.erase(it);
+  }
+  lru_.push_front(path);
+  Entry& entry = images_[path];
+  entry.image_ = image;
+  entry.mtime_ = mtime;
+  entry.file_size_ = file_size;
+  entry.lru_ = lru_.begin();
+  bytes_ += ImageBytes(image);
+  Evict();
+  return image;
+}
+
+cv::Size2i ImageStore::GetSize(const std::string& path) {
+  time_t mtime = 0;
+  off_t file_size = 0;
+  if (!FileStamp(path, &mtime, &file_size))
+    return cv::Size2i(0, 0);
+  const IndexEntry* entry = FreshIndexEntry(path, mtime, file_size);
+  if (NULL != entry)
+    return cv::Size2i(entry->width_, entry->height_);
+  {
+    cv::AutoLock lock(mutex_);
+    std::map<std::string, SizeEntry>::iterator it = sizes_.find(path);
+    if ((it != sizes_.end()) &&
+        (it->second.mtime_ == mtime) &&
+        (it->second.file_size_ == file_size)) {
+      return it->second.size_;
+    }
+  }
+  std::vector<unsigned char> header;
+  cv::Size2i stored_size;
+  if (ReadFile(path, IMAGE_STORE_HEADER, &header) &&
+      ReadImageSize(&header[0], header.size(), &stored_size)) {
+    cv::Size2i size = index_.empty() ? stored_size :
+        UprightSize(stored_size, ReadExifOrientation(&header[0], header.size()));
+    cv::AutoLock lock(mutex_);
+    SizeEntry& size_entry = sizes_[path];
+    size_entry.size_ = size;
+    size_entry.mtime_ = mtime;
+    size_entry.file_size_ = file_size;
+    return size;
+  }
+  return Get(path).size();
+}
+
+cv::Mat ImageStore::GetThumbnail(const std::string& path, const cv::Size2i& min_size) {
+  time_t mtime = 0;
+  off_t file_size = 0;
+  if (!FileStamp(path, &mtime, &file_size))
+    return cv::Mat();
+  const IndexEntry* entry = FreshIndexEntry(path, mtime, file_size);
+  if (NULL != entry) {
+    cv::Mat thumbnail = index_->Thumbnail(*entry, min_size);
+    if (!thumbnail.empty()) {
+      TRACE_COUNTER("thumbnail_hits", 1);
+      return thumbnail;
+    }
+  }
+  return Get(path);
+}
+
+const IndexEntry* ImageStore::FreshIndexEntry(const std::string& path,
+                                              time_t mtime,
+                                              off_t file_size) const {
+  if (index_.empty())
+    return NULL;
+  const IndexEntry* entry = index_->Find(path);
+  if ((NULL == entry) || (entry->mtime_ != mtime) || (entry->file_size_ != file_size))
+    return NULL;
+  return entry;
+}
+
+void ImageStore::set_budget(size_t budget) {
+  cv::AutoLock lock(mutex_);
+  budget_ = budget;
+  Evict();
+}
+
+void ImageStore::Clear() {
+  cv::AutoLock lock(mutex_);
+  images_.clear();
+  sizes_.clear();
+  lru_.clear();
+  bytes_ = 0;
+}
+
+void ImageStore::Evict() {
+  while ((bytes_ > budget_) && !lru_.empty()) {
+    std::map<std::string, Entry>::iterator it = images_.find(lru_.back());
+    bytes_ -= ImageBytes(it->second.image_);
+    images_.erase(it);
+    lru_.pop_back();
+  }
+}
@@ -0,0 +1,108 @@
+//
+//  ImageStore.h
+//  image-browser
+//
+//  Process-wide cache of decoded source images and their dimensions.
+//
+
+#ifndef __image_browser__ImageStore__
+#define __image_browser__ImageStore__
+
+#include <list>
+#include <map>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include "ThumbnailIndex.h"
+#define IMAGE_STORE_BUDGET (256 << 20)  // Default byte budget of decoded images.
+#define IMAGE_STORE_HEADER (256 << 10)  // Bytes read to probe a source's size.
+
+// Decoded BGR images are kept in LRU order until their total size exceeds
+// the byte budget. Entries are keyed by path and revalidated against the
+// file's modification time and size, so an edited file is decoded again.
+// Image dimensions are cached separately and never evicted, since collage
+// layout only needs aspect ratios.
+// Returned images share the cached data and must not be modified.
+// Source files are read into memory and decoded from there; only their
+// header is read to probe their size. They are not memory-mapped: a source
+// truncated or rewritten in place while mapped would raise SIGBUS in the
+// decoder and take the daemon down.
+class ImageStore {
+public:
+  static ImageStore* Instance();
+  
+  // Decoded CV_8UC3 image, or an empty Mat if path cannot be read.
+  // With an index set, images are turned upright according to their EXIF
+  // orientation, as the index thumbnails and sizes are; without one they
+  // are returned as stored, so existing layouts and styles are unchanged.
+  cv::Mat Get(const std::string& path);
+  // Image dimensions. Taken from the thumbnail index if it has a fresh
+  // entry, else from the JPEG or PNG header; other formats are decoded (and
+  // cached) on the first call.
+  cv::Size2i GetSize(const std::string& path);
+  // Smallest indexed thumbnail covering min_size, read straight from the
+  // index mapping. Falls back to Get() if there is none.
+  cv::Mat GetThumbnail(const std::string& path, const cv::Size2i& min_size);
+  
+  // Thumbnail index consulted by GetSize() and GetThumbnail(). Set it at
+  // start-up: thumbnails handed out point into the index mapping, and
+  // images decoded before are not turned upright.
+  void set_index(const cv::Ptr<ThumbnailIndex>& index) {
+    index_ = index;
+  }
+  
+  void set_budget(size_t budget);
+  size_t budget() const {
+    return budget_;
+  }
+  // Statistics:
+  size_t bytes() const {
+    return bytes_;
+  }
+  int hits() const {
+    return hits_;
+  }
+  int misses() const {
+    return misses_;
+  }
+  // Drop every cached image and dimension.
+  void Clear();
+  
+private:
+  ImageStore();
+  
+  class Entry {
+  public:
+    cv::Mat image_;
+    time_t mtime_;
+    off_t file_size_;
+    std::list<std::string>::iterator lru_;
+  };
+  class SizeEntry {
+  public:
+    cv::Size2i size_;
+    time_t mtime_;
+    off_t file_size_;
+  };
+  // Evict least recently used images until bytes_ <= budget_.
+  void Evict();
+  // Index entry of path if it matches the file stamp, or NULL.
+  const IndexEntry* FreshIndexEntry(const std::string& path,
+                                    time_t mtime,
+                                    off_t file_size) const;
+  
+  cv::Mutex mutex_;
+  std::map<std::string, Entry> images_;
+  std::map<std::string, SizeEntry> sizes_;
+  std::list<std::string> lru_;  // Most recently used at the front.
+  cv::Ptr<ThumbnailIndex> index_;
+  size_t budget_;
+  size_t bytes_;
+  int hits_;
+  int misses_;
+  
+  // Disallow copy and assign.
+  void operator= (const ImageStore&);
+  ImageStore(const ImageStore&);
+};
+
+#endif /* defined(__image_browser__ImageStore__) */
@@ -0,0 +1,81 @@
+//
+//  Log.cpp
+//  image-browser
+//
+
+#include "Log.h"
+#include <iostream>
+
+LogLevel Log::level_ = LOG_INFO;
+
+namespace {
+
+cv::Mutex g_log_mutex;
+StderrLogSink g_stderr_sink;
+LogSink* g_sink = &g_stderr_sink;
+std::string g_debug_image_dir;
+int g_debug_image_num = 0;
+
+}  // namespace
+
+void StderrLogSink::Write(LogLevel level, const std::string& message) {
+  static const char tags[] = {'D', 'I', 'W', 'E'};
+  std::cerr << "[" << tags[level] << "] " << message << std::endl;
+}
+
+void Log::set_sink(LogSink* sink) {
+  cv::AutoLock lock(g_log_mutex);
+  g_sink = (NULL == sink) ? &g_stderr_sink : sink;
+}
+
+void Log::Write(LogLevel level, const char* file, int line,
+                const std::string& message) {
+  if ((level < LOG_DEBUG) || (level >= LOG_NONE))
+    return;
+  // Call sites are identified by file and line; the map stays as small as
+  // the number of LOG statements.
+  static std::map<std::pair<const char*, int>, SiteState> sites;
+  int64 now = cv::getTickCount();
+  cv::AutoLock lock(g_log_mutex);
+  SiteState& site = sites[std::make_pair(file, line)];
+  if (now - site.window_start_ > cv::getTickFrequency()) {
+    site.window_start_ = now;
+    site.count_ = 0;
+  }
+  if (site.count_ >= LOG_RATE_LIMIT) {
+    ++site.dropped_;
+    return;
+  }
+  ++site.count_;
+  if (site.dropped_ > 0) {
+    std::ostringstream with_dropped;
+    with_dropped << message << " (" << site.dropped_ << " similar messages dropped)";
+    site.dropped_ = 0;
+    g_sink->Write(level, with_dropped.str());
+  } else {
+    g_sink->Write(level, message);
+  }
+}
+
+void Log::set_debug_image_dir(const std::string& directory) {
+  cv::AutoLock lock(g_log_mutex);
+  g_debug_image_dir = directory;
+}
+
+void Log::DebugImage(const std::string& name, const cv::Mat& image) {
+  std::string path;
+  {
+    cv::AutoLock lock(g_log_mutex);
+    if (g_debug_image_dir.empty() || image.empty())
+      return;
+    std::ostringstream stream;
+    stream << g_debug_image_dir << "/" << ++g_debug_image_num << "_" << name << ".png";
+    path = stream.str();
+  }
+  // Floating point images are in [0, 1], as imshow() expects.
+  cv::Mat output = image;
+  if (image.depth() == CV_32F || image.depth() == CV_64F)
+    image.convertTo(output, CV_8U, 255);
+  if (!cv::imwrite(path, output))
+    LOG(LOG_WARNING, "cannot write debug image " << path);
+}
@@ -0,0 +1,84 @@
+//
+//  Log.h
+//  image-browser
+//
+//  Leveled, thread-safe and rate-limited logging, plus a debug image sink.
+//
+
+#ifndef __image_browser__Log__
+#define __image_browser__Log__
+
+#include <map>
+#include <opencv2/opencv.hpp>
+#include <sstream>
+#include <string>
+#define LOG_RATE_LIMIT 10  // Max messages per call site and second.
+
+enum LogLevel {
+  LOG_DEBUG = 0,
+  LOG_INFO = 1,
+  LOG_WARNING = 2,
+  LOG_ERROR = 3,
+  LOG_NONE = 4      // Only for Log::set_level(), to silence everything.
+};
+
+// Destination of log messages. Write() is called with Log's lock held, so
+// sinks need no locking of their own.
+class LogSink {
+public:
+  virtual ~LogSink() {}
+  virtual void Write(LogLevel level, const std::string& message) = 0;
+};
+
+// Writes "[W] message" lines to std::cerr.
+class StderrLogSink : public LogSink {
+public:
+  virtual void Write(LogLevel level, const std::string& message);
+};
+
+class Log {
+public:
+  // Messages below level are dropped before they are formatted.
+  // (LOG_INFO by default)
+  static bool enabled(LogLevel level) {
+    return level >= level_;
+  }
+  static void set_level(LogLevel level) {
+    level_ = level;
+  }
+  // The sink is not owned. NULL restores the default StderrLogSink.
+  static void set_sink(LogSink* sink);
+  
+  // Emit message from call site file:line. Each call site may emit at most
+  // LOG_RATE_LIMIT messages per second; the number of dropped messages is
+  // appended to the next message of the same site.
+  static void Write(LogLevel level, const char* file, int line,
+                    const std::string& message);
+  
+  // Debug images are written as <directory>/<number>_<name>.png instead of
+  // being shown in a window. Empty directory (the default) drops them.
+  static void set_debug_image_dir(const std::string& directory);
+  static void DebugImage(const std::string& name, const cv::Mat& image);
+  
+private:
+  class SiteState {
+  public:
+    SiteState() : window_start_(0), count_(0), dropped_(0) {}
+    int64 window_start_;
+    int count_;
+    int dropped_;
+  };
+  static LogLevel level_;
+};
+
+// LOG(LOG_WARNING, "cannot read " << path);
+#define LOG(level, message) \
+  do { \
+    if (Log::enabled(level)) { \
+      std::ostringstream log_stream_; \
+      log_stream_ << message; \
+      Log::Write(level, __FILE__, __LINE__, log_stream_.str()); \
+    } \
+  } while (0)
+
+#endif /* defined(__image_browser__Log__) */
@@ -7,6 +7,9 @@
 //
 
 #include "MangaEngine.h"
+#include "Halftone.h"
+#include "ToneCurve.h"
+#include "Trace.h"
 #include <math.h>
 
 const float PI = 3.1415926;
@@ -14,6 +17,7 @@ const float PI = 3.1415926;
 // Given an inuput image (image_), extract the edges to obtain the structure
 // component of manga image.
 bool MangaEngine::ExtractStructure(float sigma, float thresh1, float thresh2) {
+  TRACE_SCOPE("ExtractStructure");
   if (image_.empty())
     return false;
   
@@ -84,7 +88,10 @@ bool MangaEngine::ExtractStructure(float sigma, float thresh1, float thresh2) {
 //  }
 //  delete[] dev_gaussian_weights;
 //  delete[] diff_gaussian_weights;
-  structure_ = cl_->fdog_edge();
+  if (fixed_point_)
+    structure_ = cl_->fdog_mask();
+  else
+    structure_ = cl_->fdog_edge();
 //  cv::imshow("structure", structure_);
 //  cv::waitKey();
   return true;
@@ -139,25 +146,28 @@ void MangaEngine::GetDiffGaussianWeights(float* weights,
 
 // Given an inuput image (image_), render the manga-like texture.
 bool MangaEngine::ExtractTexture(float theta) {
+  TRACE_SCOPE("ExtractTexture");
   if (image_.empty())
     return false;
-  // texture_ is a CV_32FC1 image ranging in [0, 1].
-  if (!texture_.empty())
-    texture_.release();
-  texture_ = cv::Mat::zeros(rows_, cols_, CV_32FC1);
   
   cv::Mat tone_mapping;
   cv::Mat halftoning;
   
-  // Step 1: tone mapping. [0, 1], CV32FC1
+  // Step 1: tone mapping. [0, 1], CV32FC1 (fixed-point: [0, 255], CV_8UC1)
   if (!ToneMapping(&tone_mapping))
     return false;
-  // Step 2: halftoning by using bayer 2x2 templates. [0, 1],  CV32FC1
+  // Step 2: halftoning by ordered dithering. {0, 255}, CV_8UC1
   if (!Halftoning(&halftoning))
     return false;
   
   // Step 3: combining tone_mapping and haltoning into the texture rendering result.
-  texture_ = theta * tone_mapping + (1 - theta) * halftoning;
+  if (fixed_point_) {
+    cv::addWeighted(tone_mapping, theta, halftoning, 1 - theta, 0, texture_);
+  } else {
+    // The halftone is scaled to [0, 1 - theta] while converting it to float.
+    halftoning.convertTo(halftoning, CV_32FC1, (1 - theta) / 255);
+    cv::scaleAdd(tone_mapping, theta, halftoning, texture_);
+  }
   return true;
 }
 
@@ -165,127 +175,29 @@ bool MangaEngine::ExtractTexture(float theta) {
 bool MangaEngine::ToneMapping(cv::Mat* tone_mapping) {
   if (NULL == tone_mapping)
     return false;
-  
-  // Prepare tartget cumulative hisotgram.
-  cv::Mat c_target(256, 1, CV_32FC1);
-  cv::Mat h_bright(256, 1, CV_32FC1);
-  cv::Mat h_dark(256, 1, CV_32FC1);
-  cv::Mat h_mid(256, 1, CV_32FC1);
-  float sum_bright = 0;
-  float sum_dark = 0;
-  float sum_mid = 0;
-  float sum = 0;
-  for (int i = 0; i < 256; ++i) {
-    // bright tone.
-    h_bright.at<float>(i) = exp((i - 255) / 9);
-    sum_bright += h_bright.at<float>(i);
-    // dark tone.
-    h_dark.at<float>(i) = exp(i / -9);
-    sum_dark += h_dark.at<float>(i);
-    // middle tone
-    if ((i <= 225) && (i >= 105))
-      h_mid.at<float>(i) = 1;
-    else
-      h_mid.at<float>(i) = 0;
-    sum_mid += h_mid.at<float>(i);
-  }
-  
-  float bright, dark, mid;
-  for (int i = 0; i < 256; ++i) {
-    bright = h_bright.at<float>(i) / sum_bright;
-    dark = h_dark.at<float>(i) / sum_dark;
-    mid = h_mid.at<float>(i) / sum_mid;
-    sum += (10 * bright + mid + 5 * dark) / 16;
-    c_target.at<float>(i) = sum;
-  }
-  
   // Tone mapping by using histogram specification.
-  if(!HistSpecification(c_target, tone_mapping))
-    return false;
-  else
-    return true;
+  return HistSpecification(MangaToneTarget(), tone_mapping);
 }
 
-// Ordered dithering by using Bayer template (2x2).
+// Ordered dithering by using the threshold matrix selected by dither_.
+// halftoning is CV_8UC1, 0 or 255.
 bool MangaEngine::Halftoning(cv::Mat* halftoning) {
   if (NULL == halftoning)
     return false;
-  halftoning->create(rows_, cols_, CV_32FC1);
-  uchar bayer[4] = {102, 153, 204, 51};
-  for (int r = 0; r < rows_ ; ++r) {
-    for (int c = 0; c < cols_ ; ++c) {
-      int ind = r % 2 * 2 + c % 2;
-      if (image_.at<uchar>(r, c) >= bayer[ind]) {
-        halftoning->at<float>(r, c) = 1.0;
-      } else {
-        halftoning->at<float>(r, c) = 0.0;
-      }
-    }
-  }
-  return true;
+  return OrderedDither(image_, dither_, halftoning);
 }
 
 // Histogram specification by using group mapping.
-bool MangaEngine::HistSpecification(const cv::Mat& c_target, cv::Mat* tone_mapping) {
-  if (c_target.empty() || image_.empty())
+bool MangaEngine::HistSpecification(const float* c_target, cv::Mat* tone_mapping) {
+  if ((NULL == c_target) || image_.empty())
     return false;
   // The mapping of pixel values from original image to target image.
-  cv::Mat hist_map(1, 256, CV_8UC1);
-  // Histogram for original image. (CV_32FC1)
-  cv::Mat h_ori;
-  float range[] = {0, 255};
-  const float* ranges = {range};
-  int histSize = 256;
-  cv::calcHist(&image_, 1, 0, cv::Mat(), h_ori, 1, &histSize, &ranges, true, false);
-  // Cumulative histogram for original image.
-  cv::Mat c_ori(256, 1, CV_32FC1);
-  float sum = 0;
-  for (int i = 0; i < 256; ++i) {
-    sum += h_ori.at<float>(i);
-    c_ori.at<float>(i) = sum;
-  }
-  for (int i = 0; i < 256; ++i) {
-    c_ori.at<float>(i) /= sum;
-  }
-  
-  // Distance matrix.
-  cv::Mat dist(256, 256, CV_32FC1);
-  for (int y = 0; y < 256; ++y) {
-    for (int x = 0; x < 256; ++x) {
-      dist.at<float>(x, y) = fabs(c_ori.at<float>(y) - c_target.at<float>(x));
-    }
-  }
-  
-  // Construct mapping index.
-  int last_start_y = 0, last_end_y = 0, start_y = 0, end_y = 0;
-  float min_dist = 0;
-  for (int x = 0; x < 256; ++x) {
-    min_dist = dist.at<float>(x, 0);
-    for (int y = 0; y < 256; ++y) {
-      if (min_dist >= dist.at<float>(x, y)) {
-        end_y = y;
-        min_dist = dist.at<float>(x, y);
-      }
-    }
-    if ((start_y != last_start_y) || (end_y != last_end_y)) {
-      for (int i = start_y; i <= end_y; ++i) {
-        hist_map.at<uchar>(i) = static_cast<uchar>(x);
-      }
-      last_start_y = start_y;
-      last_end_y = end_y;
-      start_y = last_end_y + 1;
-    }
-  }
-  
-  // Image pixel value mapping.
-  tone_mapping->create(rows_, cols_, CV_32FC1);
-  for (int r = 0; r < rows_; ++r) {
-    for (int c = 0; c < cols_; ++c) {
-      uchar gray = image_.at<uchar>(r, c);
-      float new_gray = static_cast<float>(hist_map.at<uchar>(gray)) / 255.0;
-      tone_mapping->at<float>(r, c) = new_gray;
-    }
-  }
+  uchar hist_map[256];
+  SpecifyHistogram(image_, c_target, hist_map);
+  // Image pixel value mapping, fused with the conversion to [0, 1] unless
+  // the pipeline runs in fixed-point.
+  cv::LUT(image_, ToneLookupTable(hist_map, fixed_point_ ? CV_8U : CV_32F),
+          *tone_mapping);
   return true;
 }
 
@@ -295,6 +207,10 @@ bool MangaEngine::AddFrameTemplate(const string& frame_path) {
   if (frame.empty() || manga_.empty())
     return false;
   cv::resize(frame, frame, cv::Size(cols_, rows_));
+  if (CV_8UC1 == manga_.type()) {
+    cv::multiply(manga_, frame, manga_, 1.0 / 255);
+    return true;
+  }
   cv::Mat float_frame;
   frame.convertTo(float_frame, CV_32FC1);
   manga_ = manga_.mul(float_frame / 255.0);
@@ -343,8 +259,14 @@ bool MangaEngine::AddText(const string& text, const string& dialog_path, const c
       if (c_pos >= cols_)
         break;
       float weight = alpha.at<uchar>(r, c) / 255.0;
-      manga_.at<float>(r_pos, c_pos) = manga_.at<float>(r_pos, c_pos) * (1 - weight) +
-      weight * dialog_gray.at<uchar>(r, c) / 255.0;
+      if (CV_8UC1 == manga_.type()) {
+        manga_.at<uchar>(r_pos, c_pos) =
+        cv::saturate_cast<uchar>(manga_.at<uchar>(r_pos, c_pos) * (1 - weight) +
+                                 weight * dialog_gray.at<uchar>(r, c));
+      } else {
+        manga_.at<float>(r_pos, c_pos) = manga_.at<float>(r_pos, c_pos) * (1 - weight) +
+        weight * dialog_gray.at<uchar>(r, c) / 255.0;
+      }
     }
   }
   
@@ -357,3 +279,19 @@ bool MangaEngine::AddText(const string& text, const string& dialog_path, const c
   cv::putText(manga_, text, text_pos, fontFace, fontScale, cv::Scalar::all(255), thickness);
   return true;
 }
+
+// Resize manga_ to the size of bgr and write it there as BGR.
+bool MangaEngine::OutputBGR(cv::Mat* bgr) const {
+  if ((NULL == bgr) || manga_.empty() || (CV_8UC3 != bgr->type()))
+    return false;
+  cv::Mat gray;
+  if (CV_8UC1 == manga_.type()) {
+    gray = manga_;
+  } else {
+    manga_.convertTo(gray, CV_8UC1, 255);
+  }
+  // Resize the single channel plane first, then expand it into bgr in place.
+  cv::resize(gray, gray, bgr->size());
+  cv::cvtColor(gray, *bgr, CV_GRAY2BGR);
+  return true;
+}
@@ -10,6 +10,8 @@
 #define __Im2Manga__MangaEngine__
 
 #include "CoherentLine.h"
+#include "Halftone.h"
+#include "Trace.h"
 #include <string>
 #include <iostream>
 #include <opencv2/opencv.hpp>
@@ -22,6 +24,8 @@ public:
   // Constructors:
   explicit MangaEngine(const string& file_path) {
     cl_ = new CoherentLine(file_path);
+    dither_ = BAYER_2X2;
+    fixed_point_ = false;
     image_ = cv::imread(file_path, 0);
     if (!image_.empty()) {
       rows_ = image_.rows;
@@ -29,22 +33,16 @@ public:
     }
   }
   explicit MangaEngine(const cv::Mat& image) {
-    cl_ = new CoherentLine(image);
-    if (!image.empty()) {
-      if (1 == image.channels()) {
-        image.copyTo(image_);
-      } else {
-        cv::cvtColor(image, image_, CV_RGB2GRAY);
-      }
-      rows_ = image_.rows;
-      cols_ = image_.cols;
-    }
+    Init(image, new CoherentLine(image));
   }
-  ~MangaEngine() {
-    delete cl_;
+  // Reuse the edge analysis of image, e.g. shared with a CartoonEngine.
+  MangaEngine(const cv::Mat& image, const cv::Ptr<CoherentLine>& cl) {
+    Init(image, cl);
   }
   
   // Accessers:
+  // texture(), structure() and manga() are CV_32FC1 [0, 1], or CV_8UC1
+  // [0, 255] in fixed-point mode.
   const cv::Mat& texture() const {
     return texture_;
   }
@@ -54,19 +52,38 @@ public:
   const cv::Mat& manga() const {
     return manga_;
   }
+  // Threshold matrix used by halftoning. (BAYER_2X2 by default)
+  void set_dither(DitherType dither) {
+    dither_ = dither;
+  }
+  // In fixed-point mode, tone mapping, halftone blending and the structure
+  // multiply run on CV_8UC1 planes with saturating arithmetic.
+  void set_fixed_point(bool fixed_point) {
+    fixed_point_ = fixed_point;
+  }
+  bool fixed_point() const {
+    return fixed_point_;
+  }
   
   // Manga conversion:
   bool Convert2Manga(float sigma, float thresh1, float thresh2, float theta) {
+    TRACE_SCOPE("Convert2Manga");
     if (!ExtractStructure(sigma, thresh1, thresh2))
       return false;
     if (!ExtractTexture(theta))
       return false;
-    manga_ = structure_.mul(texture_);
+    if (fixed_point_)
+      cv::multiply(structure_, texture_, manga_, 1.0 / 255);
+    else
+      manga_ = structure_.mul(texture_);
     return true;
   }
   bool Convert2Manga() {
     return Convert2Manga(1.0, 100, 1.0, 0.7);
   }
+  // Resize manga_ to the size of bgr and write it there as BGR.
+  // bgr must be a CV_8UC3 image, e.g. a ROI of the collage canvas.
+  bool OutputBGR(cv::Mat* bgr) const;
   
   // Functions:
   // Adding frame template for generated manga.
@@ -74,6 +91,21 @@ public:
   bool AddText(const string& text, const string& dialog_path, const cv::Point2f left_top);
   
 private:
+  void Init(const cv::Mat& image, const cv::Ptr<CoherentLine>& cl) {
+    cl_ = cl;
+    dither_ = BAYER_2X2;
+    fixed_point_ = false;
+    if (!image.empty()) {
+      if (1 == image.channels()) {
+        image.copyTo(image_);
+      } else {
+        cv::cvtColor(image, image_, CV_RGB2GRAY);
+      }
+      rows_ = image_.rows;
+      cols_ = image_.cols;
+    }
+  }
+  
   bool ExtractStructure(float sigma, float thresh1, float thresh2);
   // Functions used by ExtractStructure:
   void GetGaussianWeights(float* weights, int neighbor, float sigma);
@@ -84,16 +116,18 @@ private:
   // Functions used by ExtractTexture:
   bool ToneMapping(cv::Mat* tone_mapping);
   bool Halftoning(cv::Mat* halftoning);
-  bool HistSpecification(const cv::Mat& h_target, cv::Mat* tone_mapping);
+  bool HistSpecification(const float* c_target, cv::Mat* tone_mapping);
 
-  CoherentLine* cl_;
+  cv::Ptr<CoherentLine> cl_;
   cv::Mat image_;      // Original input image (single-channel/gray-scale image)
   // type: CV_8UC1 [0, 255]
   cv::Mat texture_;    // Texture rendering result.
-  // type: CV_32FC1 [0, 1]
+  // type: CV_32FC1 [0, 1] (fixed-point: CV_8UC1 [0, 255])
   cv::Mat structure_;  // Structure extraction result.
-  // type: CV_32FC1 [0, 1]
+  // type: CV_32FC1 [0, 1] (fixed-point: CV_8UC1 [0, 255])
   cv::Mat manga_;      // Manga image as a combination of texture_ and structure_.
+  DitherType dither_;  // Threshold matrix for halftoning.
+  bool fixed_point_;   // Run the pipeline on CV_8UC1 planes.
   int rows_;           // Original image row number.
   int cols_;           // Original image col number.
   
@@ -0,0 +1,81 @@
+//
+//  MappedFile.cpp
+//  image-browser
+//
+
+#include "MappedFile.h"
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+MappedFile::MappedFile() : data_(NULL), size_(0), mtime_(0) {
+}
+
+MappedFile::~MappedFile() {
+  Close();
+}
+
+bool MappedFile::Open(const std::string& path) {
+  Close();
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if ((0 != fstat(fd, &st)) || (st.st_size <= 0)) {
+    close(fd);
+    return false;
+  }
+  void* mapping = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  // The mapping stays valid after the descriptor is closed.
+  close(fd);
+  if (MAP_FAILED == mapping)
+    return false;
+  data_ = static_cast<const unsigned char*>(mapping);
+  size_ = st.st_size;
+  mtime_ = st.st_mtime;
+  return true;
+}
+
+void MappedFile::Close() {
+  if (NULL != data_)
+    munmap(const_cast<unsigned char*>(data_), size_);
+  data_ = NULL;
+  size_ = 0;
+  mtime_ = 0;
+}
+
+bool ReadFile(const std::string& path,
+              size_t max_bytes,
+              std::vector<unsigned char>* data,
+              time_t* mtime,
+              off_t* file_size) {
+  data->clear();
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return false;
+  struct stat st;
+  if (0 != fstat(fd, &st)) {
+    close(fd);
+    return false;
+  }
+  size_t size = static_cast<size_t>(st.st_size);
+  if ((max_bytes > 0) && (max_bytes < size))
+    size = max_bytes;
+  data->resize(size);
+  size_t done = 0;
+  while (done < size) {
+    ssize_t count = read(fd, &(*data)[done], size - done);
+    if (count <= 0)
+      break;
+    done += count;
+  }
+  close(fd);
+  // The file may have shrunk since fstat().
+  data->resize(done);
+  if (NULL != mtime)
+    *mtime = st.st_mtime;
+  if (NULL != file_size)
+    *file_size = st.st_size;
+  return !data->empty();
+}
@@ -0,0 +1,74 @@
+//
+//  MappedFile.h
+//  image-browser
+//
+//  Read-only memory mapping of a whole file.
+//
+//  Reading a page past the end of a file truncated while mapped raises
+//  SIGBUS. Map only files the process controls, such as the thumbnail
+//  index, which is replaced by rename() rather than rewritten in place;
+//  user files are read with ReadFile() instead.
+//
+
+#ifndef __image_browser__MappedFile__
+#define __image_browser__MappedFile__
+
+#include <limits.h>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+class MappedFile {
+public:
+  MappedFile();
+  ~MappedFile();
+  
+  // Map path. Returns false if it cannot be opened or is empty.
+  bool Open(const std::string& path);
+  void Close();
+  bool empty() const {
+    return NULL == data_;
+  }
+  const unsigned char* data() const {
+    return data_;
+  }
+  size_t size() const {
+    return size_;
+  }
+  // Stamp of the file when it was mapped.
+  time_t mtime() const {
+    return mtime_;
+  }
+  off_t file_size() const {
+    return static_cast<off_t>(size_);
+  }
+  // Non-owning 1 x size CV_8UC1 view, e.g. for cv::imdecode(). Empty if
+  // the file is too large for the int columns of a Mat.
+  cv::Mat buffer() const {
+    if (empty() || (size_ > static_cast<size_t>(INT_MAX)))
+      return cv::Mat();
+    return cv::Mat(1, static_cast<int>(size_), CV_8UC1,
+                   const_cast<unsigned char*>(data_));
+  }
+  
+private:
+  const unsigned char* data_;
+  size_t size_;
+  time_t mtime_;
+  
+  // Disallow copy and assign.
+  void operator= (const MappedFile&);
+  MappedFile(const MappedFile&);
+};
+
+// Read up to max_bytes of path, or all of it if max_bytes is 0, into data.
+// mtime and file_size, if not NULL, receive the stamp of the file when it
+// was opened. Returns false if it cannot be read or is empty.
+bool ReadFile(const std::string& path,
+              size_t max_bytes,
+              std::vector<unsigned char>* data,
+              time_t* mtime = NULL,
+              off_t* file_size = NULL);
+
+#endif /* defined(__image_browser__MappedFile__) */
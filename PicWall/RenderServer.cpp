@@ -0,0 +1,267 @@
+//
+//  RenderServer.cpp
+//  image-browser
+//
+
+#include "RenderServer.h"
+#include "BatchRenderer.h"
+#include "ImageStore.h"
+#include "Log.h"
+#include "TileCache.h"
+#include "TonalTexture.h"
+#include "WorkQueue.h"
+#include <errno.h>
+#include <poll.h>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <time.h>
+#define MAX_REQUEST_SIZE (1 << 20)  // Longest accepted request line.
+#define REQUEST_TIMEOUT 5           // Seconds to wait for a request line.
+#define MAX_PENDING 64              // Connections still sending their request.
+
+namespace {
+
+void SendLine(int client, const std::string& line) {
+  std::string msg = line + "\n";
+  const char* data = msg.c_str();
+  size_t left = msg.size();
+  while (left > 0) {
+    ssize_t sent = send(client, data, left, 0);
+    if (sent <= 0) {
+      if ((sent < 0) && (EINTR == errno))
+        continue;
+      return;
+    }
+    data += sent;
+    left -= sent;
+  }
+}
+
+// Connection whose request line has not fully arrived yet.
+class PendingClient {
+public:
+  int fd_;
+  std::string line_;
+  time_t deadline_;
+};
+
+// Receive what is available on a readable client. Returns false once the
+// request can no longer complete (closed, failed or oversized); complete is
+// set when line_ holds the whole request line, without its line break.
+bool ReceiveLine(PendingClient* client, bool* complete) {
+  *complete = false;
+  char buff[4096];
+  ssize_t received = recv(client->fd_, buff, sizeof(buff), 0);
+  if (received < 0)
+    return (EINTR == errno) || (EAGAIN == errno);
+  if (0 == received)
+    return false;
+  std::string& line = client->line_;
+  line.append(buff, received);
+  size_t end = line.find('\n');
+  if (end == std::string::npos)
+    return line.size() < MAX_REQUEST_SIZE;
+  line.erase(end);
+  if (!line.empty() && ('\r' == line[line.size() - 1]))
+    line.erase(line.size() - 1);
+  *complete = true;
+  return true;
+}
+
+void SplitTabs(const std::string& line, std::vector<std::string>* fields) {
+  fields->clear();
+  size_t start = 0;
+  while (true) {
+    size_t end = line.find('\t', start);
+    fields->push_back(line.substr(start, end - start));
+    if (end == std::string::npos)
+      break;
+    start = end + 1;
+  }
+}
+
+class RenderItem : public WorkItem {
+public:
+  RenderItem(int client, const BatchJob& job, int* queued)
+  : client_(client), job_(job), queued_(queued) {}
+  virtual void Run() {
+    std::ostringstream response;
+    if (RunBatchJob(&job_)) {
+      response << "OK\t" << job_.load_ms_ << "\t" << job_.layout_ms_
+               << "\t" << job_.render_ms_ << "\t" << job_.write_ms_
+               << "\t" << job_.total_ms_;
+    } else {
+      response << "ERROR\t" << job_.error_;
+    }
+    SendLine(client_, response.str());
+    close(client_);
+    CV_XADD(queued_, -1);
+  }
+private:
+  int client_;
+  BatchJob job_;
+  int* queued_;
+};
+
+}  // namespace
+
+RenderServer::RenderServer(const std::string& socket_path, int thread_num) {
+  socket_path_ = socket_path;
+  thread_num_ = (thread_num < 1) ? 1 : thread_num;
+  listen_fd_ = -1;
+  queued_ = 0;
+  job_num_ = 0;
+  crop_fit_ = false;
+  stopping_ = 0;
+}
+
+RenderServer::~RenderServer() {
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+    unlink(socket_path_.c_str());
+  }
+}
+
+void RenderServer::Stop() {
+  stopping_ = 1;
+}
+
+bool RenderServer::Serve() {
+  sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (socket_path_.size() >= sizeof(addr.sun_path)) {
+    LOG(LOG_ERROR, "socket path too long " << socket_path_);
+    return false;
+  }
+  strncpy(addr.sun_path, socket_path_.c_str(), sizeof(addr.sun_path) - 1);
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd_ < 0) {
+    LOG(LOG_ERROR, "cannot create socket");
+    return false;
+  }
+  unlink(socket_path_.c_str());
+  if ((0 != bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr))) ||
+      (0 != listen(listen_fd_, 64))) {
+    LOG(LOG_ERROR, "cannot listen on " << socket_path_);
+    close(listen_fd_);
+    listen_fd_ = -1;
+    return false;
+  }
+  
+  WorkQueue queue(thread_num_);
+  // Request lines are gathered from all connections with one poll(), so a
+  // slow client holds up neither the others nor Stop().
+  std::vector<PendingClient> pending;
+  std::vector<pollfd> polls;
+  while (!stopping_) {
+    polls.clear();
+    for (size_t i = 0; i < pending.size(); ++i) {
+      pollfd client_poll;
+      client_poll.fd = pending[i].fd_;
+      client_poll.events = POLLIN;
+      polls.push_back(client_poll);
+    }
+    // Further connections wait in the listen backlog while too many are
+    // pending.
+    bool listening = (pending.size() < MAX_PENDING);
+    if (listening) {
+      pollfd listen_poll;
+      listen_poll.fd = listen_fd_;
+      listen_poll.events = POLLIN;
+      polls.push_back(listen_poll);
+    }
+    // Wake up regularly to notice Stop() and timeouts.
+    int ready = poll(&polls[0], polls.size(), 200);
+    time_t now = time(NULL);
+    std::vector<PendingClient> waiting;
+    for (size_t i = 0; i < pending.size(); ++i) {
+      PendingClient& client = pending[i];
+      bool complete = false;
+      if ((ready > 0) && (0 != polls[i].revents) && !ReceiveLine(&client, &complete)) {
+        close(client.fd_);
+      } else if (complete) {
+        HandleConnection(client.fd_, client.line_, &queue);
+      } else if (now > client.deadline_) {
+        close(client.fd_);
+      } else {
+        waiting.push_back(client);
+      }
+    }
+    pending.swap(waiting);
+    if ((ready > 0) && listening && (0 != polls.back().revents)) {
+      int client = accept(listen_fd_, NULL, NULL);
+      if (client >= 0) {
+        PendingClient new_client;
+        new_client.fd_ = client;
+        new_client.deadline_ = now + REQUEST_TIMEOUT;
+        pending.push_back(new_client);
+      }
+    }
+  }
+  for (size_t i = 0; i < pending.size(); ++i) {
+    close(pending[i].fd_);
+  }
+  // The queue finishes the accepted jobs before it is destroyed.
+  return true;
+}
+
+void RenderServer::HandleConnection(int client, const std::string& line, WorkQueue* queue) {
+  std::vector<std::string> fields;
+  SplitTabs(line, &fields);
+  if ("RENDER" == fields[0]) {
+    BatchJob job;
+    if ((fields.size() < 7) || !IsCollageStyleList(fields[4])) {
+      SendLine(client, "ERROR\tmalformed RENDER request");
+      close(client);
+      return;
+    }
+    int priority = atoi(fields[1].c_str());
+    job.canvas_size_ = cv::Size2i(atoi(fields[2].c_str()), atoi(fields[3].c_str()));
+    job.styles_ = fields[4];
+    job.output_path_ = fields[5];
+    job.image_list_.assign(fields.begin() + 6, fields.end());
+    job.tonal_path_ = tonal_path_;
+    job.html_options_ = html_options_;
+    job.zoom_options_ = zoom_options_;
+    job.crop_fit_ = crop_fit_;
+    ++job_num_;
+    if (!trace_dir_.empty()) {
+      std::ostringstream trace_path;
+      trace_path << trace_dir_ << "/job_" << job_num_ << ".json";
+      job.trace_path_ = trace_path.str();
+    }
+    if ((job.canvas_size_.width <= 0) || (job.canvas_size_.height <= 0)) {
+      SendLine(client, "ERROR\tbad canvas size");
+      close(client);
+      return;
+    }
+    CV_XADD(&queued_, 1);
+    // The worker answers and closes the connection.
+    queue->Push(new RenderItem(client, job, &queued_), priority);
+    return;
+  }
+  if ("STATS" == fields[0]) {
+    ImageStore* store = ImageStore::Instance();
+    std::ostringstream response;
+    response << "OK\timages_bytes\t" << store->bytes()
+             << "\thits\t" << store->hits()
+             << "\tmisses\t" << store->misses()
+             << "\ttile_bytes\t" << TileCache::Instance()->bytes()
+             << "\ttile_hits\t" << TileCache::Instance()->hits()
+             << "\ttile_misses\t" << TileCache::Instance()->misses()
+             << "\tqueued\t" << CV_XADD(&queued_, 0);
+    SendLine(client, response.str());
+  } else if ("FLUSH" == fields[0]) {
+    ImageStore::Instance()->Clear();
+    TonalTexturePool::Instance()->Clear();
+    SendLine(client, "OK");
+  } else {
+    SendLine(client, "ERROR\tunknown request");
+  }
+  close(client);
+}
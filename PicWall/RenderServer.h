@@ -0,0 +1,87 @@
+//
+//  RenderServer.h
+//  image-browser
+//
+//  Long-running collage render service on a Unix domain socket.
+//
+
+#ifndef __image_browser__RenderServer__
+#define __image_browser__RenderServer__
+
+#include "Collage.h"
+#include <signal.h>
+#include <string>
+
+class WorkQueue;
+
+// Each connection sends one request line and receives one response line.
+// Connections that send no complete line within 5 seconds are closed.
+// Fields are separated by tabs, so paths may contain spaces:
+//   RENDER <priority> <width> <height> <style> <output> <image> [<image> ...]
+//     -> OK <load_ms> <layout_ms> <render_ms> <write_ms> <total_ms>
+//   STATS -> OK images_bytes <n> hits <n> misses <n>
+//            tile_bytes <n> tile_hits <n> tile_misses <n> queued <n>
+//   FLUSH -> OK  (drops the decoded-image and tonal texture caches)
+// Errors are answered with "ERROR <message>".
+// style and output follow the batch manifest (see BatchJob). RENDER jobs
+// with a higher priority are started first, e.g. interactive re-layouts
+// ahead of bulk exports. Decoded images (ImageStore) and tonal textures
+// (TonalTexturePool) stay cached between requests.
+class RenderServer {
+public:
+  RenderServer(const std::string& socket_path, int thread_num);
+  ~RenderServer();
+  
+  // Bind the socket and serve requests until Stop() is called.
+  // Returns false if the socket cannot be created.
+  bool Serve();
+  // Ask Serve() to return. Safe to call from a signal handler.
+  void Stop();
+  
+  int queued() const {
+    return CV_XADD(const_cast<int*>(&queued_), 0);
+  }
+  // Tonal texture for 'e' and 'o' jobs, which fail without one.
+  void set_tonal_path(const std::string& tonal_path) {
+    tonal_path_ = tonal_path;
+  }
+  // If set, RENDER job n writes its Chrome trace to <trace_dir>/job_<n>.json.
+  void set_trace_dir(const std::string& trace_dir) {
+    trace_dir_ = trace_dir;
+  }
+  // Tile export settings of html jobs.
+  void set_html_options(const HtmlOptions& html_options) {
+    html_options_ = html_options;
+  }
+  // Pyramid settings of dzi jobs.
+  void set_zoom_options(const DeepZoomOptions& zoom_options) {
+    zoom_options_ = zoom_options;
+  }
+  // Crop sources to their leaves, see CollageAdvanced::set_crop_fit().
+  void set_crop_fit(bool crop_fit) {
+    crop_fit_ = crop_fit;
+  }
+  
+private:
+  // Answer the request line of client: STATS/FLUSH directly, RENDER jobs
+  // are queued.
+  void HandleConnection(int client, const std::string& line, WorkQueue* queue);
+  
+  std::string socket_path_;
+  std::string tonal_path_;
+  std::string trace_dir_;
+  HtmlOptions html_options_;
+  DeepZoomOptions zoom_options_;
+  bool crop_fit_;
+  int job_num_;               // RENDER requests accepted so far.
+  int thread_num_;
+  int listen_fd_;
+  int queued_;                // RENDER jobs waiting or running (CV_XADD).
+  volatile sig_atomic_t stopping_;  // Set by Stop(), e.g. from a signal handler.
+  
+  // Disallow copy and assign.
+  void operator= (const RenderServer&);
+  RenderServer(const RenderServer&);
+};
+
+#endif /* defined(__image_browser__RenderServer__) */
@@ -7,16 +7,97 @@
 //
 
 #include "SketchEngine.h"
+#include "ToneCurve.h"
+#include "Trace.h"
 
-bool SketchEngine::Convert2Sketch(int hardness, int directions, float strength) {
-  if (image_.empty() || gray_image_.empty() || tonal_sample_.empty())
+// Side length of the square blocks scheduled by the wavefront beta solver.
+#define BETA_BLOCK_SIZE 64
+// Smoothness weight (lambda) of the beta least-squares problem.
+#define BETA_LAMBDA 0.2f
+// Max conjugate gradient iterations and relative residual for exact beta.
+#define BETA_CG_MAX_ITER 200
+#define BETA_CG_TOLERANCE 1e-4
+
+// Solves the blocks lying on one block anti-diagonal of the beta recurrence.
+// Blocks on the same anti-diagonal only read rows/cols of the blocks above
+// and to the left of them, which belong to the previous anti-diagonal.
+// ln(H) is read from a single texture tile with wrap-around addressing.
+class BetaWavefrontBody : public cv::ParallelLoopBody {
+public:
+  BetaWavefrontBody(const cv::Mat& log_tone, const cv::Mat& log_tonal,
+                    int diagonal, int first_block_row, cv::Mat* beta)
+  : log_tone_(log_tone), log_tonal_(log_tonal), diagonal_(diagonal),
+  first_block_row_(first_block_row), beta_(beta) {}
+  virtual void operator()(const cv::Range& range) const {
+    int tile_rows = log_tonal_.rows;
+    int tile_cols = log_tonal_.cols;
+    for (int i = range.start; i < range.end; ++i) {
+      int block_row = first_block_row_ + i;
+      int block_col = diagonal_ - block_row;
+      int r_start = std::max(1, block_row * BETA_BLOCK_SIZE);
+      int r_end = std::min(beta_->rows, (block_row + 1) * BETA_BLOCK_SIZE);
+      int c_start = std::max(1, block_col * BETA_BLOCK_SIZE);
+      int c_end = std::min(beta_->cols, (block_col + 1) * BETA_BLOCK_SIZE);
+      for (int r = r_start; r < r_end; ++r) {
+        const float* tone_row = log_tone_.ptr<float>(r);
+        const float* tonal_row = log_tonal_.ptr<float>(r % tile_rows);
+        const float* up = beta_->ptr<float>(r - 1);
+        float* cur = beta_->ptr<float>(r);
+        int tc = c_start % tile_cols;
+        for (int c = c_start; c < c_end; ++c) {
+          float t = tonal_row[tc];
+          cur[c] = (t * tone_row[c] + BETA_LAMBDA * (up[c] + cur[c - 1])) /
+          (t * t + 2 * BETA_LAMBDA);
+          if (++tc == tile_cols)
+            tc = 0;
+        }
+      }
+    }
+  }
+private:
+  const cv::Mat& log_tone_;
+  const cv::Mat& log_tonal_;
+  int diagonal_;
+  int first_block_row_;
+  cv::Mat* beta_;
+};
+
+// Computes Beta * ln(H) row by row, ln(H) tiled with wrap-around addressing.
+class BetaExponentBody : public cv::ParallelLoopBody {
+public:
+  BetaExponentBody(const cv::Mat& beta, const cv::Mat& log_tonal,
+                   cv::Mat* exponent)
+  : beta_(beta), log_tonal_(log_tonal), exponent_(exponent) {}
+  virtual void operator()(const cv::Range& range) const {
+    for (int r = range.start; r < range.end; ++r) {
+      const float* beta_row = beta_.ptr<float>(r);
+      const float* tonal_row = log_tonal_.ptr<float>(r % log_tonal_.rows);
+      float* out = exponent_->ptr<float>(r);
+      for (int c = 0; c < beta_.cols; c += log_tonal_.cols) {
+        int n = std::min(log_tonal_.cols, beta_.cols - c);
+        for (int i = 0; i < n; ++i) {
+          out[c + i] = beta_row[c + i] * tonal_row[i];
+        }
+      }
+    }
+  }
+private:
+  const cv::Mat& beta_;
+  const cv::Mat& log_tonal_;
+  cv::Mat* exponent_;
+};
+
+bool SketchEngine::Convert2Sketch(int hardness, int directions, float strength,
+                                  bool exact_beta) {
+  TRACE_SCOPE("Convert2Sketch");
+  if (image_.empty() || gray_image_.empty() || tonal_.empty() || tonal_->empty())
     return false;
   // structure ranges at [0, 1]
   cv::Mat structure = StrokeStructure(hardness, directions, strength);
   // tone ranges at [0, 1];
   cv::Mat tone = ToneMapping();
   // texture ranges at [0, 1];
-  cv::Mat texture = TextureRendering(tone);
+  cv::Mat texture = TextureRendering(tone, exact_beta);
   // pencil ranges at [0, 1];
   cv::Mat pencil = structure.mul(texture);
   //  cv::imshow("structure", structure);
@@ -47,6 +128,7 @@ bool SketchEngine::Convert2Sketch(int hardness, int directions, float strength)
 
 // Generate pencil stroke structure.
 cv::Mat SketchEngine::StrokeStructure(int hardness, int directions, float strength) {
+  TRACE_SCOPE("StrokeStructure");
   vector<cv::Mat> masks;
   vector<cv::Mat> Gs;
   vector<cv::Mat> Cs;
@@ -124,149 +206,119 @@ cv::Mat SketchEngine::GenerateMask(int mask_size, float angle, int hardness) {
 
 // Map the gray-scale image to pencil-sketch-like tone.
 cv::Mat SketchEngine::ToneMapping() {
+  TRACE_SCOPE("ToneMapping");
   cv::Mat tone(rows_, cols_, CV_32FC1, cv::Scalar(0));
-  if (gray_image_.empty())
+  if (gray_u8_.empty())
     return tone;
-  
-  // Prepare tartget cumulative hisotgram.
-  cv::Mat c_target(256, 1, CV_32FC1);
-  cv::Mat h_bright(256, 1, CV_32FC1);
-  cv::Mat h_dark(256, 1, CV_32FC1);
-  cv::Mat h_mid(256, 1, CV_32FC1);
-  float sum_bright = 0;
-  float sum_dark = 0;
-  float sum_mid = 0;
-  float sum = 0;
-  for (int i = 0; i < 256; ++i) {
-    // bright tone.
-    h_bright.at<float>(i) = expf(static_cast<float>(i - 255) / 9);
-    sum_bright += h_bright.at<float>(i);
-    // dark tone.
-    h_dark.at<float>(i) = expf(static_cast<float>((i - 90) * (i - 90)) / -242);
-    sum_dark += h_dark.at<float>(i);
-    // middle tone
-    if ((i <= 225) && (i >= 105))
-      h_mid.at<float>(i) = 1;
-    else
-      h_mid.at<float>(i) = 0;
-    sum_mid += h_mid.at<float>(i);
-  }
-  
-  float bright, dark, mid;
-  for (int i = 0; i < 256; ++i) {
-    bright = h_bright.at<float>(i) / sum_bright;
-    dark = h_dark.at<float>(i) / sum_dark;
-    mid = h_mid.at<float>(i) / sum_mid;
-    sum += (52 * bright + 37 * mid + 11 * dark) / 100;
-    c_target.at<float>(i) = sum;
-  }
-  
   // Tone mapping by using histogram specification.
-  HistSpecification(c_target, &tone);
-  //  cv::imshow("tone", tone);
-  //  cv::waitKey();
+  HistSpecification(PencilToneTarget(), &tone);
   return tone;
 }
 
 // Histogram specification by using group mapping.
-bool SketchEngine::HistSpecification(const cv::Mat& c_target, cv::Mat* tone) {
-  if (c_target.empty() || gray_image_.empty())
+bool SketchEngine::HistSpecification(const float* c_target, cv::Mat* tone) {
+  if ((NULL == c_target) || gray_u8_.empty())
     return false;
   // The mapping of pixel values from original image to target image.
-  cv::Mat hist_map(1, 256, CV_32FC1);
-  // Histogram for original image. (CV_32FC1)
-  cv::Mat h_ori;
-  float range[] = {0, 255};
-  const float* ranges = {range};
-  int histSize = 256;
-  cv::calcHist(&gray_image_, 1, 0, cv::Mat(), h_ori, 1, &histSize, &ranges, true, false);
-  // Cumulative histogram for original image.
-  cv::Mat c_ori(256, 1, CV_32FC1);
-  float sum = 0;
-  for (int i = 0; i < 256; ++i) {
-    sum += h_ori.at<float>(i);
-    c_ori.at<float>(i) = sum;
-  }
-  for (int i = 0; i < 256; ++i) {
-    c_ori.at<float>(i) /= sum;
-  }
-  
-  // Distance matrix.
-  cv::Mat dist(256, 256, CV_32FC1);
-  for (int y = 0; y < 256; ++y) {
-    for (int x = 0; x < 256; ++x) {
-      dist.at<float>(x, y) = fabs(c_ori.at<float>(y) - c_target.at<float>(x));
-    }
-  }
-  // Construct mapping index.
-  int last_start_y = 0, last_end_y = 0, start_y = 0, end_y = 0;
-  float min_dist = 0;
-  for (int x = 0; x < 256; ++x) {
-    min_dist = dist.at<float>(x, 0);
-    for (int y = 0; y < 256; ++y) {
-      if (min_dist >= dist.at<float>(x, y)) {
-        end_y = y;
-        min_dist = dist.at<float>(x, y);
-      }
-    }
-    if ((start_y != last_start_y) || (end_y != last_end_y)) {
-      for (int i = start_y; i <= end_y; ++i) {
-        hist_map.at<float>(i) = static_cast<float>(x);
-      }
-      last_start_y = start_y;
-      last_end_y = end_y;
-      start_y = last_end_y + 1;
-    }
-  }
-  
-  // Image pixel value mapping.
-  for (int r = 0; r < rows_; ++r) {
-    for (int c = 0; c < cols_; ++c) {
-      float gray = gray_image_.at<float>(r, c);
-      float new_gray = hist_map.at<float>(static_cast<int>(gray)) / 255.0;
-      tone->at<float>(r, c) = new_gray;
-    }
-  }
+  uchar hist_map[256];
+  SpecifyHistogram(gray_u8_, c_target, hist_map);
+  // Image pixel value mapping, fused with the conversion to [0, 1].
+  cv::LUT(gray_u8_, ToneLookupTable(hist_map, CV_32F), *tone);
   return true;
 }
 
 // Pencil drawing texture rendering by using tonal sample image.
-cv::Mat SketchEngine::TextureRendering(cv::Mat& tone) {
+cv::Mat SketchEngine::TextureRendering(const cv::Mat& tone, bool exact_beta) const {
+  TRACE_SCOPE("TextureRendering");
   cv::Mat texture(rows_, cols_, CV_32FC1, cv::Scalar(0));
   if (tone.empty())
     return texture;
   
-  // Get a large tonal sample, by naive tiling.
-  int ny = ceil(static_cast<float>(rows_) / tonal_sample_.rows);
-  int nx = ceil(static_cast<float>(cols_) / tonal_sample_.cols);
-  if ((ny > 1) || (nx > 1))
-    cv::repeat(tonal_sample_, ny, nx, tonal_sample_);
-  cv::resize(tonal_sample_, tonal_sample_, cv::Size2i(cols_, rows_));
-  tonal_sample_ = tonal_sample_ / 255;
+  // ln(H) of a single texture tile, at the scale naive tiling would give.
+  const cv::Mat& log_tonal = tonal_->log_level(tonal_->SelectLevel(rows_, cols_));
+  // ln(J).
+  cv::Mat log_tone;
+  cv::log(tone + 0.000001, log_tone);
   
   cv::Mat Beta(rows_, cols_, CV_32FC1, cv::Scalar(1));
-  for (int c = 0; c < cols_; ++c) {
-    Beta.at<float>(0, c) =
-    logf(tone.at<float>(0, c) + 0.000001) / logf(tonal_sample_.at<float>(0, c) + 0.000001);
+  SolveBetaWavefront(log_tone, log_tonal, &Beta);
+  if (exact_beta) {
+    // The exact solver works on whole-image planes.
+    cv::Mat full_tonal;
+    cv::copyMakeBorder(log_tonal, full_tonal, 0,
+                       std::max(0, rows_ - log_tonal.rows), 0,
+                       std::max(0, cols_ - log_tonal.cols), cv::BORDER_WRAP);
+    SolveBetaExact(log_tone, full_tonal(cv::Rect(0, 0, cols_, rows_)), &Beta);
   }
-  for (int r = 0; r < rows_; ++r) {
-    Beta.at<float>(r, 0) =
-    logf(tone.at<float>(r, 0) + 0.000001) / logf(tonal_sample_.at<float>(r, 0) + 0.000001);
+  
+  // texture = H ^ Beta = exp(Beta * ln(H)).
+  cv::parallel_for_(cv::Range(0, rows_),
+                    BetaExponentBody(Beta, log_tonal, &texture));
+  cv::exp(texture, texture);
+  return texture;
+}
+
+void SketchEngine::SolveBetaWavefront(const cv::Mat& log_tone,
+                                      const cv::Mat& log_tonal,
+                                      cv::Mat* beta) const {
+  // The first row and column have no top/left neighbours:
+  // Beta = ln(J) / ln(H).
+  int tile_rows = log_tonal.rows;
+  int tile_cols = log_tonal.cols;
+  float* first_row = beta->ptr<float>(0);
+  const float* tone_row = log_tone.ptr<float>(0);
+  const float* tonal_row = log_tonal.ptr<float>(0);
+  for (int c = 0; c < cols_; ++c) {
+    first_row[c] = tone_row[c] / tonal_row[c % tile_cols];
   }
   for (int r = 1; r < rows_; ++r) {
-    for (int c = 1; c < cols_; ++c) {
-      float t = logf(tonal_sample_.at<float>(r, c) + 0.000001);
-      float v = (t * logf(tone.at<float>(r, c) + 0.000001) +
-                 0.2 * (Beta.at<float>(r - 1, c) + Beta.at<float>(r, c - 1))) /
-      (t * t + 0.4);
-      Beta.at<float>(r, c) = v;
-    }
+    beta->at<float>(r, 0) =
+    log_tone.at<float>(r, 0) / log_tonal.at<float>(r % tile_rows, 0);
   }
-  for (int r = 0; r < rows_; ++r) {
-    for (int c = 0; c < cols_; ++c) {
-      texture.at<float>(r, c) = powf(tonal_sample_.at<float>(r, c), Beta.at<float>(r, c));
-    }
+  
+  // Beta(r, c) = (t * ln(J) + lambda * (Beta(r - 1, c) + Beta(r, c - 1))) /
+  // (t * t + 2 * lambda), with t = ln(H).
+  int block_rows = (rows_ + BETA_BLOCK_SIZE - 1) / BETA_BLOCK_SIZE;
+  int block_cols = (cols_ + BETA_BLOCK_SIZE - 1) / BETA_BLOCK_SIZE;
+  for (int d = 0; d < block_rows + block_cols - 1; ++d) {
+    int first = std::max(0, d - block_cols + 1);
+    int last = std::min(d, block_rows - 1);
+    cv::parallel_for_(cv::Range(0, last - first + 1),
+                      BetaWavefrontBody(log_tone, log_tonal, d, first, beta));
   }
+}
+
+void SketchEngine::SolveBetaExact(const cv::Mat& log_tone,
+                                  const cv::Mat& log_tonal,
+                                  cv::Mat* beta) const {
+  cv::Mat t2 = log_tonal.mul(log_tonal);
+  cv::Mat rhs = log_tonal.mul(log_tone);
+  // Jacobi preconditioner: diagonal of the system matrix.
+  cv::Mat inv_diag = 1.0 / (t2 + 4 * BETA_LAMBDA);
   
-  return texture;
-}
\ No newline at end of file
+  cv::Mat lap, Ap;
+  cv::Laplacian(*beta, lap, CV_32F, 1, 1, 0, cv::BORDER_REPLICATE);
+  cv::Mat res = rhs - (t2.mul(*beta) - BETA_LAMBDA * lap);
+  cv::Mat z = res.mul(inv_diag);
+  cv::Mat p = z.clone();
+  double rz = res.dot(z);
+  double rhs_norm = cv::norm(rhs);
+  if (rhs_norm == 0)
+    return;
+  for (int i = 0; i < BETA_CG_MAX_ITER; ++i) {
+    if (cv::norm(res) < BETA_CG_TOLERANCE * rhs_norm)
+      break;
+    cv::Laplacian(p, lap, CV_32F, 1, 1, 0, cv::BORDER_REPLICATE);
+    Ap = t2.mul(p) - BETA_LAMBDA * lap;
+    double pAp = p.dot(Ap);
+    if (pAp <= 0)
+      break;
+    double alpha = rz / pAp;
+    cv::scaleAdd(p, alpha, *beta, *beta);
+    cv::scaleAdd(Ap, -alpha, res, res);
+    z = res.mul(inv_diag);
+    double rz_new = res.dot(z);
+    cv::scaleAdd(p, rz_new / rz, z, p);
+    rz = rz_new;
+  }
+}
@@ -14,6 +14,7 @@
 #ifndef __Im2Sketch__SketchEngine__
 #define __Im2Sketch__SketchEngine__
 
+#include "TonalTexture.h"
 #include <string>
 #include <iostream>
 #include <opencv2/opencv.hpp>
@@ -26,35 +27,25 @@ using std::string;
 class SketchEngine {
 public:
   // Constructors:
+  // The tonal texture at tonal_path is shared through TonalTexturePool.
   explicit SketchEngine(const string& file_path, const string& tonal_path) {
     image_ = cv::imread(file_path, 1);
-    tonal_sample_ = cv::imread(tonal_path, 0);
-    if ((!image_.empty()) && (!tonal_sample_.empty())) {
+    tonal_ = TonalTexturePool::Instance()->Get(tonal_path);
+    if ((!image_.empty()) && (!tonal_.empty())) {
       rows_ = image_.rows;
       cols_ = image_.cols;
-      cv::cvtColor(image_, gray_image_, CV_BGR2GRAY);
-      gray_image_.convertTo(gray_image_, CV_32FC1);
-      tonal_sample_.convertTo(tonal_sample_, CV_32FC1);
+      cv::cvtColor(image_, gray_u8_, CV_BGR2GRAY);
+      gray_u8_.convertTo(gray_image_, CV_32FC1);
     }
   }
   explicit SketchEngine(const cv::Mat& image, const cv::Mat& tonal) {
-    if ((!image.empty()) && (!tonal.empty())) {
-      if (3 == image.channels()) {
-        image.copyTo(image_);
-      } else {
-        cv::cvtColor(image, image_, CV_GRAY2BGR);
-      }
-      if (3 == tonal.channels()) {
-        cv::cvtColor(tonal, tonal_sample_, CV_BGR2GRAY);
-      } else {
-        tonal.copyTo(tonal_sample_);
-      }
-      rows_ = image_.rows;
-      cols_ = image_.cols;
-      cv::cvtColor(image_, gray_image_, CV_BGR2GRAY);
-      gray_image_.convertTo(gray_image_, CV_32FC1);
-      tonal_sample_.convertTo(tonal_sample_, CV_32FC1);
-    }
+    if (!tonal.empty())
+      tonal_ = new TonalTexture(tonal);
+    SetImage(image);
+  }
+  explicit SketchEngine(const cv::Mat& image, const cv::Ptr<TonalTexture>& tonal) {
+    tonal_ = tonal;
+    SetImage(image);
   }
   
   // Accessers:
@@ -66,26 +57,60 @@ public:
   }
   
   // Sketch conversion:
-  bool Convert2Sketch(int hardness, int directions, float strength);
+  // exact_beta: if it is true, the texture exponent beta is solved as the
+  // least-squares problem of the paper (conjugate gradient), otherwise the
+  // one-pass recurrence is used.
+  bool Convert2Sketch(int hardness, int directions, float strength, bool exact_beta);
+  bool Convert2Sketch(int hardness, int directions, float strength) {
+    return Convert2Sketch(hardness, directions, strength, false);
+  }
   bool Convert2Sketch() {
     return Convert2Sketch(1, 8, 0.9);
   }
   
 private:
   // Member functions.
+  // Prepare image_ and gray_image_ from the input image.
+  void SetImage(const cv::Mat& image) {
+    if (image.empty() || tonal_.empty())
+      return;
+    if (3 == image.channels()) {
+      image.copyTo(image_);
+    } else {
+      cv::cvtColor(image, image_, CV_GRAY2BGR);
+    }
+    rows_ = image_.rows;
+    cols_ = image_.cols;
+    cv::cvtColor(image_, gray_u8_, CV_BGR2GRAY);
+    gray_u8_.convertTo(gray_image_, CV_32FC1);
+  }
   // Generate pencil stroke structure.
   cv::Mat StrokeStructure(int hardness, int directions, float strength);
   // Map the gray-scale image to pencil-sketch-like tone.
   cv::Mat ToneMapping();
   // Histogram specification by using group mapping.
-  bool HistSpecification(const cv::Mat& c_target, cv::Mat* tone);
+  bool HistSpecification(const float* c_target, cv::Mat* tone);
   // Pencil drawing texture rendering by using tonal sample image.
-  cv::Mat TextureRendering(cv::Mat& tone);
+  // The shared tonal_ is only read, so the engine can be converted again.
+  cv::Mat TextureRendering(const cv::Mat& tone, bool exact_beta) const;
+  // Solve beta with the top/left recurrence, block anti-diagonals in parallel.
+  // log_tone is ln(J). log_tonal is one tile of ln(H), addressed with
+  // wrap-around over the image. beta is CV_32FC1.
+  void SolveBetaWavefront(const cv::Mat& log_tone,
+                          const cv::Mat& log_tonal,
+                          cv::Mat* beta) const;
+  // Refine beta by solving (ln(H)^2 + lambda * L) beta = ln(H) * ln(J),
+  // where L is the Neumann Laplacian, with Jacobi preconditioned CG.
+  // Here log_tonal has the full image size.
+  void SolveBetaExact(const cv::Mat& log_tone,
+                      const cv::Mat& log_tonal,
+                      cv::Mat* beta) const;
   // Generate directional masks.
   cv::Mat GenerateMask(int mask_size, float angle, int hardness);
   cv::Mat image_;            // Original input image.
+  cv::Mat gray_u8_;          // Gray-scale image of the original input (CV_8UC1).
   cv::Mat gray_image_;       // Grau-scale image of the original input.
-  cv::Mat tonal_sample_;     // The tonal sample used for texture rendering.
+  cv::Ptr<TonalTexture> tonal_;  // The tonal sample used for texture rendering.
   cv::Mat pencil_sketch_;    // Single color (grayscale) sketch.
   cv::Mat color_sketch_;     // Colored sketch.
   int rows_;                 // Original image row number.
@@ -0,0 +1,325 @@
+//
+//  ThumbnailIndex.cpp
+//  image-browser
+//
+
+#include "ThumbnailIndex.h"
+#include "ContentHash.h"
+#include "ImageProbe.h"
+#include "Log.h"
+#include "WorkQueue.h"
+#include <algorithm>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define THUMB_ALIGN 64  // Alignment of thumbnail rows in the file.
+
+namespace {
+
+class ThumbResult {
+public:
+  ThumbResult() : success_(false) {
+    memset(&entry_, 0, sizeof(entry_));
+  }
+  bool success_;
+  IndexEntry entry_;
+  std::vector<cv::Mat> levels_;
+};
+
+// Decode one source image and build its pyramid, largest level first, each
+// level downscaled from the one above it.
+void MakeThumbnails(const std::string& path,
+                    const std::vector<int>& level_sizes,
+                    ThumbResult* result) {
+  // Read rather than mapped, see MappedFile.h.
+  std::vector<unsigned char> data;
+  time_t mtime = 0;
+  off_t file_size = 0;
+  if (!ReadFile(path, 0, &data, &mtime, &file_size))
+    return;
+  IndexEntry& entry = result->entry_;
+  entry.mtime_ = mtime;
+  entry.file_size_ = file_size;
+  entry.content_hash_ = HashBytes(&data[0], data.size(), FNV_OFFSET_BASIS);
+  entry.orientation_ = ReadExifOrientation(&data[0], data.size());
+  cv::Mat image = cv::imdecode(cv::Mat(data), 1);
+  if (image.empty())
+    return;
+  ApplyOrientation(entry.orientation_, &image);
+  entry.width_ = image.cols;
+  entry.height_ = image.rows;
+
+  int level_num = static_cast<int>(level_sizes.size());
+  result->levels_.resize(level_num);
+  cv::Mat source = image;
+  for (int i = level_num - 1; i >= 0; --i) {
+    double scale = std::min(1.0, static_cast<double>(level_sizes[i]) /
+                            std::max(image.cols, image.rows));
+    cv::Size2i size(std::max(1, cvRound(image.cols * scale)),
+                    std::max(1, cvRound(image.rows * scale)));
+    if (size == source.size())
+      source.copyTo(result->levels_[i]);
+    else
+      cv::resize(source, result->levels_[i], size, 0, 0, cv::INTER_AREA);
+    source = result->levels_[i];
+  }
+  result->success_ = true;
+}
+
+class ThumbItem : public WorkItem {
+public:
+  ThumbItem(const std::string& path,
+            const std::vector<int>& level_sizes,
+            ThumbResult* result)
+  : path_(path), level_sizes_(level_sizes), result_(result) {}
+  virtual void Run() {
+    MakeThumbnails(path_, level_sizes_, result_);
+  }
+private:
+  std::string path_;
+  const std::vector<int>& level_sizes_;
+  ThumbResult* result_;
+};
+
+// Pad the file with zeros up to a multiple of alignment.
+bool Align(FILE* file, uint64_t alignment, uint64_t* pos) {
+  static const char zeros[THUMB_ALIGN] = {0};
+  size_t padding = static_cast<size_t>((alignment - *pos % alignment) % alignment);
+  if ((padding > 0) && (fwrite(zeros, 1, padding, file) != padding))
+    return false;
+  *pos += padding;
+  return true;
+}
+
+bool Write(FILE* file, const void* data, size_t size, uint64_t* pos) {
+  if ((size > 0) && (fwrite(data, 1, size, file) != size))
+    return false;
+  *pos += size;
+  return true;
+}
+
+int ComparePath(const char* path, size_t length, const std::string& other) {
+  int result = memcmp(path, other.data(), std::min(length, other.size()));
+  if (0 != result)
+    return result;
+  return (length < other.size()) ? -1 : ((length > other.size()) ? 1 : 0);
+}
+
+}  // namespace
+
+ThumbnailIndex::ThumbnailIndex() {
+  data_ = NULL;
+  size_ = 0;
+  header_ = NULL;
+  entries_ = NULL;
+  strings_ = NULL;
+}
+
+ThumbnailIndex::~ThumbnailIndex() {
+  Close();
+}
+
+bool ThumbnailIndex::Open(const std::string& index_path) {
+  Close();
+  if (!file_.Open(index_path))
+    return false;
+  if (file_.size() < sizeof(IndexHeader)) {
+    Close();
+    return false;
+  }
+  data_ = file_.data();
+  size_ = file_.size();
+
+  const IndexHeader* header = reinterpret_cast<const IndexHeader*>(data_);
+  bool valid = (0 == memcmp(header->magic_, THUMB_MAGIC, 8)) &&
+  (header->level_num_ <= THUMB_MAX_LEVELS) &&
+  (header->file_size_ == size_) &&
+  (header->entries_offset_ % 8 == 0) &&
+  (header->entries_offset_ +
+   static_cast<uint64_t>(header->entry_num_) * sizeof(IndexEntry) <= header->strings_offset_) &&
+  (header->strings_offset_ <= size_);
+  if (!valid) {
+    LOG(LOG_WARNING, "malformed thumbnail index " << index_path);
+    Close();
+    return false;
+  }
+  header_ = header;
+  entries_ = reinterpret_cast<const IndexEntry*>(data_ + header->entries_offset_);
+  strings_ = reinterpret_cast<const char*>(data_ + header->strings_offset_);
+  return true;
+}
+
+void ThumbnailIndex::Close() {
+  file_.Close();
+  data_ = NULL;
+  size_ = 0;
+  header_ = NULL;
+  entries_ = NULL;
+  strings_ = NULL;
+}
+
+const IndexEntry* ThumbnailIndex::Find(const std::string& image_path) const {
+  if (empty())
+    return NULL;
+  // Entries are sorted by path: binary search.
+  int low = 0;
+  int high = entry_num() - 1;
+  while (low <= high) {
+    int mid = (low + high) / 2;
+    const IndexEntry& entry = entries_[mid];
+    if (entry.path_offset_ + static_cast<uint64_t>(entry.path_length_) >
+        size_ - header_->strings_offset_)
+      return NULL;
+    int result = ComparePath(strings_ + entry.path_offset_, entry.path_length_, image_path);
+    if (0 == result)
+      return &entry;
+    if (result < 0)
+      low = mid + 1;
+    else
+      high = mid - 1;
+  }
+  return NULL;
+}
+
+std::string ThumbnailIndex::path(const IndexEntry& entry) const {
+  return std::string(strings_ + entry.path_offset_, entry.path_length_);
+}
+
+cv::Mat ThumbnailIndex::Level(const IndexEntry& entry, int level) const {
+  if ((level < 0) || (level >= level_num()))
+    return cv::Mat();
+  const IndexLevel& thumb = entry.levels_[level];
+  uint64_t bytes = static_cast<uint64_t>(thumb.width_) * thumb.height_ * 3;
+  if ((thumb.width_ <= 0) || (thumb.height_ <= 0) || (thumb.offset_ + bytes > size_))
+    return cv::Mat();
+  // Read-only data: callers must not write into the returned Mat.
+  return cv::Mat(thumb.height_, thumb.width_, CV_8UC3,
+                 const_cast<unsigned char*>(data_ + thumb.offset_));
+}
+
+cv::Mat ThumbnailIndex::Thumbnail(const IndexEntry& entry, const cv::Size2i& min_size) const {
+  for (int i = 0; i < level_num(); ++i) {
+    const IndexLevel& thumb = entry.levels_[i];
+    if ((thumb.width_ >= min_size.width) && (thumb.height_ >= min_size.height))
+      return Level(entry, i);
+  }
+  return cv::Mat();
+}
+
+bool ThumbnailIndex::Build(const std::vector<std::string>& image_list,
+                           const std::vector<int>& level_sizes,
+                           const std::string& index_path,
+                           int thread_num) {
+  int level_num = static_cast<int>(level_sizes.size());
+  bool ascending = (level_num >= 1) && (level_num <= THUMB_MAX_LEVELS);
+  for (int i = 1; ascending && (i < level_num); ++i) {
+    ascending = (level_sizes[i - 1] < level_sizes[i]);
+  }
+  if (!ascending) {
+    LOG(LOG_ERROR, "thumbnail levels must be 1 to " << THUMB_MAX_LEVELS
+        << " ascending sizes");
+    return false;
+  }
+  std::vector<std::string> paths(image_list);
+  std::sort(paths.begin(), paths.end());
+  paths.erase(std::unique(paths.begin(), paths.end()), paths.end());
+
+  // Reuse unchanged entries of the previous index.
+  ThumbnailIndex old_index;
+  bool reuse = old_index.Open(index_path) && (old_index.level_num() == level_num);
+  for (int i = 0; reuse && (i < level_num); ++i) {
+    reuse = (old_index.level_size(i) == level_sizes[i]);
+  }
+
+  std::string temp_path = index_path + ".tmp";
+  FILE* file = fopen(temp_path.c_str(), "wb");
+  if (NULL == file) {
+    LOG(LOG_ERROR, "cannot write thumbnail index " << temp_path);
+    return false;
+  }
+  IndexHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic_, THUMB_MAGIC, 8);
+  header.level_num_ = level_num;
+  for (int i = 0; i < level_num; ++i) {
+    header.level_sizes_[i] = level_sizes[i];
+  }
+  uint64_t pos = 0;
+  bool success = Write(file, &header, sizeof(header), &pos);
+
+  std::vector<IndexEntry> entries;
+  std::string strings;
+  int reused_num = 0;
+  // Decode a few images per worker at a time, then append them in path
+  // order, so memory stays bounded for large libraries.
+  if (thread_num < 1)
+    thread_num = 1;
+  const int batch_size = 4 * thread_num;
+  WorkQueue queue(thread_num);
+  for (int start = 0; success && (start < static_cast<int>(paths.size())); start += batch_size) {
+    int batch_num = std::min(batch_size, static_cast<int>(paths.size()) - start);
+    std::vector<ThumbResult> results(batch_num);
+    for (int k = 0; k < batch_num; ++k) {
+      const std::string& path = paths[start + k];
+      const IndexEntry* old_entry = reuse ? old_index.Find(path) : NULL;
+      struct stat st;
+      if ((NULL != old_entry) && (0 == stat(path.c_str(), &st)) &&
+          (old_entry->mtime_ == st.st_mtime) && (old_entry->file_size_ == st.st_size)) {
+        results[k].entry_ = *old_entry;
+        for (int i = 0; i < level_num; ++i) {
+          results[k].levels_.push_back(old_index.Level(*old_entry, i));
+        }
+        results[k].success_ = true;
+        ++reused_num;
+      } else {
+        queue.Push(new ThumbItem(path, level_sizes, &results[k]));
+      }
+    }
+    queue.Wait();
+    for (int k = 0; success && (k < batch_num); ++k) {
+      ThumbResult& result = results[k];
+      if (!result.success_) {
+        LOG(LOG_WARNING, "cannot index " << paths[start + k]);
+        continue;
+      }
+      IndexEntry entry = result.entry_;
+      for (int i = 0; success && (i < level_num); ++i) {
+        const cv::Mat& level = result.levels_[i];
+        success = !level.empty() && level.isContinuous() && Align(file, THUMB_ALIGN, &pos);
+        if (!success)
+          break;
+        entry.levels_[i].width_ = level.cols;
+        entry.levels_[i].height_ = level.rows;
+        entry.levels_[i].offset_ = pos;
+        success = Write(file, level.data, level.total() * level.elemSize(), &pos);
+      }
+      entry.path_offset_ = static_cast<uint32_t>(strings.size());
+      entry.path_length_ = static_cast<uint32_t>(paths[start + k].size());
+      strings += paths[start + k];
+      entries.push_back(entry);
+    }
+  }
+
+  success = success && Align(file, 8, &pos);
+  header.entry_num_ = static_cast<uint32_t>(entries.size());
+  header.entries_offset_ = pos;
+  if (success && !entries.empty())
+    success = Write(file, &entries[0], entries.size() * sizeof(IndexEntry), &pos);
+  header.strings_offset_ = pos;
+  success = success && Write(file, strings.data(), strings.size(), &pos);
+  header.file_size_ = pos;
+  success = success && (0 == fseek(file, 0, SEEK_SET)) &&
+  (fwrite(&header, sizeof(header), 1, file) == 1);
+  success = (0 == fclose(file)) && success;
+  old_index.Close();
+  // Replace the old index atomically; open mappings of it stay valid.
+  if (!success || (0 != rename(temp_path.c_str(), index_path.c_str()))) {
+    LOG(LOG_ERROR, "cannot write thumbnail index " << index_path);
+    unlink(temp_path.c_str());
+    return false;
+  }
+  LOG(LOG_INFO, "indexed " << entries.size() << " images (" << reused_num
+      << " unchanged) into " << index_path);
+  return true;
+}
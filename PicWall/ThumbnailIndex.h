@@ -0,0 +1,114 @@
+//
+//  ThumbnailIndex.h
+//  image-browser
+//
+//  Memory-mapped sidecar index of image metadata and thumbnail pyramids.
+//
+
+#ifndef __image_browser__ThumbnailIndex__
+#define __image_browser__ThumbnailIndex__
+
+#include "MappedFile.h"
+#include <opencv2/opencv.hpp>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#define THUMB_MAX_LEVELS 4     // Max number of pyramid levels.
+#define THUMB_MAGIC "PWTHUMB1"
+
+// On-disk layout. All numbers are in native byte order; the index is a
+// local cache and is not meant to move between machines.
+//   IndexHeader
+//   pixel data: raw BGR thumbnails, each 64-byte aligned
+//   IndexEntry[entry_num], sorted by path
+//   path strings
+class IndexHeader {
+public:
+  char magic_[8];
+  uint32_t entry_num_;
+  uint32_t level_num_;
+  int32_t level_sizes_[THUMB_MAX_LEVELS];  // Longer side of each level, ascending.
+  uint64_t entries_offset_;
+  uint64_t strings_offset_;
+  uint64_t file_size_;
+};
+
+class IndexLevel {
+public:
+  int32_t width_;
+  int32_t height_;
+  uint64_t offset_;    // Raw CV_8UC3 pixels, width_ * 3 bytes per row.
+};
+
+class IndexEntry {
+public:
+  uint32_t path_offset_;  // Into the string table.
+  uint32_t path_length_;
+  uint64_t content_hash_; // HashFile() of the source.
+  int64_t mtime_;         // Source stamp when the entry was built.
+  int64_t file_size_;
+  int32_t width_;         // Upright size, after EXIF orientation.
+  int32_t height_;
+  int32_t orientation_;   // EXIF orientation of the source.
+  int32_t reserved_;
+  IndexLevel levels_[THUMB_MAX_LEVELS];
+};
+
+// Read-only view of an index file. Thumbnails returned by Level() and
+// Thumbnail() point into the mapping, so the index must outlive them.
+class ThumbnailIndex {
+public:
+  ThumbnailIndex();
+  ~ThumbnailIndex();
+
+  // Map an index file. Returns false if it is missing or malformed.
+  bool Open(const std::string& index_path);
+  void Close();
+  bool empty() const {
+    return NULL == header_;
+  }
+  int entry_num() const {
+    return empty() ? 0 : static_cast<int>(header_->entry_num_);
+  }
+  int level_num() const {
+    return empty() ? 0 : static_cast<int>(header_->level_num_);
+  }
+  int level_size(int level) const {
+    return header_->level_sizes_[level];
+  }
+
+  // Entry of image_path, or NULL. The caller decides whether the entry is
+  // still fresh by comparing mtime_ and file_size_ with the file.
+  const IndexEntry* Find(const std::string& image_path) const;
+  const IndexEntry& entry(int i) const {
+    return entries_[i];
+  }
+  std::string path(const IndexEntry& entry) const;
+  // Zero-copy CV_8UC3 thumbnail of one pyramid level.
+  cv::Mat Level(const IndexEntry& entry, int level) const;
+  // Smallest level covering min_size, or an empty Mat.
+  cv::Mat Thumbnail(const IndexEntry& entry, const cv::Size2i& min_size) const;
+
+  // Write an index for image_list to index_path. Thumbnails are scaled so
+  // that their longer side is each of level_sizes (never enlarged).
+  // Entries of an existing index at index_path are reused when the source
+  // file has not changed. Images are decoded by thread_num workers.
+  static bool Build(const std::vector<std::string>& image_list,
+                    const std::vector<int>& level_sizes,
+                    const std::string& index_path,
+                    int thread_num);
+
+private:
+  MappedFile file_;
+  const unsigned char* data_;
+  size_t size_;
+  const IndexHeader* header_;
+  const IndexEntry* entries_;
+  const char* strings_;
+
+  // Disallow copy and assign.
+  void operator= (const ThumbnailIndex&);
+  ThumbnailIndex(const ThumbnailIndex&);
+};
+
+#endif /* defined(__image_browser__ThumbnailIndex__) */
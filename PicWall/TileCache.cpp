@@ -0,0 +1,250 @@
+//
+//  TileCache.cpp
+//  image-browser
+//
+
+#include "TileCache.h"
+#include "ContentHash.h"
+#include "Log.h"
+#include "Trace.h"
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <utime.h>
+#include <vector>
+
+namespace {
+
+class TileFile {
+public:
+  time_t mtime_;
+  size_t bytes_;
+  std::string key_;
+};
+
+bool less_mtime(const TileFile& m, const TileFile& n) {
+  return m.mtime_ < n.mtime_;
+}
+
+bool EndsWith(const std::string& str, const std::string& suffix) {
+  return (str.size() >= suffix.size()) &&
+         (0 == str.compare(str.size() - suffix.size(), suffix.size(), suffix));
+}
+
+}  // namespace
+
+TileCache* TileCache::Instance() {
+  static TileCache cache;
+  return &cache;
+}
+
+TileCache::TileCache() {
+  budget_ = TILE_CACHE_BUDGET;
+  bytes_ = 0;
+  hits_ = 0;
+  misses_ = 0;
+  temp_num_ = 0;
+}
+
+bool TileCache::set_directory(const std::string& directory) {
+  cv::AutoLock lock(mutex_);
+  directory_.clear();
+  tiles_.clear();
+  lru_.clear();
+  bytes_ = 0;
+  if (directory.empty())
+    return true;
+  if ((0 != mkdir(directory.c_str(), S_IRWXU)) && (EEXIST != errno)) {
+    LOG(LOG_ERROR, "cannot create tile cache " << directory);
+    return false;
+  }
+  DIR* dir = opendir(directory.c_str());
+  if (NULL == dir) {
+    LOG(LOG_ERROR, "cannot open tile cache " << directory);
+    return false;
+  }
+  directory_ = directory;
+  time_t now = time(NULL);
+  std::vector<TileFile> files;
+  dirent* item = NULL;
+  while (NULL != (item = readdir(dir))) {
+    std::string name = item->d_name;
+    if (!EndsWith(name, ".png"))
+      continue;
+    std::string path = directory_ + "/" + name;
+    struct stat st;
+    if (0 != stat(path.c_str(), &st))
+      continue;
+    if (std::string::npos != name.find(".tmp")) {
+      // Leftovers of interrupted writes.
+      if (st.st_mtime + TILE_CACHE_TEMP_AGE < now)
+        unlink(path.c_str());
+      continue;
+    }
+    TileFile file;
+    file.mtime_ = st.st_mtime;
+    file.bytes_ = st.st_size;
+    file.key_ = name.substr(0, name.size() - 4);
+    files.push_back(file);
+  }
+  closedir(dir);
+  // Rebuild LRU order from modification times; Get() touches hit tiles.
+  std::sort(files.begin(), files.end(), less_mtime);
+  for (int i = 0; i < static_cast<int>(files.size()); ++i) {
+    Insert(files[i].key_, files[i].bytes_);
+  }
+  Evict();
+  return true;
+}
+
+void TileCache::set_budget(size_t budget) {
+  cv::AutoLock lock(mutex_);
+  budget_ = budget;
+  Evict();
+}
+
+std::string TileCache::Key(const std::string& source_path,
+                           char style,
+                           const std::string& params,
+                           const cv::Size2i& size) {
+  struct stat st;
+  if (0 != stat(source_path.c_str(), &st))
+    return std::string();
+  uint64 source_hash = 0;
+  bool known = false;
+  {
+    cv::AutoLock lock(mutex_);
+    std::map<std::string, SourceHash>::iterator it =
+    source_hashes_.find(source_path);
+    if ((it != source_hashes_.end()) &&
+        (it->second.mtime_ == st.st_mtime) &&
+        (it->second.file_size_ == st.st_size)) {
+      source_hash = it->second.hash_;
+      known = true;
+    }
+  }
+  if (!known) {
+    if (!HashFile(source_path, &source_hash))
+      return std::string();
+    cv::AutoLock lock(mutex_);
+    SourceHash& entry = source_hashes_[source_path];
+    entry.hash_ = source_hash;
+    entry.mtime_ = st.st_mtime;
+    entry.file_size_ = st.st_size;
+  }
+  uint64 hash = HashBytes(&source_hash, sizeof(source_hash), FNV_OFFSET_BASIS);
+  hash = HashBytes(&style, sizeof(style), hash);
+  hash = HashString(params, hash);
+  int dims[2] = {size.width, size.height};
+  hash = HashBytes(dims, sizeof(dims), hash);
+  return HashToHex(hash);
+}
+
+bool TileCache::Get(const std::string& key, cv::Mat* tile) {
+  if (key.empty() || !enabled())
+    return false;
+  TRACE_SCOPE("tile_cache_get");
+  std::string path;
+  {
+    cv::AutoLock lock(mutex_);
+    std::map<std::string, Entry>::iterator it = tiles_.find(key);
+    if (it == tiles_.end()) {
+      ++misses_;
+      TRACE_COUNTER("tile_cache_misses", 1);
+      return false;
+    }
+    lru_.splice(lru_.begin(), lru_, it->second.lru_);
+    path = TilePath(key);
+  }
+  cv::Mat cached = cv::imread(path, -1);
+  if (cached.empty()) {
+    // Deleted by another process sharing the directory.
+    cv::AutoLock lock(mutex_);
+    std::map<std::string, Entry>::iterator it = tiles_.find(key);
+    if (it != tiles_.end()) {
+      bytes_ -= it->second.bytes_;
+      lru_.erase(it->second.lru_);
+      tiles_.erase(it);
+    }
+    ++misses_;
+    TRACE_COUNTER("tile_cache_misses", 1);
+    return false;
+  }
+  // Keep the file's mtime in LRU order for the next set_directory().
+  utime(path.c_str(), NULL);
+  if ((tile->size() == cached.size()) && (tile->type() == cached.type()))
+    cached.copyTo(*tile);
+  else
+    *tile = cached;
+  cv::AutoLock lock(mutex_);
+  ++hits_;
+  TRACE_COUNTER("tile_cache_hits", 1);
+  return true;
+}
+
+bool TileCache::Contains(const std::string& key) {
+  if (key.empty() || !enabled())
+    return false;
+  cv::AutoLock lock(mutex_);
+  return tiles_.find(key) != tiles_.end();
+}
+
+void TileCache::Put(const std::string& key, const cv::Mat& tile) {
+  if (key.empty() || !enabled() || tile.empty())
+    return;
+  TRACE_SCOPE("tile_cache_put");
+  std::string temp_path;
+  {
+    cv::AutoLock lock(mutex_);
+    if (tiles_.find(key) != tiles_.end())
+      return;
+    char buff[64];
+    snprintf(buff, sizeof(buff), ".tmp%d_%d.png",
+             static_cast<int>(getpid()), temp_num_++);
+    temp_path = directory_ + "/" + key + buff;
+  }
+  // Write to a temporary file and rename it, so readers never see a
+  // partially written tile.
+  if (!cv::imwrite(temp_path, tile)) {
+    unlink(temp_path.c_str());
+    return;
+  }
+  struct stat st;
+  std::string path = TilePath(key);
+  if ((0 != stat(temp_path.c_str(), &st)) ||
+      (0 != rename(temp_path.c_str(), path.c_str()))) {
+    unlink(temp_path.c_str());
+    return;
+  }
+  cv::AutoLock lock(mutex_);
+  Insert(key, st.st_size);
+  Evict();
+}
+
+void TileCache::Insert(const std::string& key, size_t bytes) {
+  std::map<std::string, Entry>::iterator it = tiles_.find(key);
+  if (it != tiles_.end()) {
+    bytes_ -= it->second.bytes_;
+    lru_.erase(it->second.lru_);
+    tiles_.erase(it);
+  }
+  lru_.push_front(key);
+  Entry& entry = tiles_[key];
+  entry.bytes_ = bytes;
+  entry.lru_ = lru_.begin();
+  bytes_ += bytes;
+}
+
+void TileCache::Evict() {
+  while ((bytes_ > budget_) && !lru_.empty()) {
+    std::map<std::string, Entry>::iterator it = tiles_.find(lru_.back());
+    unlink(TilePath(it->first).c_str());
+    bytes_ -= it->second.bytes_;
+    tiles_.erase(it);
+    lru_.pop_back();
+  }
+}
@@ -0,0 +1,105 @@
+//
+//  TileCache.h
+//  image-browser
+//
+//  Content-addressed on-disk cache of stylized collage tiles.
+//
+
+#ifndef __image_browser__TileCache__
+#define __image_browser__TileCache__
+
+#include <list>
+#include <map>
+#include <opencv2/opencv.hpp>
+#include <string>
+#define TILE_CACHE_BUDGET (1 << 30)  // Default byte budget on disk.
+// Age in seconds after which temporary files are taken for leftovers of
+// interrupted writes. Younger ones may belong to another process writing.
+#define TILE_CACHE_TEMP_AGE 3600
+
+// Tiles are stored losslessly as <directory>/<key>.png, where the key hashes
+// the source file content, the style code, the engine parameters and the
+// tile size. Changing any of them yields a new key, so entries never need
+// invalidation. Least recently used files are deleted once the directory
+// exceeds the byte budget. The cache is disabled until set_directory() is
+// called.
+class TileCache {
+public:
+  static TileCache* Instance();
+  
+  // Use directory (created if needed) and index the tiles already there.
+  bool set_directory(const std::string& directory);
+  const std::string& directory() const {
+    return directory_;
+  }
+  bool enabled() const {
+    return !directory_.empty();
+  }
+  void set_budget(size_t budget);
+  
+  // Key of a tile rendered from source_path. params lists every engine
+  // setting that changes the result. Returns an empty key if the source
+  // cannot be read.
+  std::string Key(const std::string& source_path,
+                  char style,
+                  const std::string& params,
+                  const cv::Size2i& size);
+  // Load a cached tile. If tile already has the cached size and type (e.g. a
+  // canvas ROI) the pixels are written into it.
+  bool Get(const std::string& key, cv::Mat* tile);
+  // Whether a tile is recorded for key, without reading it. Get() may still
+  // fail if another process deleted the file.
+  bool Contains(const std::string& key);
+  void Put(const std::string& key, const cv::Mat& tile);
+  
+  // Statistics:
+  size_t bytes() const {
+    return bytes_;
+  }
+  int hits() const {
+    return hits_;
+  }
+  int misses() const {
+    return misses_;
+  }
+  
+private:
+  TileCache();
+  
+  class Entry {
+  public:
+    size_t bytes_;
+    std::list<std::string>::iterator lru_;
+  };
+  class SourceHash {
+  public:
+    uint64 hash_;
+    time_t mtime_;
+    off_t file_size_;
+  };
+  std::string TilePath(const std::string& key) const {
+    return directory_ + "/" + key + ".png";
+  }
+  // Record a tile file. Caller holds mutex_.
+  void Insert(const std::string& key, size_t bytes);
+  // Delete least recently used tiles until bytes_ <= budget_.
+  void Evict();
+  
+  cv::Mutex mutex_;
+  std::string directory_;
+  std::map<std::string, Entry> tiles_;
+  std::list<std::string> lru_;  // Most recently used at the front.
+  // Content hashes of source files, revalidated by mtime and size.
+  std::map<std::string, SourceHash> source_hashes_;
+  size_t budget_;
+  size_t bytes_;
+  int hits_;
+  int misses_;
+  int temp_num_;                // Counter for unique temporary file names.
+  
+  // Disallow copy and assign.
+  void operator= (const TileCache&);
+  TileCache(const TileCache&);
+};
+
+#endif /* defined(__image_browser__TileCache__) */
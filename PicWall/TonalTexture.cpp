@@ -0,0 +1,78 @@
+//
+//  TonalTexture.cpp
+//  image-browser
+//
+
+#include "TonalTexture.h"
+#include <math.h>
+
+// Scales at which every tonal texture is kept. Naive tiling followed by a
+// resize to the image size shrinks the sample by a factor in (0.5, 1] when
+// the image is at least as large as the sample. A smaller image shrinks it
+// further, to the ratio of their sizes; the 0.5 level is the closest then.
+static const float kTonalScales[] = {1.0f, 0.75f, 0.5f};
+
+TonalTexture::TonalTexture(const cv::Mat& sample) {
+  if (sample.empty())
+    return;
+  cv::Mat gray;
+  if (3 == sample.channels()) {
+    cv::cvtColor(sample, gray, CV_BGR2GRAY);
+  } else {
+    gray = sample;
+  }
+  gray.convertTo(gray, CV_32FC1, 1.0 / 255);
+  int level_num = sizeof(kTonalScales) / sizeof(kTonalScales[0]);
+  for (int i = 0; i < level_num; ++i) {
+    cv::Size2i size(std::max(1, cvRound(gray.cols * kTonalScales[i])),
+                    std::max(1, cvRound(gray.rows * kTonalScales[i])));
+    cv::Mat level;
+    if (size == gray.size()) {
+      level = gray.clone();
+    } else {
+      cv::resize(gray, level, size, 0, 0, cv::INTER_AREA);
+    }
+    cv::log(level + 0.000001, level);
+    log_levels_.push_back(level);
+    scales_.push_back(kTonalScales[i]);
+  }
+}
+
+int TonalTexture::SelectLevel(int rows, int cols) const {
+  if (empty())
+    return -1;
+  const cv::Mat& sample = log_levels_[0];
+  float ny = ceilf(static_cast<float>(rows) / sample.rows);
+  float nx = ceilf(static_cast<float>(cols) / sample.cols);
+  float expect_scale = (rows / ny / sample.rows + cols / nx / sample.cols) / 2;
+  int best = 0;
+  for (int i = 1; i < level_num(); ++i) {
+    if (fabs(scales_[i] - expect_scale) < fabs(scales_[best] - expect_scale))
+      best = i;
+  }
+  return best;
+}
+
+TonalTexturePool* TonalTexturePool::Instance() {
+  static TonalTexturePool pool;
+  return &pool;
+}
+
+cv::Ptr<TonalTexture> TonalTexturePool::Get(const std::string& path) {
+  cv::AutoLock lock(mutex_);
+  std::map<std::string, cv::Ptr<TonalTexture> >::iterator it =
+  textures_.find(path);
+  if (it != textures_.end())
+    return it->second;
+  cv::Mat sample = cv::imread(path, 0);
+  if (sample.empty())
+    return cv::Ptr<TonalTexture>();
+  cv::Ptr<TonalTexture> texture(new TonalTexture(sample));
+  textures_[path] = texture;
+  return texture;
+}
+
+void TonalTexturePool::Clear() {
+  cv::AutoLock lock(mutex_);
+  textures_.clear();
+}
@@ -0,0 +1,70 @@
+//
+//  TonalTexture.h
+//  image-browser
+//
+//  Paper textures (tonal samples) for pencil drawing. Each texture is read
+//  from disk once per process and kept in the log domain at a few scales,
+//  so every SketchEngine can sample it with wrap-around addressing.
+//
+
+#ifndef __image_browser__TonalTexture__
+#define __image_browser__TonalTexture__
+
+#include <map>
+#include <string>
+#include <vector>
+#include <opencv2/opencv.hpp>
+
+class TonalTexture {
+public:
+  // sample: the tonal sample image, gray-scale or BGR, CV_8U.
+  explicit TonalTexture(const cv::Mat& sample);
+  
+  bool empty() const {
+    return log_levels_.empty();
+  }
+  int level_num() const {
+    return static_cast<int>(log_levels_.size());
+  }
+  float scale(int level) const {
+    return scales_[level];
+  }
+  // ln(H + 0.000001) of the texture at the given level, H ranges at [0, 1].
+  // type: CV_32FC1
+  const cv::Mat& log_level(int level) const {
+    return log_levels_[level];
+  }
+  // Select the level whose scale is closest to the one produced by tiling the
+  // original sample over a rows x cols image and resizing it to fit.
+  int SelectLevel(int rows, int cols) const;
+  
+private:
+  std::vector<cv::Mat> log_levels_;
+  std::vector<float> scales_;
+  
+  // Disallow copy and assign.
+  void operator= (const TonalTexture&);
+  TonalTexture(const TonalTexture&);
+};
+
+// Process-wide registry of tonal textures, keyed by file path.
+class TonalTexturePool {
+public:
+  static TonalTexturePool* Instance();
+  // Returns the texture stored at path, loading it on first use.
+  // The returned pointer is empty if the file cannot be read.
+  cv::Ptr<TonalTexture> Get(const std::string& path);
+  // Drop all loaded textures.
+  void Clear();
+  
+private:
+  TonalTexturePool() {}
+  cv::Mutex mutex_;
+  std::map<std::string, cv::Ptr<TonalTexture> > textures_;
+  
+  // Disallow copy and assign.
+  void operator= (const TonalTexturePool&);
+  TonalTexturePool(const TonalTexturePool&);
+};
+
+#endif /* defined(__image_browser__TonalTexture__) */
@@ -0,0 +1,133 @@
+//
+//  ToneCurve.cpp
+//  image-browser
+//
+
+#include "ToneCurve.h"
+#include <math.h>
+
+// Normalize the three tone layers and accumulate their weighted sum.
+static void BuildToneTarget(const float* h_bright,
+                            const float* h_dark,
+                            const float* h_mid,
+                            float w_bright,
+                            float w_dark,
+                            float w_mid,
+                            float* c_target) {
+  float sum_bright = 0;
+  float sum_dark = 0;
+  float sum_mid = 0;
+  for (int i = 0; i < 256; ++i) {
+    sum_bright += h_bright[i];
+    sum_dark += h_dark[i];
+    sum_mid += h_mid[i];
+  }
+  float sum = 0;
+  float w_sum = w_bright + w_dark + w_mid;
+  for (int i = 0; i < 256; ++i) {
+    sum += (w_bright * h_bright[i] / sum_bright +
+            w_mid * h_mid[i] / sum_mid +
+            w_dark * h_dark[i] / sum_dark) / w_sum;
+    c_target[i] = sum;
+  }
+}
+
+static const float* BuildMangaToneTarget() {
+  static float c_target[256];
+  float h_bright[256], h_dark[256], h_mid[256];
+  for (int i = 0; i < 256; ++i) {
+    // bright tone.
+    h_bright[i] = exp((i - 255) / 9);
+    // dark tone.
+    h_dark[i] = exp(i / -9);
+    // middle tone
+    h_mid[i] = ((i <= 225) && (i >= 105)) ? 1 : 0;
+  }
+  BuildToneTarget(h_bright, h_dark, h_mid, 10, 5, 1, c_target);
+  return c_target;
+}
+
+static const float* BuildPencilToneTarget() {
+  static float c_target[256];
+  float h_bright[256], h_dark[256], h_mid[256];
+  for (int i = 0; i < 256; ++i) {
+    // bright tone.
+    h_bright[i] = expf(static_cast<float>(i - 255) / 9);
+    // dark tone.
+    h_dark[i] = expf(static_cast<float>((i - 90) * (i - 90)) / -242);
+    // middle tone
+    h_mid[i] = ((i <= 225) && (i >= 105)) ? 1 : 0;
+  }
+  BuildToneTarget(h_bright, h_dark, h_mid, 52, 11, 37, c_target);
+  return c_target;
+}
+
+const float* MangaToneTarget() {
+  static const float* c_target = BuildMangaToneTarget();
+  return c_target;
+}
+
+const float* PencilToneTarget() {
+  static const float* c_target = BuildPencilToneTarget();
+  return c_target;
+}
+
+void SpecifyHistogram(const cv::Mat& gray, const float* c_target, uchar* hist_map) {
+  CV_Assert(gray.type() == CV_8UC1);
+  // Cumulative histogram for original image.
+  float c_ori[256];
+  int h_ori[256] = {0};
+  for (int r = 0; r < gray.rows; ++r) {
+    const uchar* row = gray.ptr<uchar>(r);
+    for (int c = 0; c < gray.cols; ++c) {
+      ++h_ori[row[c]];
+    }
+  }
+  float sum = 0;
+  for (int i = 0; i < 256; ++i) {
+    sum += h_ori[i];
+    c_ori[i] = sum;
+  }
+  for (int i = 0; i < 256; ++i) {
+    c_ori[i] /= sum;
+  }
+  
+  // Construct mapping index. Both cumulative histograms are non-decreasing,
+  // so the last y minimizing |c_ori(y) - c_target(x)| never moves backwards
+  // as x grows and a single forward scan over y finds it for every x.
+  bool mapped[256] = {false};
+  int last_start_y = 0, last_end_y = 0, start_y = 0, end_y = 0;
+  int y = 0;
+  for (int x = 0; x < 256; ++x) {
+    float target = c_target[x];
+    while ((y < 255) &&
+           (fabs(c_ori[y + 1] - target) <= fabs(c_ori[y] - target))) {
+      ++y;
+    }
+    end_y = y;
+    if ((start_y != last_start_y) || (end_y != last_end_y)) {
+      for (int i = start_y; i <= end_y; ++i) {
+        hist_map[i] = static_cast<uchar>(x);
+        mapped[i] = true;
+      }
+      last_start_y = start_y;
+      last_end_y = end_y;
+      start_y = last_end_y + 1;
+    }
+  }
+  // Levels left out by group mapping keep the value of the level below.
+  for (int i = 0; i < 256; ++i) {
+    if (!mapped[i])
+      hist_map[i] = (i > 0) ? hist_map[i - 1] : 0;
+  }
+}
+
+cv::Mat ToneLookupTable(const uchar* hist_map, int depth) {
+  cv::Mat lut(1, 256, CV_8UC1);
+  for (int i = 0; i < 256; ++i) {
+    lut.at<uchar>(i) = hist_map[i];
+  }
+  if (CV_32F == depth)
+    lut.convertTo(lut, CV_32FC1, 1.0 / 255);
+  return lut;
+}
@@ -0,0 +1,28 @@
+//
+//  ToneCurve.h
+//  image-browser
+//
+//  Target tone curves and histogram specification shared by MangaEngine and
+//  SketchEngine. The target cumulative histograms are built once per process.
+//
+
+#ifndef __image_browser__ToneCurve__
+#define __image_browser__ToneCurve__
+
+#include <opencv2/opencv.hpp>
+
+// Target cumulative histogram (256 entries) of manga tone mapping.
+const float* MangaToneTarget();
+// Target cumulative histogram (256 entries) of pencil drawing tone mapping.
+const float* PencilToneTarget();
+
+// Histogram specification by using group mapping.
+// gray: CV_8UC1 image, c_target: target cumulative histogram (256 entries).
+// hist_map receives the new value of each of the 256 gray levels.
+void SpecifyHistogram(const cv::Mat& gray, const float* c_target, uchar* hist_map);
+
+// Build a 1x256 lookup table from hist_map for cv::LUT.
+// depth CV_8U keeps [0, 255], CV_32F scales the values to [0, 1].
+cv::Mat ToneLookupTable(const uchar* hist_map, int depth);
+
+#endif /* defined(__image_browser__ToneCurve__) */
@@ -0,0 +1,148 @@
+//
+//  Trace.cpp
+//  image-browser
+//
+
+#include "Trace.h"
+#include <fstream>
+#include <pthread.h>
+
+bool Trace::enabled_ = false;
+
+namespace {
+
+// Per-thread state, stored under a pthread key.
+class ThreadState {
+public:
+  TraceSession* session_;
+  int tid_;
+};
+
+pthread_key_t g_state_key;
+pthread_once_t g_state_once = PTHREAD_ONCE_INIT;
+int g_thread_num = 0;
+
+void DeleteState(void* state) {
+  delete static_cast<ThreadState*>(state);
+}
+
+void CreateStateKey() {
+  pthread_key_create(&g_state_key, DeleteState);
+}
+
+ThreadState* GetState() {
+  pthread_once(&g_state_once, CreateStateKey);
+  ThreadState* state = static_cast<ThreadState*>(pthread_getspecific(g_state_key));
+  if (NULL == state) {
+    state = new ThreadState();
+    state->session_ = NULL;
+    state->tid_ = CV_XADD(&g_thread_num, 1) + 1;
+    pthread_setspecific(g_state_key, state);
+  }
+  return state;
+}
+
+double TickToUs(int64 ticks) {
+  return ticks * 1e6 / cv::getTickFrequency();
+}
+
+// Stage names are identifiers chosen in the code, but escape them anyway.
+void WriteJsonString(std::ostream& out, const std::string& str) {
+  out << '"';
+  for (int i = 0; i < static_cast<int>(str.size()); ++i) {
+    if (('"' == str[i]) || ('\\' == str[i]))
+      out << '\\';
+    out << str[i];
+  }
+  out << '"';
+}
+
+}  // namespace
+
+TraceSession* Trace::session() {
+  return GetState()->session_;
+}
+
+void Trace::set_session(TraceSession* session) {
+  GetState()->session_ = session;
+}
+
+int Trace::thread_id() {
+  return GetState()->tid_;
+}
+
+TraceSession::TraceSession() {
+  origin_ = cv::getTickCount();
+}
+
+void TraceSession::AddEvent(const char* name, int64 start_tick, int64 end_tick, int tid) {
+  Event event;
+  event.name_ = name;
+  event.start_ = start_tick;
+  event.end_ = end_tick;
+  event.tid_ = tid;
+  cv::AutoLock lock(mutex_);
+  events_.push_back(event);
+}
+
+void TraceSession::AddCounter(const std::string& name, int64 value) {
+  cv::AutoLock lock(mutex_);
+  counters_[name] += value;
+}
+
+int64 TraceSession::counter(const std::string& name) const {
+  cv::AutoLock lock(mutex_);
+  std::map<std::string, int64>::const_iterator it = counters_.find(name);
+  return (it == counters_.end()) ? 0 : it->second;
+}
+
+void TraceSession::WriteChromeTrace(std::ostream& out) const {
+  cv::AutoLock lock(mutex_);
+  out << "{\"traceEvents\":[";
+  int64 last_tick = origin_;
+  for (int i = 0; i < static_cast<int>(events_.size()); ++i) {
+    const Event& event = events_[i];
+    out << (i ? ",\n" : "\n") << "{\"name\":";
+    WriteJsonString(out, event.name_);
+    out << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << event.tid_
+        << ",\"ts\":" << TickToUs(event.start_ - origin_)
+        << ",\"dur\":" << TickToUs(event.end_ - event.start_) << "}";
+    last_tick = std::max(last_tick, event.end_);
+  }
+  std::map<std::string, int64>::const_iterator it = counters_.begin();
+  for (; it != counters_.end(); ++it) {
+    out << (events_.empty() && (it == counters_.begin()) ? "\n" : ",\n")
+        << "{\"name\":";
+    WriteJsonString(out, it->first);
+    out << ",\"ph\":\"C\",\"pid\":1,\"ts\":" << TickToUs(last_tick - origin_)
+        << ",\"args\":{\"value\":" << it->second << "}}";
+  }
+  out << "\n]}\n";
+}
+
+bool TraceSession::WriteChromeTrace(const std::string& path) const {
+  std::ofstream out(path.c_str());
+  if (!out.is_open())
+    return false;
+  WriteChromeTrace(out);
+  return out.good();
+}
+
+void TraceSession::WriteSummary(std::ostream& out) const {
+  cv::AutoLock lock(mutex_);
+  std::map<std::string, std::pair<double, int> > stages;
+  for (int i = 0; i < static_cast<int>(events_.size()); ++i) {
+    std::pair<double, int>& stage = stages[events_[i].name_];
+    stage.first += TickToUs(events_[i].end_ - events_[i].start_) / 1000.0;
+    ++stage.second;
+  }
+  std::map<std::string, std::pair<double, int> >::const_iterator stage = stages.begin();
+  for (; stage != stages.end(); ++stage) {
+    out << "stage\t" << stage->first << "\t" << stage->second.first << "ms\t"
+        << stage->second.second << std::endl;
+  }
+  std::map<std::string, int64>::const_iterator it = counters_.begin();
+  for (; it != counters_.end(); ++it) {
+    out << "counter\t" << it->first << "\t" << it->second << std::endl;
+  }
+}
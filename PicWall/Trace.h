@@ -0,0 +1,131 @@
+//
+//  Trace.h
+//  image-browser
+//
+//  Scoped stage timers and counters, collected per render job.
+//
+
+#ifndef __image_browser__Trace__
+#define __image_browser__Trace__
+
+#include <iostream>
+#include <map>
+#include <opencv2/opencv.hpp>
+#include <string>
+#include <vector>
+
+// Stage timings and counters of one job. Events are recorded by the thread
+// that made the session current (see TraceSessionScope). Threads without a
+// current session record nothing.
+class TraceSession {
+public:
+  TraceSession();
+  
+  // name must be a string literal: only the pointer is stored.
+  void AddEvent(const char* name, int64 start_tick, int64 end_tick, int tid);
+  void AddCounter(const std::string& name, int64 value);
+  int64 counter(const std::string& name) const;
+  
+  // Chrome trace JSON ("X" events and the final counter values as "C"
+  // events), loadable in chrome://tracing.
+  void WriteChromeTrace(std::ostream& out) const;
+  bool WriteChromeTrace(const std::string& path) const;
+  // Tab-separated total time and call count per stage, then the counters.
+  void WriteSummary(std::ostream& out) const;
+  
+private:
+  class Event {
+  public:
+    const char* name_;
+    int64 start_;
+    int64 end_;
+    int tid_;
+  };
+  
+  mutable cv::Mutex mutex_;
+  std::vector<Event> events_;
+  std::map<std::string, int64> counters_;
+  int64 origin_;         // Tick count at construction, time zero of the trace.
+  
+  // Disallow copy and assign.
+  void operator= (const TraceSession&);
+  TraceSession(const TraceSession&);
+};
+
+class Trace {
+public:
+  // Tracing is off by default. While it is off, TRACE_SCOPE and
+  // TRACE_COUNTER cost one branch on a global flag.
+  static bool enabled() {
+    return enabled_;
+  }
+  static void set_enabled(bool enabled) {
+    enabled_ = enabled;
+  }
+  // Session of the calling thread, or NULL.
+  static TraceSession* session();
+  // Small per-thread id for trace events.
+  static int thread_id();
+  static void AddCounter(const std::string& name, int64 value) {
+    TraceSession* current = session();
+    if (NULL != current)
+      current->AddCounter(name, value);
+  }
+  
+private:
+  friend class TraceSessionScope;
+  static void set_session(TraceSession* session);
+  static bool enabled_;
+};
+
+// Makes session current for the calling thread during its lifetime.
+class TraceSessionScope {
+public:
+  explicit TraceSessionScope(TraceSession* session) {
+    previous_ = Trace::session();
+    Trace::set_session(session);
+  }
+  ~TraceSessionScope() {
+    Trace::set_session(previous_);
+  }
+private:
+  TraceSession* previous_;
+  
+  // Disallow copy and assign.
+  void operator= (const TraceSessionScope&);
+  TraceSessionScope(const TraceSessionScope&);
+};
+
+// Records the time from construction to destruction as one event.
+class TraceScope {
+public:
+  explicit TraceScope(const char* name) {
+    session_ = Trace::enabled() ? Trace::session() : NULL;
+    if (NULL != session_) {
+      name_ = name;
+      start_ = cv::getTickCount();
+    }
+  }
+  ~TraceScope() {
+    if (NULL != session_)
+      session_->AddEvent(name_, start_, cv::getTickCount(), Trace::thread_id());
+  }
+private:
+  TraceSession* session_;
+  const char* name_;
+  int64 start_;
+  
+  // Disallow copy and assign.
+  void operator= (const TraceScope&);
+  TraceScope(const TraceScope&);
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+// Time the rest of the enclosing block as stage name.
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(trace_scope_, __LINE__)(name)
+// Add value to counter name of the current session.
+#define TRACE_COUNTER(name, value) \
+  do { if (Trace::enabled()) Trace::AddCounter(name, value); } while (0)
+
+#endif /* defined(__image_browser__Trace__) */
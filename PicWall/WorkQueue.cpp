@@ -0,0 +1,96 @@
+//
+//  WorkQueue.cpp
+//  image-browser
+//
+
+#include "WorkQueue.h"
+
+WorkQueue::WorkQueue(int thread_num, int max_pending) {
+  Start(thread_num, max_pending);
+}
+
+WorkQueue::WorkQueue(int thread_num) {
+  Start(thread_num, 0);
+}
+
+void WorkQueue::Start(int thread_num, int max_pending) {
+  max_pending_ = max_pending;
+  running_ = 0;
+  sequence_ = 0;
+  stopping_ = false;
+  pthread_mutex_init(&mutex_, NULL);
+  pthread_cond_init(&item_ready_, NULL);
+  pthread_cond_init(&slot_free_, NULL);
+  pthread_cond_init(&all_done_, NULL);
+  if (thread_num < 1)
+    thread_num = 1;
+  for (int i = 0; i < thread_num; ++i) {
+    pthread_t thread;
+    if (0 == pthread_create(&thread, NULL, WorkerMain, this))
+      threads_.push_back(thread);
+  }
+}
+
+WorkQueue::~WorkQueue() {
+  pthread_mutex_lock(&mutex_);
+  stopping_ = true;
+  pthread_cond_broadcast(&item_ready_);
+  pthread_mutex_unlock(&mutex_);
+  for (int i = 0; i < static_cast<int>(threads_.size()); ++i) {
+    pthread_join(threads_[i], NULL);
+  }
+  pthread_cond_destroy(&all_done_);
+  pthread_cond_destroy(&slot_free_);
+  pthread_cond_destroy(&item_ready_);
+  pthread_mutex_destroy(&mutex_);
+}
+
+void WorkQueue::Push(WorkItem* item, int priority) {
+  if (NULL == item)
+    return;
+  pthread_mutex_lock(&mutex_);
+  while ((max_pending_ > 0) &&
+         (static_cast<int>(items_.size()) >= max_pending_)) {
+    pthread_cond_wait(&slot_free_, &mutex_);
+  }
+  items_.push(Entry(item, priority, sequence_++));
+  pthread_cond_signal(&item_ready_);
+  pthread_mutex_unlock(&mutex_);
+}
+
+void WorkQueue::Wait() {
+  pthread_mutex_lock(&mutex_);
+  while (!items_.empty() || (running_ > 0)) {
+    pthread_cond_wait(&all_done_, &mutex_);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
+
+void* WorkQueue::WorkerMain(void* arg) {
+  static_cast<WorkQueue*>(arg)->WorkerLoop();
+  return NULL;
+}
+
+void WorkQueue::WorkerLoop() {
+  pthread_mutex_lock(&mutex_);
+  while (true) {
+    while (items_.empty() && !stopping_) {
+      pthread_cond_wait(&item_ready_, &mutex_);
+    }
+    // Drain the queue before stopping.
+    if (items_.empty())
+      break;
+    WorkItem* item = items_.top().item_;
+    items_.pop();
+    ++running_;
+    pthread_cond_signal(&slot_free_);
+    pthread_mutex_unlock(&mutex_);
+    item->Run();
+    delete item;
+    pthread_mutex_lock(&mutex_);
+    --running_;
+    if (items_.empty() && (0 == running_))
+      pthread_cond_broadcast(&all_done_);
+  }
+  pthread_mutex_unlock(&mutex_);
+}
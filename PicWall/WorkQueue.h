@@ -0,0 +1,82 @@
+//
+//  WorkQueue.h
+//  image-browser
+//
+//  A fixed-size pool of pthread workers consuming a bounded priority queue.
+//
+
+#ifndef __image_browser__WorkQueue__
+#define __image_browser__WorkQueue__
+
+#include <queue>
+#include <vector>
+#include <pthread.h>
+
+// A unit of work executed by WorkQueue.
+class WorkItem {
+public:
+  virtual ~WorkItem() {}
+  virtual void Run() = 0;
+};
+
+class WorkQueue {
+public:
+  // thread_num: number of worker threads (at least 1).
+  // max_pending: Push() blocks while this many items wait to be run.
+  // 0 means unbounded.
+  WorkQueue(int thread_num, int max_pending);
+  explicit WorkQueue(int thread_num);
+  // Runs the remaining items, then stops and joins the workers.
+  ~WorkQueue();
+  
+  // Queue an item. The queue takes ownership and deletes it after Run().
+  // Items with a higher priority run first; equal priorities run in FIFO
+  // order.
+  void Push(WorkItem* item, int priority);
+  void Push(WorkItem* item) {
+    Push(item, 0);
+  }
+  // Block until every pushed item has finished.
+  void Wait();
+  
+  int thread_num() const {
+    return static_cast<int>(threads_.size());
+  }
+  
+private:
+  class Entry {
+  public:
+    Entry(WorkItem* item, int priority, long sequence)
+    : item_(item), priority_(priority), sequence_(sequence) {}
+    // Lower priority, or same priority pushed later, runs later.
+    bool operator< (const Entry& other) const {
+      if (priority_ != other.priority_)
+        return priority_ < other.priority_;
+      return sequence_ > other.sequence_;
+    }
+    WorkItem* item_;
+    int priority_;
+    long sequence_;
+  };
+  
+  void Start(int thread_num, int max_pending);
+  static void* WorkerMain(void* arg);
+  void WorkerLoop();
+  
+  std::vector<pthread_t> threads_;
+  std::priority_queue<Entry> items_;
+  long sequence_;          // Push counter for FIFO order within a priority.
+  int max_pending_;
+  int running_;            // Items taken by a worker but not finished.
+  bool stopping_;
+  pthread_mutex_t mutex_;
+  pthread_cond_t item_ready_;
+  pthread_cond_t slot_free_;
+  pthread_cond_t all_done_;
+  
+  // Disallow copy and assign.
+  void operator= (const WorkQueue&);
+  WorkQueue(const WorkQueue&);
+};
+
+#endif /* defined(__image_browser__WorkQueue__) */
@@ -0,0 +1,155 @@
+//
+//  picwall_batch.cpp
+//  image-browser
+//
+//  Command-line batch renderer:
+//    picwall_batch [-j threads] [-t tonal_texture] [-c tile_cache]
+//                  [-x thumbnail_index] [-L lightbox_size] [-Q quality] [-W]
+//                  [-S strip_height] [-B] [-A asset_dir] [-Z gzip|br]
+//                  [-z zoom_scale] [-F] [-T trace_dir] [-D debug_image_dir] [-v]
+//                  [-r report] manifest
+//
+
+#include "BatchRenderer.h"
+#include "ImageStore.h"
+#include "Log.h"
+#include "ThumbnailIndex.h"
+#include "TileCache.h"
+#include "Trace.h"
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+namespace {
+
+void PrintUsage(const char* name) {
+  std::cout << "usage: " << name
+            << " [-j threads] [-t tonal_texture] [-c tile_cache] [-x thumbnail_index]"
+            << " [-L lightbox_size] [-Q quality] [-W] [-S strip_height] [-B]"
+            << " [-A asset_dir] [-Z gzip|br] [-z zoom_scale] [-F] [-T trace_dir]"
+            << " [-D debug_image_dir] [-v] [-r report] manifest"
+            << std::endl;
+  std::cout << "manifest lines: <image_list> <width> <height> <style> <output> [border]"
+            << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  long cpu_num = sysconf(_SC_NPROCESSORS_ONLN);
+  int thread_num = (cpu_num > 0) ? static_cast<int>(cpu_num) : 1;
+  std::string tonal_path;
+  std::string tile_cache_path;
+  std::string index_path;
+  HtmlOptions html_options;
+  DeepZoomOptions zoom_options;
+  bool crop_fit = false;
+  std::string trace_dir;
+  std::string report_path;
+  std::string manifest_path;
+  for (int i = 1; i < argc; ++i) {
+    if ((0 == strcmp(argv[i], "-j")) && (i + 1 < argc)) {
+      thread_num = atoi(argv[++i]);
+    } else if ((0 == strcmp(argv[i], "-t")) && (i + 1 < argc)) {
+      tonal_path = argv[++i];
+    } else if ((0 == strcmp(argv[i], "-c")) && (i + 1 < argc)) {
+      tile_cache_path = argv[++i];
+    } else if ((0 == strcmp(argv[i], "-x")) && (i + 1 < argc)) {
+      index_path = argv[++i];
+    } else if ((0 == strcmp(argv[i], "-L")) && (i + 1 < argc)) {
+      html_options.lightbox_size_ = atoi(argv[++i]);
+    } else if ((0 == strcmp(argv[i], "-Q")) && (i + 1 < argc)) {
+      html_options.quality_ = atoi(argv[++i]);
+    } else if (0 == strcmp(argv[i], "-W")) {
+      html_options.webp_ = true;
+    } else if ((0 == strcmp(argv[i], "-S")) && (i + 1 < argc)) {
+      html_options.sprite_ = true;
+      html_options.strip_height_ = atoi(argv[++i]);
+    } else if (0 == strcmp(argv[i], "-B")) {
+      html_options.bundle_ = true;
+    } else if ((0 == strcmp(argv[i], "-A")) && (i + 1 < argc)) {
+      html_options.asset_dir_ = argv[++i];
+    } else if ((0 == strcmp(argv[i], "-z")) && (i + 1 < argc)) {
+      zoom_options.scale_ = static_cast<float>(atof(argv[++i]));
+    } else if (0 == strcmp(argv[i], "-F")) {
+      crop_fit = true;
+    } else if ((0 == strcmp(argv[i], "-Z")) && (i + 1 < argc)) {
+      std::string compression = argv[++i];
+      if ("gzip" == compression) {
+        html_options.compression_ = HTML_GZIP;
+      } else if ("br" == compression) {
+        html_options.compression_ = HTML_BROTLI;
+      } else {
+        PrintUsage(argv[0]);
+        return 2;
+      }
+    } else if ((0 == strcmp(argv[i], "-T")) && (i + 1 < argc)) {
+      trace_dir = argv[++i];
+    } else if ((0 == strcmp(argv[i], "-D")) && (i + 1 < argc)) {
+      Log::set_debug_image_dir(argv[++i]);
+    } else if (0 == strcmp(argv[i], "-v")) {
+      Log::set_level(LOG_DEBUG);
+    } else if ((0 == strcmp(argv[i], "-r")) && (i + 1 < argc)) {
+      report_path = argv[++i];
+    } else if (manifest_path.empty() && ('-' != argv[i][0])) {
+      manifest_path = argv[i];
+    } else {
+      PrintUsage(argv[0]);
+      return 2;
+    }
+  }
+  if (manifest_path.empty() || (thread_num < 1) || (zoom_options.scale_ <= 0) ||
+      (html_options.quality_ < 1) || (html_options.quality_ > 100)) {
+    PrintUsage(argv[0]);
+    return 2;
+  }
+  zoom_options.quality_ = html_options.quality_;
+  zoom_options.webp_ = html_options.webp_;
+  
+  if (!tile_cache_path.empty() &&
+      !TileCache::Instance()->set_directory(tile_cache_path))
+    return 2;
+  if (!index_path.empty()) {
+    cv::Ptr<ThumbnailIndex> index = new ThumbnailIndex();
+    if (!index->Open(index_path)) {
+      std::cout << "error: cannot open thumbnail index " << index_path << std::endl;
+      return 2;
+    }
+    ImageStore::Instance()->set_index(index);
+  }
+  
+  std::vector<BatchJob> jobs;
+  if (!ReadManifest(manifest_path, &jobs))
+    return 2;
+  // With -T, every job writes <trace_dir>/job_<manifest line>.json.
+  Trace::set_enabled(!trace_dir.empty());
+  for (int i = 0; i < static_cast<int>(jobs.size()); ++i) {
+    jobs[i].tonal_path_ = tonal_path;
+    jobs[i].html_options_ = html_options;
+    jobs[i].zoom_options_ = zoom_options;
+    jobs[i].crop_fit_ = crop_fit;
+    if (!trace_dir.empty()) {
+      std::ostringstream trace_path;
+      trace_path << trace_dir << "/job_" << jobs[i].line_ << ".json";
+      jobs[i].trace_path_ = trace_path.str();
+    }
+  }
+  
+  int64 start = cv::getTickCount();
+  int failed = RunBatch(&jobs, thread_num);
+  double wall_ms = (cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency();
+  
+  if (report_path.empty()) {
+    WriteBatchReport(jobs, wall_ms, std::cout);
+  } else {
+    std::ofstream report(report_path.c_str());
+    if (!report.is_open()) {
+      std::cout << "error: cannot write report " << report_path << std::endl;
+      return 2;
+    }
+    WriteBatchReport(jobs, wall_ms, report);
+  }
+  return (0 == failed) ? 0 : 1;
+}
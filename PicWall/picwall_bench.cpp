@@ -0,0 +1,363 @@
+//
+//  picwall_bench.cpp
+//  image-browser
+//
+//  Benchmarks for the style engines and the collage layout solver:
+//    picwall_bench [-i image] [-t tonal_texture] [-s sizes] [-n image_nums]
+//                  [-r repeats] [-b engines|layout|all] [-o output]
+//
+//  Results are JSON lines, one per benchmark and size:
+//    {"bench":"manga","size":512,"repeats":5,"mean_ms":..,"p50_ms":..,
+//     "p90_ms":..,"p99_ms":..,"min_ms":..,"max_ms":..,"per_s":..,
+//     "max_rss_kb":..}
+//  per_s is megapixels per second for engines, images per second for the
+//  layout and edits per second for relayout (AddImages + RemoveImages of one
+//  image). The weights case reports the canvas share of one image of
+//  weight BENCH_WEIGHT, with and without SetImageWeight():
+//    {"bench":"weights","images":100,"repeats":5,"weight":10,
+//     "target_share":..,"weighted_share":..,"unweighted_share":..}
+//
+
+#include "CartoonEngine.h"
+#include "CoherentLine.h"
+#include "Collage.h"
+#include "MangaEngine.h"
+#include "SketchEngine.h"
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#define BENCH_WEIGHT 10.0  // Weight of the starred image in the weights case.
+
+namespace {
+
+double ElapsedMs(int64 start) {
+  return (cv::getTickCount() - start) * 1000.0 / cv::getTickFrequency();
+}
+
+long MaxRssKb() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+  return usage.ru_maxrss / 1024;  // Bytes on Mac OS X.
+#else
+  return usage.ru_maxrss;         // Kilobytes on Linux.
+#endif
+}
+
+std::vector<int> ParseList(const char* arg) {
+  std::vector<int> values;
+  std::stringstream list(arg);
+  std::string item;
+  while (std::getline(list, item, ',')) {
+    int value = atoi(item.c_str());
+    if (value > 0)
+      values.push_back(value);
+  }
+  return values;
+}
+
+// Nearest-rank percentile of sorted times.
+double Percentile(const std::vector<double>& sorted, double p) {
+  int rank = static_cast<int>(ceil(p * sorted.size())) - 1;
+  rank = std::max(0, std::min(rank, static_cast<int>(sorted.size()) - 1));
+  return sorted[rank];
+}
+
+void Report(std::ostream& out,
+            const std::string& bench,
+            const char* size_key,
+            int size,
+            std::vector<double> times,
+            double units,
+            int failures) {
+  if (times.empty())
+    return;
+  std::sort(times.begin(), times.end());
+  double sum = 0;
+  for (int i = 0; i < static_cast<int>(times.size()); ++i) {
+    sum += times[i];
+  }
+  double mean = sum / times.size();
+  out << "{\"bench\":\"" << bench << "\""
+      << ",\"" << size_key << "\":" << size
+      << ",\"repeats\":" << times.size()
+      << ",\"failures\":" << failures
+      << ",\"mean_ms\":" << mean
+      << ",\"p50_ms\":" << Percentile(times, 0.5)
+      << ",\"p90_ms\":" << Percentile(times, 0.9)
+      << ",\"p99_ms\":" << Percentile(times, 0.99)
+      << ",\"min_ms\":" << times.front()
+      << ",\"max_ms\":" << times.back()
+      << ",\"per_s\":" << ((mean > 0) ? units * 1000.0 / mean : 0)
+      << ",\"max_rss_kb\":" << MaxRssKb()
+      << "}" << std::endl;
+}
+
+// Deterministic test photo: smooth gradients, shapes and noise, so the
+// edge and tone stages see realistic structure.
+cv::Mat SyntheticImage(int size) {
+  cv::Mat image(size * 3 / 4, size, CV_8UC3);
+  cv::RNG rng(20130528);
+  for (int r = 0; r < image.rows; ++r) {
+    cv::Vec3b* row = image.ptr<cv::Vec3b>(r);
+    for (int c = 0; c < image.cols; ++c) {
+      row[c] = cv::Vec3b(static_cast<uchar>(255 * r / image.rows),
+                         static_cast<uchar>(255 * c / image.cols),
+                         128);
+    }
+  }
+  for (int i = 0; i < 40; ++i) {
+    cv::Point center(rng.uniform(0, image.cols), rng.uniform(0, image.rows));
+    cv::Scalar color(rng.uniform(0, 256), rng.uniform(0, 256), rng.uniform(0, 256));
+    int radius = rng.uniform(size / 40 + 1, size / 6 + 2);
+    if (i % 2)
+      cv::circle(image, center, radius, color, -1);
+    else
+      cv::rectangle(image, center, center + cv::Point(radius, radius / 2), color, -1);
+  }
+  cv::Mat noise(image.size(), CV_8UC3);
+  rng.fill(noise, cv::RNG::NORMAL, cv::Scalar::all(0), cv::Scalar::all(12));
+  cv::add(image, noise, image);
+  return image;
+}
+
+// Deterministic pencil stroke texture for SketchEngine.
+cv::Mat SyntheticTonal() {
+  cv::Mat tonal(256, 256, CV_8UC1, cv::Scalar::all(255));
+  cv::RNG rng(1);
+  for (int i = 0; i < 600; ++i) {
+    cv::Point start(rng.uniform(-64, 256), rng.uniform(0, 256));
+    cv::Point end = start + cv::Point(rng.uniform(48, 128), rng.uniform(-24, 24));
+    cv::line(tonal, start, end, cv::Scalar::all(rng.uniform(80, 200)), 1, CV_AA);
+  }
+  return tonal;
+}
+
+// Aspect ratios of a typical photo album: mostly 4:3 and 3:2 in both
+// orientations, some squares and a few panoramas, all jittered.
+std::vector<cv::Size2i> SyntheticSizes(int image_num, cv::RNG& rng) {
+  static const float alphas[] = {4.0f / 3, 3.0f / 4, 3.0f / 2, 2.0f / 3,
+                                 16.0f / 9, 1.0f, 3.0f};
+  std::vector<cv::Size2i> sizes;
+  for (int i = 0; i < image_num; ++i) {
+    float alpha = alphas[rng.uniform(0, 7)] * rng.uniform(0.95f, 1.05f);
+    sizes.push_back(cv::Size2i(cvRound(1000 * alpha), 1000));
+  }
+  return sizes;
+}
+
+void BenchEngines(const cv::Mat& source,
+                  const cv::Mat& tonal,
+                  const std::vector<int>& sizes,
+                  int repeats,
+                  std::ostream& out) {
+  for (int s = 0; s < static_cast<int>(sizes.size()); ++s) {
+    // size is the longer side.
+    double scale = static_cast<double>(sizes[s]) / std::max(source.rows, source.cols);
+    cv::Mat image;
+    cv::resize(source, image, cv::Size(), scale, scale, cv::INTER_AREA);
+    double mpix = image.total() / 1e6;
+    std::vector<double> etf, fdog, manga, sketch, cartoon, painting;
+    int64 start = 0;
+    for (int i = 0; i < repeats; ++i) {
+      {
+        start = cv::getTickCount();
+        CoherentLine cl(image);
+        cl.etf();
+        etf.push_back(ElapsedMs(start));
+        start = cv::getTickCount();
+        cl.fdog_edge();
+        fdog.push_back(ElapsedMs(start));
+      }
+      {
+        start = cv::getTickCount();
+        MangaEngine engine(image);
+        engine.set_fixed_point(true);
+        engine.Convert2Manga();
+        manga.push_back(ElapsedMs(start));
+      }
+      {
+        start = cv::getTickCount();
+        SketchEngine engine(image, tonal);
+        engine.Convert2Sketch();
+        sketch.push_back(ElapsedMs(start));
+      }
+      {
+        start = cv::getTickCount();
+        CartoonEngine engine(image);
+        engine.Convert2Cartoon();
+        cartoon.push_back(ElapsedMs(start));
+      }
+      {
+        start = cv::getTickCount();
+        CartoonEngine engine(image);
+        engine.Convert2Painting();
+        painting.push_back(ElapsedMs(start));
+      }
+    }
+    Report(out, "etf", "size", sizes[s], etf, mpix, 0);
+    Report(out, "fdog", "size", sizes[s], fdog, mpix, 0);
+    Report(out, "manga", "size", sizes[s], manga, mpix, 0);
+    Report(out, "sketch", "size", sizes[s], sketch, mpix, 0);
+    Report(out, "cartoon", "size", sizes[s], cartoon, mpix, 0);
+    Report(out, "painting", "size", sizes[s], painting, mpix, 0);
+  }
+}
+
+// Canvas share of the leaf of path.
+double AreaShare(const CollageAdvanced& collage, const std::string& path) {
+  FloatRect position;
+  if (!collage.LeafPosition(path, &position))
+    return 0;
+  return position.width_ * position.height_ /
+         (static_cast<double>(collage.canvas_width()) * collage.canvas_height());
+}
+
+// Canvas share of one image with weight BENCH_WEIGHT among images of
+// weight 1, against the same layout without weights and against its share
+// of the total weight.
+void BenchWeights(int image_num, int repeats, cv::RNG& rng, std::ostream& out) {
+  std::vector<std::string> paths;
+  for (int i = 0; i < image_num; ++i) {
+    std::ostringstream path;
+    path << "synthetic/" << i << ".jpg";
+    paths.push_back(path.str());
+  }
+  double weighted_sum = 0;
+  double unweighted_sum = 0;
+  int runs = 0;
+  for (int i = 0; i < repeats; ++i) {
+    std::vector<cv::Size2i> sizes = SyntheticSizes(image_num, rng);
+    CollageAdvanced unweighted(paths, sizes);
+    CollageAdvanced weighted(paths, sizes);
+    weighted.SetImageWeight(paths[0], BENCH_WEIGHT);
+    if (!unweighted.CreateCollage() || !weighted.CreateCollage())
+      continue;
+    unweighted_sum += AreaShare(unweighted, paths[0]);
+    weighted_sum += AreaShare(weighted, paths[0]);
+    ++runs;
+  }
+  if (0 == runs)
+    return;
+  out << "{\"bench\":\"weights\""
+      << ",\"images\":" << image_num
+      << ",\"repeats\":" << runs
+      << ",\"weight\":" << BENCH_WEIGHT
+      << ",\"target_share\":" << BENCH_WEIGHT / (BENCH_WEIGHT + image_num - 1)
+      << ",\"weighted_share\":" << weighted_sum / runs
+      << ",\"unweighted_share\":" << unweighted_sum / runs
+      << "}" << std::endl;
+}
+
+void BenchLayout(const std::vector<int>& image_nums,
+                 int repeats,
+                 std::ostream& out) {
+  cv::RNG rng(42);
+  for (int n = 0; n < static_cast<int>(image_nums.size()); ++n) {
+    int image_num = image_nums[n];
+    std::vector<std::string> paths;
+    for (int i = 0; i < image_num; ++i) {
+      std::ostringstream path;
+      path << "synthetic/" << i << ".jpg";
+      paths.push_back(path.str());
+    }
+    // Large sets take seconds per layout; one run is enough there.
+    int layout_repeats = (image_num >= 10000) ? 1 : repeats;
+    std::vector<double> times;
+    std::vector<double> relayout_times;
+    int failures = 0;
+    int relayout_failures = 0;
+    for (int i = 0; i < layout_repeats; ++i) {
+      std::vector<cv::Size2i> sizes = SyntheticSizes(image_num, rng);
+      CollageAdvanced collage(paths, sizes);
+      int64 start = cv::getTickCount();
+      if (!collage.CreateCollage()) {
+        ++failures;
+        times.push_back(ElapsedMs(start));
+        continue;
+      }
+      times.push_back(ElapsedMs(start));
+      // Interactive edit: add one image, then remove it again.
+      std::vector<std::string> added(1, "synthetic/added.jpg");
+      std::vector<cv::Size2i> added_sizes = SyntheticSizes(1, rng);
+      start = cv::getTickCount();
+      if (!collage.AddImages(added, added_sizes) || !collage.RemoveImages(added))
+        ++relayout_failures;
+      relayout_times.push_back(ElapsedMs(start));
+    }
+    Report(out, "layout", "images", image_num, times, image_num, failures);
+    Report(out, "relayout", "images", image_num, relayout_times, 2, relayout_failures);
+    if (image_num <= 10000)
+      BenchWeights(image_num, layout_repeats, rng, out);
+  }
+}
+
+void PrintUsage(const char* name) {
+  std::cout << "usage: " << name
+            << " [-i image] [-t tonal_texture] [-s sizes] [-n image_nums]"
+            << " [-r repeats] [-b engines|layout|all] [-o output]" << std::endl;
+  std::cout << "defaults: -s 256,512,1024 -n 10,100,1000,10000,100000 -r 5 -b all"
+            << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  std::string image_path;
+  std::string tonal_path;
+  std::string bench = "all";
+  std::string output_path;
+  std::vector<int> sizes = ParseList("256,512,1024");
+  std::vector<int> image_nums = ParseList("10,100,1000,10000,100000");
+  int repeats = 5;
+  for (int i = 1; i < argc; ++i) {
+    if ((0 == strcmp(argv[i], "-i")) && (i + 1 < argc)) {
+      image_path = argv[++i];
+    } else if ((0 == strcmp(argv[i], "-t")) && (i + 1 < argc)) {
+      tonal_path = argv[++i];
+    } else if ((0 == strcmp(argv[i], "-s")) && (i + 1 < argc)) {
+      sizes = ParseList(argv[++i]);
+    } else if ((0 == strcmp(argv[i], "-n")) && (i + 1 < argc)) {
+      image_nums = ParseList(argv[++i]);
+    } else if ((0 == strcmp(argv[i], "-r")) && (i + 1 < argc)) {
+      repeats = atoi(argv[++i]);
+    } else if ((0 == strcmp(argv[i], "-b")) && (i + 1 < argc)) {
+      bench = argv[++i];
+    } else if ((0 == strcmp(argv[i], "-o")) && (i + 1 < argc)) {
+      output_path = argv[++i];
+    } else {
+      PrintUsage(argv[0]);
+      return 2;
+    }
+  }
+  if ((repeats < 1) ||
+      (("engines" != bench) && ("layout" != bench) && ("all" != bench))) {
+    PrintUsage(argv[0]);
+    return 2;
+  }
+
+  cv::Mat image = image_path.empty() ? SyntheticImage(1024) : cv::imread(image_path, 1);
+  cv::Mat tonal = tonal_path.empty() ? SyntheticTonal() : cv::imread(tonal_path, 0);
+  if (image.empty() || tonal.empty()) {
+    std::cout << "error: cannot read benchmark images" << std::endl;
+    return 2;
+  }
+  std::ofstream output_file;
+  if (!output_path.empty()) {
+    output_file.open(output_path.c_str());
+    if (!output_file.is_open()) {
+      std::cout << "error: cannot write " << output_path << std::endl;
+      return 2;
+    }
+  }
+  std::ostream& out = output_path.empty() ? std::cout : output_file;
+
+  if (("engines" == bench) || ("all" == bench))
+    BenchEngines(image, tonal, sizes, repeats, out);
+  if (("layout" == bench) || ("all" == bench))
+    BenchLayout(image_nums, repeats, out);
+  return 0;
+}
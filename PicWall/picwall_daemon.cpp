@@ -0,0 +1,143 @@
+//
+//  picwall_daemon.cpp
+//  image-browser
+//
+//  Render service keeping decoded images and textures warm:
+//    picwall_daemon [-s socket] [-j threads] [-m cache_mb] [-t tonal_texture]
+//                   [-c tile_cache] [-x thumbnail_index] [-L lightbox_size]
+//                   [-Q quality] [-W] [-S strip_height] [-B] [-A asset_dir]
+//                   [-Z gzip|br] [-z zoom_scale] [-F] [-T trace_dir]
+//                   [-D debug_image_dir] [-v]
+//
+
+#include "ImageStore.h"
+#include "RenderServer.h"
+#include "Log.h"
+#include "ThumbnailIndex.h"
+#include "TileCache.h"
+#include "Trace.h"
+#include <iostream>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#define DEFAULT_SOCKET_PATH "/tmp/picwall.sock"
+
+namespace {
+
+RenderServer* g_server = NULL;
+
+void HandleSignal(int) {
+  if (NULL != g_server)
+    g_server->Stop();
+}
+
+void PrintUsage(const char* name) {
+  std::cout << "usage: " << name
+            << " [-s socket] [-j threads] [-m cache_mb] [-t tonal_texture]"
+            << " [-c tile_cache] [-x thumbnail_index] [-L lightbox_size]"
+            << " [-Q quality] [-W] [-S strip_height] [-B] [-A asset_dir]"
+            << " [-Z gzip|br] [-z zoom_scale] [-F] [-T trace_dir] [-D debug_image_dir] [-v]"
+            << std::endl;
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  long cpu_num = sysconf(_SC_NPROCESSORS_ONLN);
+  int thread_num = (cpu_num > 0) ? static_cast<int>(cpu_num) : 1;
+  int cache_mb = IMAGE_STORE_BUDGET >> 20;
+  std::string socket_path = DEFAULT_SOCKET_PATH;
+  std::string tonal_path;
+  std::string tile_cache_path;
+  std::string index_path;
+  HtmlOptions html_options;
+  DeepZoomOptions zoom_options;
+  bool crop_fit = false;
+  std::string trace_dir;
+  for (int i = 1; i < argc; ++i) {
+    if ((0 == strcmp(argv[i], "-s")) && (i + 1 < argc)) {
+      socket_path = argv[++i];
+    } else if ((0 == strcmp(argv[i], "-j")) && (i + 1 < argc)) {
+      thread_num = atoi(argv[++i]);
+    } else if ((0 == strcmp(argv[i], "-m")) && (i + 1 < argc)) {
+      cache_mb = atoi(argv[++i]);
+    } else if ((0 == strcmp(argv[i], "-t")) && (i + 1 < argc)) {
+      tonal_path = argv[++i];
+    } else if ((0 == strcmp(argv[i], "-c")) && (i + 1 < argc)) {
+      tile_cache_path = argv[++i];
+    } else if ((0 == strcmp(argv[i], "-x")) && (i + 1 < argc)) {
+      index_path = argv[++i];
+    } else if ((0 == strcmp(argv[i], "-L")) && (i + 1 < argc)) {
+      html_options.lightbox_size_ = atoi(argv[++i]);
+    } else if ((0 == strcmp(argv[i], "-Q")) && (i + 1 < argc)) {
+      html_options.quality_ = atoi(argv[++i]);
+    } else if (0 == strcmp(argv[i], "-W")) {
+      html_options.webp_ = true;
+    } else if ((0 == strcmp(argv[i], "-S")) && (i + 1 < argc)) {
+      html_options.sprite_ = true;
+      html_options.strip_height_ = atoi(argv[++i]);
+    } else if (0 == strcmp(argv[i], "-B")) {
+      html_options.bundle_ = true;
+    } else if ((0 == strcmp(argv[i], "-A")) && (i + 1 < argc)) {
+      html_options.asset_dir_ = argv[++i];
+    } else if ((0 == strcmp(argv[i], "-z")) && (i + 1 < argc)) {
+      zoom_options.scale_ = static_cast<float>(atof(argv[++i]));
+    } else if (0 == strcmp(argv[i], "-F")) {
+      crop_fit = true;
+    } else if ((0 == strcmp(argv[i], "-Z")) && (i + 1 < argc)) {
+      std::string compression = argv[++i];
+      if ("gzip" == compression) {
+        html_options.compression_ = HTML_GZIP;
+      } else if ("br" == compression) {
+        html_options.compression_ = HTML_BROTLI;
+      } else {
+        PrintUsage(argv[0]);
+        return 2;
+      }
+    } else if ((0 == strcmp(argv[i], "-T")) && (i + 1 < argc)) {
+      trace_dir = argv[++i];
+    } else if ((0 == strcmp(argv[i], "-D")) && (i + 1 < argc)) {
+      Log::set_debug_image_dir(argv[++i]);
+    } else if (0 == strcmp(argv[i], "-v")) {
+      Log::set_level(LOG_DEBUG);
+    } else {
+      PrintUsage(argv[0]);
+      return 2;
+    }
+  }
+  if ((thread_num < 1) || (cache_mb < 0) || (zoom_options.scale_ <= 0) ||
+      (html_options.quality_ < 1) || (html_options.quality_ > 100)) {
+    PrintUsage(argv[0]);
+    return 2;
+  }
+  zoom_options.quality_ = html_options.quality_;
+  zoom_options.webp_ = html_options.webp_;
+  ImageStore::Instance()->set_budget(static_cast<size_t>(cache_mb) << 20);
+  if (!tile_cache_path.empty() &&
+      !TileCache::Instance()->set_directory(tile_cache_path))
+    return 2;
+  if (!index_path.empty()) {
+    cv::Ptr<ThumbnailIndex> index = new ThumbnailIndex();
+    if (!index->Open(index_path)) {
+      std::cout << "error: cannot open thumbnail index " << index_path << std::endl;
+      return 2;
+    }
+    ImageStore::Instance()->set_index(index);
+  }
+  
+  RenderServer server(socket_path, thread_num);
+  server.set_tonal_path(tonal_path);
+  server.set_html_options(html_options);
+  server.set_zoom_options(zoom_options);
+  server.set_crop_fit(crop_fit);
+  server.set_trace_dir(trace_dir);
+  Trace::set_enabled(!trace_dir.empty());
+  g_server = &server;
+  signal(SIGINT, HandleSignal);
+  signal(SIGTERM, HandleSignal);
+  // A client hanging up before its answer must not kill the service.
+  signal(SIGPIPE, SIG_IGN);
+  std::cout << "picwall_daemon listening on " << socket_path << std::endl;
+  return server.Serve() ? 0 : 1;
+}